@@ -34,9 +34,29 @@ static DBusHandlerResult error_callback(DBusConnection * connection,
 					DBusMessage * message, void *user_data);
 
 static struct tor_method_callbacks callbacks[] = {
-	{"Start", &start_callback},
-	{"Stop", &stop_callback},
-	{"GetStatus", &getstatus_callback},
+	{ICD_TOR_METHOD_START, &start_callback},
+	{ICD_TOR_METHOD_STARTANDWAIT, &startandwait_callback},
+	{ICD_TOR_METHOD_STOP, &stop_callback},
+	{ICD_TOR_METHOD_GETSTATUS, &getstatus_callback},
+	{ICD_TOR_METHOD_GETBOOTSTRAPPROGRESS, &getbootstrapprogress_callback},
+	{ICD_TOR_METHOD_PRESTART, &prestart_callback},
+	{ICD_TOR_METHOD_GETTIMINGS, &gettimings_callback},
+	{ICD_TOR_METHOD_GETSTARTSTATS, &getstartstats_callback},
+	{ICD_TOR_METHOD_DUMPTRACE, &dumptrace_callback},
+	{ICD_TOR_METHOD_GETSIGNALCOUNTERS, &getsignalcounters_callback},
+	{ICD_TOR_METHOD_GETWARMUPSTATS, &getwarmupstats_callback},
+	{ICD_TOR_METHOD_ADDONION, &addonion_callback},
+	{ICD_TOR_METHOD_REMOVEONION, &removeonion_callback},
+	{ICD_TOR_METHOD_GETDORMANTSTATS, &getdormantstats_callback},
+
+	{NULL,}
+};
+
+/* org.freedesktop.DBus.Properties */
+static struct tor_method_callbacks properties_callbacks[] = {
+	{"Get", &properties_get_callback},
+	{"GetAll", &properties_getall_callback},
+	{"Set", &properties_set_callback},
 
 	{NULL,}
 };
@@ -58,15 +78,33 @@ static DBusHandlerResult tor_icd_dbus_api_request(DBusConnection * connection,
 
 	TN_DEBUG("ICD2 Tor dbus api request\n");
 
+	const char *interface = dbus_message_get_interface(message);
 	const char *member = dbus_message_get_member(message);
+	struct tor_method_callbacks *table;
+
+	/* Calls without an interface go to ours */
+	if (interface == NULL || strcmp(interface, ICD_TOR_DBUS_INTERFACE) == 0) {
+		table = callbacks;
+	} else if (strcmp(interface, DBUS_INTERFACE_PROPERTIES) == 0) {
+		table = properties_callbacks;
+	} else {
+		DBusMessage *err_msg = dbus_message_new_error(message, DBUS_ERROR_UNKNOWN_INTERFACE,
+							      "Unknown interface");
+		if (err_msg == NULL)
+			return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+		icd_dbus_send_system_msg(err_msg);
+		dbus_message_unref(err_msg);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
 
 	int i = 0;
 
-	while (callbacks[i].method_name != NULL) {
-		if (strcmp(member, callbacks[i].method_name) == 0) {
+	while (table[i].method_name != NULL) {
+		if (strcmp(member, table[i].method_name) == 0) {
 			TN_DEBUG("Match for method %s", member);
-			return callbacks[i].call(connection, message,
-						 user_data);
+			return table[i].call(connection, message,
+					     user_data);
 		}
 
 		i++;
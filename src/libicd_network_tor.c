@@ -21,19 +21,36 @@
 
 #include "libicd_network_tor.h"
 
+/* Have ICd close the network, with the transitions leading up to it logged */
+static void close_network_error(network_tor_private * private, tor_network_data * network_data, const char *reason)
+{
+	TN_ERR("Closing network: %s", reason);
+	trace_log(private);
+
+	private->close_cb(ICD_NW_ERROR, reason, network_data->network_type, network_data->network_attrs,
+			  network_data->network_id);
+}
+
 void tor_state_change(network_tor_private * private,
 		      tor_network_data * network_data, network_tor_state new_state, int source)
 {
-	network_tor_state current_state = private->state;
+	/* Without network_data, this is a change for all IAPs */
+	network_tor_state current_state = network_data ? network_data->state : private->state;
+	tor_trace_entry *trace;
+	guint32 session_id;
 
-	if (source == EVENT_SOURCE_IP_UP) {
-		if (current_state.iap_connected) {
-			TN_ERR("ip_up called when we are already connected\n");
-			/* Figure out how to handle this */
-		}
+	trace = trace_begin(private, network_data, &current_state, source);
+	timeline_event(network_data, source);
+
+	/* Lets the provider tell signals of this start from stale ones */
+	if (source == EVENT_SOURCE_IP_UP || source == EVENT_SOURCE_DBUS_CALL_START)
+		network_data->session_id = ++private->last_session_id;
+	/* network_data may be freed before the signal goes out */
+	session_id = network_data ? network_data->session_id : 0;
 
+	if (source == EVENT_SOURCE_IP_UP) {
 		/* Add network to network_data */
-		private->network_data_list = g_slist_prepend(private->network_data_list, network_data);
+		network_index_add(network_data);
 
 		if (new_state.service_provider_mode) {
 			/* Return right away, wait for dbus calls */
@@ -73,12 +90,13 @@ void tor_state_change(network_tor_private * private,
 			}
 		}
 
-		emit_status_signal(new_state);
+		emit_status_signal(private, session_id, new_state);
 	} else if (source == EVENT_SOURCE_IP_DOWN) {
 		icd_nw_ip_down_cb_fn down_cb = network_data->ip_down_cb;
 		gpointer down_token = network_data->ip_down_cb_token;
 
-		/* Stop Tor etc, free network data */
+		/* Stop Tor etc (or keep it warm), free network data */
+		network_park_tor(network_data);
 		network_stop_all(network_data);
 		network_free_all(network_data);
 
@@ -90,56 +108,103 @@ void tor_state_change(network_tor_private * private,
 
 		down_cb(ICD_NW_SUCCESS, down_token);
 
-		emit_status_signal(new_state);
-	} else if (source == EVENT_SOURCE_GCONF_CHANGE) {
+		emit_status_signal(private, session_id, new_state);
+	} else if (source == EVENT_SOURCE_GCONF_CHANGE && network_data == NULL) {
+		GSList *networks, *l;
+
 		TN_INFO("Tor system_wide status changed via gconf");
 
+		if (!new_state.system_wide_enabled) {
+			standby_stop(private);
+		}
+
+		/* Pass it on to every IAP, which can disconnect along the way */
+		networks = g_slist_copy(private->network_data_list);
+		for (l = networks; l; l = l->next) {
+			tor_network_data *found = (tor_network_data *) l->data;
+			network_tor_state network_state;
+
+			if (!icd_tor_network_data_alive(private, found))
+				continue;
+
+			memcpy(&network_state, &found->state, sizeof(network_tor_state));
+			network_state.system_wide_enabled = new_state.system_wide_enabled;
+			tor_state_change(private, found, network_state, EVENT_SOURCE_GCONF_CHANGE);
+		}
+		g_slist_free(networks);
+	} else if (source == EVENT_SOURCE_GCONF_CHANGE) {
 		/* We don't act on this in service provider mode */
 		if (!current_state.service_provider_mode && current_state.iap_connected) {
-			tor_network_data *network_data = icd_tor_find_first_network_data(private);
-
-			if (network_data == NULL) {
-				TN_ERR("iap_connected is TRUE, but we have no network_data");
-			} else {
-				if (new_state.system_wide_enabled
-				    && current_state.system_wide_enabled != new_state.system_wide_enabled) {
-					int start_ret = 0;
+			if (new_state.system_wide_enabled
+			    && current_state.system_wide_enabled != new_state.system_wide_enabled) {
+				int start_ret = 0;
 
-					new_state.gconf_transition_ongoing = TRUE;
+				new_state.gconf_transition_ongoing = TRUE;
 
-					start_ret = startup_tor(network_data, new_state.active_config);
+				start_ret = startup_tor(network_data, new_state.active_config);
 
-					if (start_ret == 1) {
-						TN_ERR("Could not start Tor triggered through gconf change");
-						private->close_cb(ICD_NW_ERROR,
-								  "Could not launch Tor on gconf request",
-								  network_data->network_type,
-								  network_data->network_attrs,
-								  network_data->network_id);
-					} else if (start_ret == 2) {
-						network_stop_all(network_data);
-					} else if (start_ret == 0) {
-						new_state.tor_running = TRUE;
-						new_state.tor_bootstrapped_running = TRUE;
-						new_state.tor_bootstrapped = FALSE;
-					}
-				} else {
-					new_state.gconf_transition_ongoing = TRUE;
+				if (start_ret == 1) {
+					TN_ERR("Could not start Tor triggered through gconf change");
+					close_network_error(private, network_data, "Could not launch Tor on gconf request");
+				} else if (start_ret == 2) {
 					network_stop_all(network_data);
+				} else if (start_ret == 0) {
+					new_state.tor_running = TRUE;
+					new_state.tor_bootstrapped_running = TRUE;
+					new_state.tor_bootstrapped = FALSE;
 				}
+			} else if (current_state.system_wide_enabled != new_state.system_wide_enabled) {
+				new_state.gconf_transition_ongoing = TRUE;
+				network_stop_all(network_data);
+			}
+
+			emit_status_signal(private, session_id, new_state);
+		}
+	} else if (source == EVENT_SOURCE_CONFIG_CHANGE && network_data == NULL) {
+		GSList *networks, *l;
+
+		networks = g_slist_copy(private->network_data_list);
+		for (l = networks; l; l = l->next) {
+			tor_network_data *found = (tor_network_data *) l->data;
+			network_tor_state network_state;
+
+			if (!icd_tor_network_data_alive(private, found))
+				continue;
 
-				emit_status_signal(new_state);
+			memcpy(&network_state, &found->state, sizeof(network_tor_state));
+			if (!network_state.service_provider_mode) {
+				network_state.active_config = get_active_config();
 			}
+			tor_state_change(private, found, network_state, EVENT_SOURCE_CONFIG_CHANGE);
 		}
-	} else if (source == EVENT_SOURCE_DBUS_CALL_START) {
-		if (!current_state.service_provider_mode) {
-			TN_ERR("Got EVENT_SOURCE_DBUS_CALL_START while not in provider mode");
+		g_slist_free(networks);
+	} else if (source == EVENT_SOURCE_CONFIG_CHANGE) {
+		const char *config = NULL;
+
+		if (!current_state.tor_running) {
+			/* Will be picked up on the next start */
 			goto done;
 		}
 
-		tor_network_data *network_data = icd_tor_find_first_network_data(private);
-		if (network_data == NULL) {
-			TN_ERR("service_provider_module is TRUE, but we have no network_data");
+		/* Providers ask for their own configuration */
+		if (current_state.service_provider_mode) {
+			config = network_data->config;
+		} else {
+			config = new_state.active_config;
+		}
+
+		if (reconfigure_tor(network_data, config) != 0) {
+			if (current_state.service_provider_mode) {
+				TN_WARN("Configuration %s needs a Tor restart, applied on next connect", config);
+			} else if (!current_state.config_restart_ongoing) {
+				TN_INFO("Restarting Tor for configuration %s", config);
+				new_state.config_restart_ongoing = TRUE;
+				network_stop_all(network_data);
+			}
+		}
+	} else if (source == EVENT_SOURCE_DBUS_CALL_START) {
+		if (!current_state.service_provider_mode) {
+			TN_ERR("Got EVENT_SOURCE_DBUS_CALL_START while not in provider mode");
 			goto done;
 		}
 
@@ -155,17 +220,20 @@ void tor_state_change(network_tor_private * private,
 		new_state.tor_bootstrapped_running = TRUE;
 		new_state.tor_bootstrapped = FALSE;
 
-		emit_status_signal(new_state);
+		emit_status_signal(private, session_id, new_state);
 	} else if (source == EVENT_SOURCE_DBUS_CALL_STOP) {
 		if (!current_state.service_provider_mode) {
 			TN_ERR("Got EVENT_SOURCE_DBUS_CALL_STOP while not in provider mode");
 			goto done;
 		}
 
-		tor_network_data *network_data = icd_tor_find_first_network_data(private);
-		if (network_data == NULL) {
-			TN_ERR("service_provider_module is TRUE, but we have no network_data");
-			goto done;
+		if (network_park_tor(network_data)) {
+			/* There will be no pid exit to tell the provider */
+			new_state.tor_running = FALSE;
+			new_state.tor_bootstrapped_running = FALSE;
+			new_state.tor_bootstrapped = FALSE;
+
+			emit_status_signal(private, session_id, new_state);
 		}
 
 		network_stop_all(network_data);
@@ -177,39 +245,67 @@ void tor_state_change(network_tor_private * private,
 			TN_ERR("Received tor pid exit but we don't think it was running");
 			/* Figure out how to handle this */
 		} else {
-			network_data->tor_pid = 0;
+			network_set_tor_pid(network_data, 0);
+
+			/* Nothing left to bootstrap */
+			bootstrap_watch_stop(network_data);
+			timeline_finish(network_data, FALSE);
+			new_state.tor_bootstrapped_running = FALSE;
+			set_bootstrap_progress(network_data, 0, NULL, NULL);
 
 			if (current_state.service_provider_mode) {
 				/* Nothing more to do, service provider will pick it up */
+			} else if (current_state.config_restart_ongoing) {
+				new_state.config_restart_ongoing = FALSE;
+
+				if (startup_tor(network_data, new_state.active_config) == 0) {
+					new_state.tor_running = TRUE;
+					new_state.tor_bootstrapped_running = TRUE;
+					new_state.tor_bootstrapped = FALSE;
+					/* Don't call ip_up_cb again once bootstrapped */
+					new_state.gconf_transition_ongoing = TRUE;
+				} else {
+					network_stop_all(network_data);
+					close_network_error(private, network_data,
+							    "Could not restart Tor with new configuration");
+				}
 			} else if (current_state.gconf_transition_ongoing) {
 				network_stop_all(network_data);
 				new_state.gconf_transition_ongoing = FALSE;
 			} else {
 				/* This will call tor_disconnect, so we don't free/stop here, since
 				 * ip_down should be called */
-				private->close_cb(ICD_NW_ERROR,
-						  "Tor process quit (unexpectedly)",
-						  network_data->network_type,
-						  network_data->network_attrs, network_data->network_id);
+				close_network_error(private, network_data, "Tor process quit (unexpectedly)");
 			}
 
 		}
 
-		emit_status_signal(new_state);
-	} else if (source == EVENT_SOURCE_TOR_BOOTSTRAPPED_PID_EXIT) {
-		network_data->wait_for_tor_pid = 0;
-
+		emit_status_signal(private, session_id, new_state);
+	} else if (source == EVENT_SOURCE_TOR_BOOTSTRAPPED) {
 		if (new_state.tor_bootstrapped) {
 			new_state.iap_connected = TRUE;
+			warmup_start(network_data);
+			dormant_tor_ready(private);
 
 			if (current_state.service_provider_mode) {
 				/* Nothing more to do here */
+				timeline_mark(network_data, TOR_STAGE_CONNECTED);
+				timeline_finish(network_data, TRUE);
 			} else if (current_state.gconf_transition_ongoing) {
 				new_state.gconf_transition_ongoing = FALSE;
+				timeline_mark(network_data, TOR_STAGE_CONNECTED);
+				timeline_finish(network_data, TRUE);
+			} else if (network_data->transproxy_job != NULL) {
+				/* ip_up_cb once the transproxy rules are in place too */
+				network_data->ip_up_pending = TRUE;
 			} else {
+				timeline_mark(network_data, TOR_STAGE_CONNECTED);
+				timeline_finish(network_data, TRUE);
 				network_data->ip_up_cb(ICD_NW_SUCCESS, NULL, network_data->ip_up_cb_token, NULL);
 			}
 		} else {
+			timeline_finish(network_data, FALSE);
+
 			if (current_state.service_provider_mode) {
 				/* We should probably signal service_provider that we could
 				 * not connect to Tor somehow, although the Stopped signal
@@ -220,24 +316,81 @@ void tor_state_change(network_tor_private * private,
 				icd_nw_ip_up_cb_fn up_cb = network_data->ip_up_cb;
 				gpointer up_token = network_data->ip_up_cb_token;
 
-				/* Maybe we should not free here */
+				/* Tor and the transproxy rules must not outlive the IAP */
 				new_state.iap_connected = FALSE;
+				network_stop_all(network_data);
 				network_free_all(network_data);
 
 				up_cb(ICD_NW_ERROR, NULL, up_token);
 			}
 		}
 
-		emit_status_signal(new_state);
+		emit_status_signal(private, session_id, new_state);
+	} else if (source == EVENT_SOURCE_TRANSPROXY_APPLIED) {
+		TN_INFO("Transproxy rules applied");
+		timeline_mark(network_data, TOR_STAGE_TRANSPROXY_APPLIED);
+
+		if (network_data->ip_up_pending) {
+			network_data->ip_up_pending = FALSE;
+			timeline_mark(network_data, TOR_STAGE_CONNECTED);
+			timeline_finish(network_data, TRUE);
+			network_data->ip_up_cb(ICD_NW_SUCCESS, NULL, network_data->ip_up_cb_token, NULL);
+		}
+	} else if (source == EVENT_SOURCE_TRANSPROXY_FAILED) {
+		TN_ERR("Could not apply transproxy rules");
+
+		if (current_state.service_provider_mode) {
+			/* The provider asked for Tor, it still has it */
+		} else if (network_data->ip_up_pending ||
+			   (current_state.tor_bootstrapped_running && !current_state.gconf_transition_ongoing)) {
+			/* ip_up_cb was not called yet, don't pretend we are connected
+			 * when traffic would bypass Tor */
+			icd_nw_ip_up_cb_fn up_cb = network_data->ip_up_cb;
+			gpointer up_token = network_data->ip_up_cb_token;
+
+			network_stop_all(network_data);
+			network_free_all(network_data);
+
+			new_state.iap_connected = FALSE;
+			new_state.tor_running = FALSE;
+			new_state.tor_bootstrapped_running = FALSE;
+			new_state.tor_bootstrapped = FALSE;
+
+			up_cb(ICD_NW_ERROR, NULL, up_token);
+
+			emit_status_signal(private, session_id, new_state);
+		} else {
+			close_network_error(private, network_data, "Could not apply transproxy rules");
+		}
 	}
 
  done:
+	trace_end(trace, &new_state);
+
+	if (network_data == NULL) {
+		private->state.system_wide_enabled = new_state.system_wide_enabled;
+		return;
+	}
+
+	/* network_data was freed along with its active_config */
+	if (!icd_tor_network_data_alive(private, network_data)) {
+		if (new_state.active_config != current_state.active_config)
+			free(new_state.active_config);
+		properties_changed(private);
+		start_waiters_update(private, network_data);
+		dormant_update(private);
+		return;
+	}
+
 	/* Free old active_config if it is not the same pointer as in new_state */
 	if (current_state.active_config != NULL && current_state.active_config != new_state.active_config) {
 		free(current_state.active_config);
 	}
 	/* Move to new state */
-	memcpy(&private->state, &new_state, sizeof(network_tor_state));
+	memcpy(&network_data->state, &new_state, sizeof(network_tor_state));
+	properties_changed(private);
+	start_waiters_update(private, network_data);
+	dormant_update(private);
 }
 
 /** Function for configuring an IP address.
@@ -312,11 +465,17 @@ tor_ip_down(const gchar * network_type, guint network_attrs,
 	tor_network_data *network_data = icd_tor_find_network_data(network_type, network_attrs, network_id,
 								   priv);
 
+	if (network_data == NULL) {
+		TN_ERR("tor_ip_down: no network_data for %s", network_id);
+		ip_down_cb(ICD_NW_SUCCESS, ip_down_cb_token);
+		return;
+	}
+
 	network_data->ip_down_cb = ip_down_cb;
 	network_data->ip_down_cb_token = ip_down_cb_token;
 
 	network_tor_state new_state;
-	memcpy(&new_state, &priv->state, sizeof(network_tor_state));
+	memcpy(&new_state, &network_data->state, sizeof(network_tor_state));
 	new_state.iap_connected = FALSE;
 	new_state.service_provider_mode = FALSE;
 
@@ -334,11 +493,46 @@ static void tor_network_destruct(gpointer * private)
 			gconf_client_notify_remove(priv->gconf_client, priv->gconf_cb_id_systemwide);
 			priv->gconf_cb_id_systemwide = 0;
 		}
+		if (priv->gconf_cb_id_active != 0) {
+			gconf_client_notify_remove(priv->gconf_client, priv->gconf_cb_id_active);
+			priv->gconf_cb_id_active = 0;
+		}
+		if (priv->gconf_cb_id_config != 0) {
+			gconf_client_notify_remove(priv->gconf_client, priv->gconf_cb_id_config);
+			priv->gconf_cb_id_config = 0;
+		}
 
 		g_object_unref(priv->gconf_client);
 	}
 	free_tor_dbus();
 
+	if (priv->config_change_id != 0) {
+		g_source_remove(priv->config_change_id);
+		priv->config_change_id = 0;
+	}
+
+	if (priv->status_flush_id != 0) {
+		g_source_remove(priv->status_flush_id);
+		priv->status_flush_id = 0;
+	}
+	properties_free(priv);
+	start_waiters_free(priv);
+	onion_requests_free(priv);
+	dormant_free(priv);
+
+	standby_stop(priv);
+	shared_stop(priv);
+	transproxy_shutdown();
+	config_cache_free();
+	tor_bridges_cache_free();
+
+	g_hash_table_destroy(priv->network_data_by_key);
+	g_hash_table_destroy(priv->network_data_by_pid);
+	g_hash_table_destroy(priv->status_sessions);
+
+	TN_INFO("StatusChanged: %" G_GUINT64_FORMAT " sent, %" G_GUINT64_FORMAT " suppressed",
+		priv->status_emitted, priv->status_suppressed);
+
 	if (priv->network_data_list)
 		TN_CRIT("ipv4 still has connected networks");
 
@@ -354,66 +548,41 @@ static void tor_network_destruct(gpointer * private)
  */
 static void tor_child_exit(const pid_t pid, const gint exit_status, gpointer * private)
 {
-	GSList *l;
 	network_tor_private *priv = *private;
 	tor_network_data *network_data;
 
-	enum pidtype { UNKNOWN, TOR_PID, WAIT_FOR_TOR_PID };
-
-	int pid_type = UNKNOWN;
-
-	for (l = priv->network_data_list; l; l = l->next) {
-		network_data = (tor_network_data *) l->data;
-		if (network_data) {
-			if (network_data->tor_pid == pid) {
-				pid_type = TOR_PID;
-				break;
-			}
-			if (network_data->wait_for_tor_pid == pid) {
-				pid_type = WAIT_FOR_TOR_PID;
-				break;
-			}
-			/* Do we want to do anything with unknown pids? */
+	if (priv->standby_tor_pid != 0 && priv->standby_tor_pid == pid) {
+		TN_INFO("Tor process in warm standby stopped");
+		priv->standby_tor_pid = 0;
+		standby_stop(priv);
+		return;
+	}
 
-		} else {
-			/* This can happen if we are manually disconnecting, and we already
-			   free the network data and kill tor, then we won't have the
-			   network_data anymore */
-			TN_DEBUG("tor_child_exit: network_data_list contains empty network_data");
-		}
+	if (priv->shared.pid != 0 && priv->shared.pid == pid) {
+		shared_exited(priv);
+		return;
 	}
 
-	if (!l) {
+	network_data = icd_tor_find_network_data_by_pid(priv, pid);
+	if (network_data == NULL) {
+		/* This can happen if we are manually disconnecting, and we already
+		   free the network data and kill tor, then we won't have the
+		   network_data anymore */
 		TN_ERR("tor_child_exit: got pid %d but did not find network_data\n", pid);
 		return;
 	}
 
-	if (pid_type == TOR_PID) {
-		TN_INFO("Tor process stopped");
-
-		network_tor_state new_state;
-		memcpy(&new_state, &priv->state, sizeof(network_tor_state));
-		new_state.tor_running = FALSE;
-		new_state.tor_bootstrapped = FALSE;
+	TN_INFO("Tor process for %s stopped", network_data->network_id);
 
-		tor_state_change(priv, network_data, new_state, EVENT_SOURCE_TOR_PID_EXIT);
-	} else if (pid_type == WAIT_FOR_TOR_PID) {
+	/* Before network_data restarts Tor or goes away */
+	tor_borrowers_exited(network_data);
 
-		TN_INFO("Got wait-for-tor pid: %d with status %d", pid, exit_status);
-
-		network_tor_state new_state;
-		memcpy(&new_state, &priv->state, sizeof(network_tor_state));
-		new_state.tor_bootstrapped_running = FALSE;
-
-		if (exit_status == 0) {
-			new_state.tor_bootstrapped = TRUE;
-		} else {
-			TN_WARN("wait-for-tor failed with %d\n", exit_status);
-			new_state.tor_bootstrapped = FALSE;
-		}
+	network_tor_state new_state;
+	memcpy(&new_state, &network_data->state, sizeof(network_tor_state));
+	new_state.tor_running = FALSE;
+	new_state.tor_bootstrapped = FALSE;
 
-		tor_state_change(priv, network_data, new_state, EVENT_SOURCE_TOR_BOOTSTRAPPED_PID_EXIT);
-	}
+	tor_state_change(priv, network_data, new_state, EVENT_SOURCE_TOR_PID_EXIT);
 
 	return;
 }
@@ -429,6 +598,30 @@ static void gconf_callback(GConfClient * client, guint cnxn_id, GConfEntry * ent
 	tor_state_change(priv, NULL, new_state, EVENT_SOURCE_GCONF_CHANGE);
 }
 
+static gboolean config_change_cb(gpointer user_data)
+{
+	network_tor_private *priv = user_data;
+
+	priv->config_change_id = 0;
+
+	network_tor_state new_state;
+	memcpy(&new_state, &priv->state, sizeof(network_tor_state));
+	tor_state_change(priv, NULL, new_state, EVENT_SOURCE_CONFIG_CHANGE);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void gconf_config_callback(GConfClient * client, guint cnxn_id, GConfEntry * entry, gpointer user_data)
+{
+	network_tor_private *priv = user_data;
+
+	/* Configurations are written one key at a time, wait for the burst to end */
+	if (priv->config_change_id != 0) {
+		g_source_remove(priv->config_change_id);
+	}
+	priv->config_change_id = g_timeout_add(TOR_CONFIG_CHANGE_DELAY_MS, config_change_cb, priv);
+}
+
 /** Tor network module initialization function.
  * @param network_api icd_nw_api structure filled in by the module
  * @param watch_cb function to inform ICd that a child process is to be
@@ -448,6 +641,13 @@ gboolean icd_nw_init(struct icd_nw_api *network_api,
 	network_api->ip_up = tor_ip_up;
 	network_api->ip_down = tor_ip_down;
 
+	priv->network_data_by_key = g_hash_table_new(g_str_hash, g_str_equal);
+	priv->network_data_by_pid = g_hash_table_new(g_direct_hash, g_direct_equal);
+	priv->status_sessions = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+
+	if (!config_cache_init())
+		TN_WARN("Could not monitor gconf for configuration changes, not caching configurations");
+
 	priv->state.system_wide_enabled = get_system_wide_enabled();
 	priv->state.active_config = NULL;
 	priv->state.iap_connected = FALSE;
@@ -474,10 +674,35 @@ gboolean icd_nw_init(struct icd_nw_api *network_api,
 		g_clear_error(&error);
 		goto err;
 	}
+	priv->gconf_cb_id_active =
+	    gconf_client_notify_add(priv->gconf_client, GC_TOR_ACTIVE, gconf_config_callback, (void *)priv, NULL,
+				    &error);
+	if (error != NULL) {
+		TN_ERR("Could not monitor gconf active config key for changes");
+		g_clear_error(&error);
+		goto err;
+	}
+
+	gconf_client_add_dir(priv->gconf_client, GC_TOR, GCONF_CLIENT_PRELOAD_NONE, &error);
+	if (error != NULL) {
+		TN_ERR("Could not monitor gconf Tor configurations for changes");
+		g_clear_error(&error);
+		goto err;
+	}
+	priv->gconf_cb_id_config =
+	    gconf_client_notify_add(priv->gconf_client, GC_TOR, gconf_config_callback, (void *)priv, NULL, &error);
+	if (error != NULL) {
+		TN_ERR("Could not monitor gconf Tor configurations for changes");
+		g_clear_error(&error);
+		goto err;
+	}
+
+	properties_init(priv);
+	dormant_init(priv);
 
 	if (setup_tor_dbus(priv)) {
 		TN_ERR("Could not request dbus interface");
-		goto err;
+		goto err_dormant;
 	}
 
 	network_api->network_destruct = tor_network_destruct;
@@ -496,11 +721,18 @@ gboolean icd_nw_init(struct icd_nw_api *network_api,
 
 	return TRUE;
 
+ err_dormant:
+	dormant_free(priv);
  err:
 	if (priv->gconf_client) {
 		g_object_unref(priv->gconf_client);
 		priv->gconf_client = NULL;
 	}
+	config_cache_free();
+	g_hash_table_destroy(priv->network_data_by_key);
+	g_hash_table_destroy(priv->network_data_by_pid);
+	g_hash_table_destroy(priv->status_sessions);
+	properties_free(priv);
 
 	g_free(priv);
 
@@ -35,9 +35,133 @@
 
 #include "dbus_tor.h"
 #include "libicd_tor.h"
+#include "tor_control.h"
+#include "transproxy.h"
+#include "tor_warmup.h"
+#include "tor_bridges.h"
+
+/* How long we wait for Tor to finish bootstrapping, in seconds */
+#ifdef TOR_TESTS
+#include <stdlib.h>
+#define TOR_BOOTSTRAP_TIMEOUT atoi(tor_tests_env("ICD_TOR_TEST_BOOTSTRAP_TIMEOUT", "60"))
+#else
+#define TOR_BOOTSTRAP_TIMEOUT 60
+#endif
+
+/* Configuration changes are applied once gconf has been quiet this long */
+#define TOR_CONFIG_CHANGE_DELAY_MS 250
+
+#ifdef TOR_TESTS
+#define TOR_TORRC_PATH tor_tests_env("ICD_TOR_TEST_TORRC", "/etc/tor/torrc-network-%s")
+#else
+#define TOR_TORRC_PATH "/etc/tor/torrc-network-%s"
+#endif
+
+/* Stages of bringing Tor up, timed from the start of startup_tor() */
+enum tor_stage {
+	TOR_STAGE_TORRC_GENERATED,
+	TOR_STAGE_TORRC_WRITTEN,
+	TOR_STAGE_SPAWNED,
+	TOR_STAGE_CONTROL_READY,
+	TOR_STAGE_TRANSPROXY_APPLIED,
+	TOR_STAGE_BOOTSTRAPPED,
+	TOR_STAGE_CONNECTED,
+	TOR_STAGE_COUNT,
+};
+
+/* In shared daemon mode, every IAP gets its own SocksPort and TransPort on
+ * the one Tor, taken in pairs from here */
+#define TOR_SHARED_PORT_BASE 19050
+#define TOR_SHARED_MAX_NETWORKS 16
+
+/* Finished timelines kept for GetTimings */
+#define TOR_TIMINGS_HISTORY 8
+
+/* cold, warm standby, pre-started, shared */
+#define TOR_START_KIND_COUNT 4
+
+/* Samples per stage the percentiles are computed over */
+#define TOR_TIMINGS_SAMPLES 64
+
+/* State changes recorded per timeline */
+#define TOR_TIMELINE_EVENTS 16
+
+struct _tor_timeline {
+	gboolean active;
+	gboolean success;
+
+	/* Monotonic and wall clock time of the start, in us */
+	gint64 start_time;
+	gint64 start_wall;
+	/* cold, warm standby, pre-started */
+	const char *start_kind;
+
+	/* ms after start_time, -1 if not reached */
+	gint stage_ms[TOR_STAGE_COUNT];
+
+	guint n_events;
+	struct {
+		gint source;
+		gint ms;
+	} events[TOR_TIMELINE_EVENTS];
+};
+typedef struct _tor_timeline tor_timeline;
+
+struct _tor_timings {
+	tor_timeline history[TOR_TIMINGS_HISTORY];
+	guint history_len;
+	guint history_next;
+
+	/* Rolling window of ms after start, per stage */
+	gint samples[TOR_STAGE_COUNT][TOR_TIMINGS_SAMPLES];
+	guint samples_len[TOR_STAGE_COUNT];
+	guint samples_next[TOR_STAGE_COUNT];
+
+	/* Successful starts and their total ms until connected, per start kind */
+	guint kind_count[TOR_START_KIND_COUNT];
+	guint64 kind_total_ms[TOR_START_KIND_COUNT];
+};
+typedef struct _tor_timings tor_timings;
+
+/* State transitions kept for DumpTrace and for logging when a connection
+ * fails, oldest ones are overwritten */
+#define TOR_TRACE_SIZE 128
+#define TOR_TRACE_NETWORK_ID_LEN 48
+
+/* network_tor_state booleans, packed for the trace */
+enum tor_trace_state_bits {
+	TOR_TRACE_SYSTEM_WIDE_ENABLED = 1 << 0,
+	TOR_TRACE_IAP_CONNECTED = 1 << 1,
+	TOR_TRACE_SERVICE_PROVIDER_MODE = 1 << 2,
+	TOR_TRACE_TOR_RUNNING = 1 << 3,
+	TOR_TRACE_TOR_BOOTSTRAPPED_RUNNING = 1 << 4,
+	TOR_TRACE_TOR_BOOTSTRAPPED = 1 << 5,
+	TOR_TRACE_GCONF_TRANSITION_ONGOING = 1 << 6,
+	TOR_TRACE_CONFIG_RESTART_ONGOING = 1 << 7,
+	TOR_TRACE_DBUS_FAILED_TO_START = 1 << 8,
+};
+
+struct _tor_trace_entry {
+	/* Monotonic, in us */
+	gint64 time;
+	gint source;
+	guint32 old_state;
+	guint32 new_state;
+	pid_t pid;
+	gchar network_id[TOR_TRACE_NETWORK_ID_LEN];
+};
+typedef struct _tor_trace_entry tor_trace_entry;
+
+struct _tor_trace {
+	tor_trace_entry entries[TOR_TRACE_SIZE];
+	/* Total number of transitions recorded */
+	guint64 count;
+};
+typedef struct _tor_trace tor_trace;
 
 struct _network_tor_state {
-	/* State data here, since without IAP we do not have tor_network_data */
+	/* Kept per IAP in tor_network_data, the copy in network_tor_private only
+	 * tracks system_wide_enabled and is the template for new IAPs */
 	gboolean system_wide_enabled;
 	gchar *active_config;
 	gboolean iap_connected;
@@ -48,6 +172,7 @@ struct _network_tor_state {
 	gboolean tor_bootstrapped;
 
 	gboolean gconf_transition_ongoing;
+	gboolean config_restart_ongoing;
 
 	gboolean dbus_failed_to_start;
 #if 0
@@ -60,6 +185,46 @@ struct _network_tor_state {
 };
 typedef struct _network_tor_state network_tor_state;
 
+/* The Tor all IAPs attach to in shared daemon mode */
+struct _tor_shared_daemon {
+	pid_t pid;
+	tor_control *control;
+	gchar *config;
+	gchar *torrc;
+
+	/* Attached tor_network_data, and which port pairs they use */
+	GSList *networks;
+	gboolean slots[TOR_SHARED_MAX_NETWORKS];
+};
+typedef struct _tor_shared_daemon tor_shared_daemon;
+
+/* Idle policy sending Tor to sleep with SIGNAL DORMANT */
+struct _tor_dormant {
+	/* dormant_timeout from gconf, 0 when the policy is off */
+	gint timeout;
+	gint64 last_activity;
+	guint idle_id;
+
+	gboolean dormant;
+	gint64 dormant_since;
+	/* Closed dormant periods */
+	gint64 dormant_us;
+	guint dormant_count;
+};
+typedef struct _tor_dormant tor_dormant;
+
+/* Published through org.freedesktop.DBus.Properties */
+struct _tor_properties {
+	const char *state;
+	const char *mode;
+	char *active_config;
+	dbus_int32_t bootstrap_percent;
+	dbus_int32_t tor_pid;
+	dbus_bool_t transproxy_enabled;
+	dbus_int32_t socks_port;
+};
+typedef struct _tor_properties tor_properties;
+
 struct _network_tor_private {
 	/* For pid monitoring */
 	icd_nw_watch_pid_fn watch_cb;
@@ -72,11 +237,62 @@ struct _network_tor_private {
 #endif
 
 	GSList *network_data_list;
+	/* tor_network_data by network_key() and by Tor pid */
+	GHashTable *network_data_by_key;
+	GHashTable *network_data_by_pid;
 
 	GConfClient *gconf_client;
 	guint gconf_cb_id_systemwide;
+	guint gconf_cb_id_active;
+	guint gconf_cb_id_config;
+	guint config_change_id;
 
 	network_tor_state state;
+
+	/* Tor kept running with DisableNetwork=1 between connections */
+	pid_t standby_tor_pid;
+	tor_control *standby_control;
+	gchar *standby_config;
+	gchar *standby_torrc;
+	gboolean standby_prestarted;
+	/* Probes the bridges of a pre-started Tor ahead of its connection */
+	tor_bridges_probe *standby_bridges_probe;
+
+	/* Shared daemon mode */
+	tor_shared_daemon shared;
+
+	/* Recent connect timelines */
+	tor_timings timings;
+
+	/* Recent state transitions */
+	tor_trace trace;
+
+	/* Last session handed out, and the number of StatusChanged signals */
+	guint32 last_session_id;
+	guint32 status_generation;
+
+	/* StatusChanged last sent and pending, by session */
+	GHashTable *status_sessions;
+	guint status_flush_id;
+	/* Calls to emit_status_signal() that did and did not send a signal */
+	guint64 status_emitted;
+	guint64 status_suppressed;
+
+	/* Time to first byte through Tor, with and without warm-up */
+	tor_warmup_stats warmup_stats;
+
+	/* StartAndWait calls waiting for Tor to connect */
+	GSList *start_waiters;
+
+	/* AddOnion and RemoveOnion calls waiting for Tor */
+	GSList *onion_requests;
+
+	/* Going dormant when idle or with the display off */
+	tor_dormant dormant;
+
+	/* Properties as last sent in PropertiesChanged */
+	tor_properties properties;
+	guint properties_flush_id;
 };
 typedef struct _network_tor_private network_tor_private;
 
@@ -89,19 +305,71 @@ struct _tor_network_data {
 	icd_nw_ip_down_cb_fn ip_down_cb;
 	gpointer ip_down_cb_token;
 
-	/* Tor pid */
+	/* State of this IAP */
+	network_tor_state state;
+	/* Sent along with StatusChanged, new for every ip_up and Start */
+	guint32 session_id;
+
+	/* Tor pid, set with network_set_tor_pid() */
 	pid_t tor_pid;
 
-	/* "Wait for Tor" stem script */
-	pid_t wait_for_tor_pid;
+	/* Control port connection following bootstrap progress */
+	tor_control *control;
+	guint bootstrap_timeout_id;
+
+	/* Attached to the shared Tor instead of running our own, tor_pid is 0 */
+	gboolean shared;
+	gint shared_slot;
+	gint socks_port;
+	gint trans_port;
+	/* No pid exit comes when detaching, this delivers it instead */
+	guint shared_exit_id;
+	/* Uses the Tor another IAP started on the same configuration, tor_pid
+	 * is 0 until that IAP goes and hands it over */
+	gboolean borrowed;
+
+	/* Tor has its network off until the bridges are probed and the fastest
+	 * ones are set with SETCONF */
+	tor_bridges_probe *bridges_probe;
+	gboolean bridges_pending;
+
+	/* Building circuits for the warm-up profile */
+	tor_warmup *warmup;
+
+	/* Woken up from warm standby, waiting for a circuit instead */
+	gboolean resuming;
+
+	/* Last bootstrap status reported by our Tor */
+	gint bootstrap_progress;
+	gchar *bootstrap_tag;
+	gchar *bootstrap_summary;
 
-	/* Is transproxy enabled? */
+	/* When and how Tor was started, and how long each stage took */
+	tor_timeline timeline;
+
+	/* Configuration Tor was started with, and the generated torrc */
+	gchar *config;
+	gchar *torrc;
+
+	/* Configuration being loaded with LOADCONF */
+	gchar *reload_config;
+	gchar *reload_torrc;
+	gboolean reload_again;
+
+	/* Is transproxy enabled, and does this IAP want it? Only one IAP
+	 * owns the rules, the others take them over when it lets go */
 	gboolean transproxy_enabled;
+	gboolean transproxy_wanted;
+	transproxy_job *transproxy_job;
+
+	/* Tor bootstrapped, ip_up_cb waits for the transproxy rules */
+	gboolean ip_up_pending;
 
 	/* For matching / callbacks later on (like close and limited_conn callback) */
 	gchar *network_type;
 	guint network_attrs;
 	gchar *network_id;
+	gchar *network_key;
 };
 typedef struct _tor_network_data tor_network_data;
 
@@ -120,24 +388,94 @@ tor_network_data *icd_tor_find_first_network_data(network_tor_private * private)
 tor_network_data *icd_tor_find_network_data(const gchar * network_type,
 					    guint network_attrs,
 					    const gchar * network_id, network_tor_private * private);
+tor_network_data *icd_tor_find_network_data_by_pid(network_tor_private * private, pid_t pid);
+tor_network_data *icd_tor_find_provider_network_data(network_tor_private * private, gboolean tor_running);
+tor_network_data *icd_tor_find_dbus_network_data(network_tor_private * private, gboolean tor_running);
+tor_network_data *icd_tor_find_status_network_data(network_tor_private * private);
+gboolean icd_tor_network_data_alive(network_tor_private * private, tor_network_data * network_data);
+gboolean icd_tor_any_tor_running(network_tor_private * private);
+void network_index_add(tor_network_data * network_data);
+void network_set_tor_pid(tor_network_data * network_data, pid_t pid);
 gboolean string_equal(const char *a, const char *b);
-int transproxy_onoff(gboolean on, char *config);
+void transproxy_onoff(tor_network_data * network_data, gboolean on, const char *config);
 int startup_tor(tor_network_data * network_data, char *config);
+int reconfigure_tor(tor_network_data * network_data, const char *config);
+void bootstrap_watch_stop(tor_network_data * network_data);
+void warmup_start(tor_network_data * network_data);
+gboolean network_park_tor(tor_network_data * network_data);
+void standby_stop(network_tor_private * priv);
+void shared_stop(network_tor_private * priv);
+void shared_exited(network_tor_private * priv);
+void tor_borrowers_exited(tor_network_data * network_data);
+int prestart_tor(network_tor_private * priv, const char *config);
+void set_bootstrap_progress(tor_network_data * network_data, int progress, const char *tag, const char *summary);
+
+/* Trace */
+tor_trace_entry *trace_begin(network_tor_private * priv, tor_network_data * network_data,
+			     network_tor_state * old_state, int source);
+void trace_end(tor_trace_entry * entry, network_tor_state * new_state);
+void trace_log(network_tor_private * priv);
+
+/* Properties */
+void properties_init(network_tor_private * priv);
+void properties_free(network_tor_private * priv);
+void properties_changed(network_tor_private * priv);
+
+/* Timings */
+const char *event_source_name(int source);
+void timeline_start(tor_network_data * network_data);
+void timeline_mark(tor_network_data * network_data, enum tor_stage stage);
+void timeline_event(tor_network_data * network_data, int source);
+void timeline_finish(tor_network_data * network_data, gboolean success);
 
 enum icd_tor_event_source_type {
 	EVENT_SOURCE_IP_UP,
 	EVENT_SOURCE_IP_DOWN,
 	EVENT_SOURCE_GCONF_CHANGE,
+	EVENT_SOURCE_CONFIG_CHANGE,
 	EVENT_SOURCE_TOR_PID_EXIT,
-	EVENT_SOURCE_TOR_BOOTSTRAPPED_PID_EXIT,
+	EVENT_SOURCE_TOR_BOOTSTRAPPED,
 	EVENT_SOURCE_DBUS_CALL_START,
 	EVENT_SOURCE_DBUS_CALL_STOP,
+	EVENT_SOURCE_TRANSPROXY_APPLIED,
+	EVENT_SOURCE_TRANSPROXY_FAILED,
 };
 
 /* DBus methods */
 DBusHandlerResult start_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
 DBusHandlerResult stop_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
 DBusHandlerResult getstatus_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
-void emit_status_signal(network_tor_state state);
+DBusHandlerResult startandwait_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+void start_waiters_update(network_tor_private * priv, tor_network_data * network_data);
+void start_waiters_free(network_tor_private * priv);
+DBusHandlerResult addonion_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+DBusHandlerResult removeonion_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+void onion_restore(tor_control * control, const char *config);
+void onion_control_lost(network_tor_private * priv, tor_control * control);
+void onion_requests_free(network_tor_private * priv);
+void dormant_init(network_tor_private * priv);
+void dormant_free(network_tor_private * priv);
+void dormant_activity(network_tor_private * priv);
+void dormant_stream_event(network_tor_private * priv, const char *event);
+void dormant_tor_ready(network_tor_private * priv);
+void dormant_update(network_tor_private * priv);
+const char *dormant_setevents(network_tor_private * priv);
+DBusHandlerResult getdormantstats_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+DBusHandlerResult prestart_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+DBusHandlerResult getbootstrapprogress_callback(DBusConnection * connection, DBusMessage * message,
+						void *user_data);
+DBusHandlerResult gettimings_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+DBusHandlerResult getsignalcounters_callback(DBusConnection * connection, DBusMessage * message,
+					     void *user_data);
+DBusHandlerResult getstartstats_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+DBusHandlerResult getwarmupstats_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+DBusHandlerResult dumptrace_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+DBusHandlerResult properties_get_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+DBusHandlerResult properties_getall_callback(DBusConnection * connection, DBusMessage * message,
+					     void *user_data);
+DBusHandlerResult properties_set_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+void status_names(network_tor_state * state, const char **status, const char **mode);
+void emit_status_signal(network_tor_private * priv, guint32 session_id, network_tor_state state);
+void emit_bootstrap_signal(network_tor_private * priv);
 
 #endif
@@ -38,9 +38,29 @@ static DBusHandlerResult start_reply(dbus_int32_t return_code, DBusMessage * rep
 	return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+/* Start also returns the session its StatusChanged signals carry, and the
+ * generation of the last signal sent before this reply */
+static DBusHandlerResult start_session_reply(network_tor_private * priv, dbus_int32_t return_code,
+					     dbus_uint32_t session_id, DBusMessage * reply)
+{
+	dbus_uint32_t generation = priv->status_generation;
+
+	dbus_message_append_args(reply, DBUS_TYPE_INT32, &return_code, DBUS_TYPE_UINT32, &session_id,
+				 DBUS_TYPE_UINT32, &generation, DBUS_TYPE_INVALID);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
 DBusHandlerResult start_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
 {
 	network_tor_private *priv = user_data;
+	tor_network_data *network_data;
 	DBusError error;
 	const char *config;
 
@@ -50,17 +70,20 @@ DBusHandlerResult start_callback(DBusConnection * connection, DBusMessage * mess
 		return DBUS_HANDLER_RESULT_NEED_MEMORY;
 	}
 
-	if (!priv->state.service_provider_mode) {
-		/* We do not accept dbus commands from non-providers */
+	network_data = icd_tor_find_dbus_network_data(priv, FALSE);
+	if (network_data == NULL) {
+		/* We do not accept dbus commands from non-providers, or
+		 * when several providers are connected */
 
-		return start_reply(TOR_DBUS_METHOD_START_RESULT_REFUSED, reply);
+		return start_session_reply(priv, TOR_DBUS_METHOD_START_RESULT_REFUSED, 0, reply);
 	}
 
 	/* We are in provider mode */
 
 	/* Tor already running? */
-	if (priv->state.tor_running == TRUE) {
-		return start_reply(TOR_DBUS_METHOD_START_RESULT_ALREADY_RUNNING, reply);
+	if (network_data->state.tor_running == TRUE) {
+		return start_session_reply(priv, TOR_DBUS_METHOD_START_RESULT_ALREADY_RUNNING,
+					   network_data->session_id, reply);
 	}
 
 	dbus_error_init(&error);
@@ -68,21 +91,205 @@ DBusHandlerResult start_callback(DBusConnection * connection, DBusMessage * mess
 		TN_WARN("start_callback received invalid arguments: %s", error.message);
 		dbus_error_free(&error);
 
-		return start_reply(TOR_DBUS_METHOD_START_RESULT_INVALID_ARGS, reply);
+		return start_session_reply(priv, TOR_DBUS_METHOD_START_RESULT_INVALID_ARGS, 0, reply);
 	}
 
 	if (!config_is_known(config)) {
-		return start_reply(TOR_DBUS_METHOD_START_RESULT_INVALID_CONFIG, reply);
+		return start_session_reply(priv, TOR_DBUS_METHOD_START_RESULT_INVALID_CONFIG, 0, reply);
 	}
 
 	/* Actually start Tor */
 	network_tor_state new_state;
-	memcpy(&new_state, &priv->state, sizeof(network_tor_state));
+	memcpy(&new_state, &network_data->state, sizeof(network_tor_state));
 	new_state.active_config = g_strdup(config);
-	tor_state_change(priv, NULL, new_state, EVENT_SOURCE_DBUS_CALL_START);
+	tor_state_change(priv, network_data, new_state, EVENT_SOURCE_DBUS_CALL_START);
+
+	if (network_data->state.dbus_failed_to_start) {
+		network_data->state.dbus_failed_to_start = FALSE;
+		return start_session_reply(priv, TOR_DBUS_METHOD_START_RESULT_FAILED, network_data->session_id,
+					   reply);
+	}
+
+	return start_session_reply(priv, TOR_DBUS_METHOD_START_RESULT_OK, network_data->session_id, reply);
+}
+
+/* A StartAndWait call, replied to once its IAP connected or gave up */
+struct _tor_start_waiter {
+	network_tor_private *priv;
+	tor_network_data *network_data;
+	DBusMessage *message;
+	gint64 start_time;
+	guint timeout_id;
+};
+typedef struct _tor_start_waiter tor_start_waiter;
+
+/* Replies (int32 result, uint32 ms waited, uint32 session) */
+static void start_waiter_reply(tor_start_waiter * waiter, dbus_int32_t return_code, dbus_uint32_t session_id)
+{
+	network_tor_private *priv = waiter->priv;
+	dbus_uint32_t elapsed = (g_get_monotonic_time() - waiter->start_time) / 1000;
+	DBusMessage *reply;
+
+	priv->start_waiters = g_slist_remove(priv->start_waiters, waiter);
+	if (waiter->timeout_id != 0)
+		g_source_remove(waiter->timeout_id);
+
+	reply = dbus_message_new_method_return(waiter->message);
+	if (reply != NULL) {
+		dbus_message_append_args(reply, DBUS_TYPE_INT32, &return_code, DBUS_TYPE_UINT32, &elapsed,
+					 DBUS_TYPE_UINT32, &session_id, DBUS_TYPE_INVALID);
+		if (icd_dbus_send_system_msg(reply) == FALSE) {
+			TN_WARN("icd_dbus_send_system_msg failed");
+		}
+		dbus_message_unref(reply);
+	}
+
+	dbus_message_unref(waiter->message);
+	g_free(waiter);
+}
+
+static gboolean start_waiter_timeout_cb(gpointer user_data)
+{
+	tor_start_waiter *waiter = user_data;
+
+	waiter->timeout_id = 0;
+	start_waiter_reply(waiter, TOR_DBUS_METHOD_START_RESULT_TIMEOUT, waiter->network_data->session_id);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Answer the StartAndWait calls of network_data that can be answered now,
+ * called after every state change */
+void start_waiters_update(network_tor_private * priv, tor_network_data * network_data)
+{
+	gboolean alive = icd_tor_network_data_alive(priv, network_data);
+	GSList *l, *next;
+
+	for (l = priv->start_waiters; l; l = next) {
+		tor_start_waiter *waiter = l->data;
+		next = l->next;
+
+		if (waiter->network_data != network_data)
+			continue;
+
+		if (!alive)
+			start_waiter_reply(waiter, TOR_DBUS_METHOD_START_RESULT_FAILED, 0);
+		else if (network_data->state.tor_running && network_data->state.tor_bootstrapped)
+			start_waiter_reply(waiter, TOR_DBUS_METHOD_START_RESULT_OK, network_data->session_id);
+		else if (!network_data->state.tor_running)
+			start_waiter_reply(waiter, TOR_DBUS_METHOD_START_RESULT_FAILED, network_data->session_id);
+		/* Bootstrapping failed, Tor is left running in provider mode */
+		else if (!network_data->state.tor_bootstrapped_running && !network_data->state.tor_bootstrapped)
+			start_waiter_reply(waiter, TOR_DBUS_METHOD_START_RESULT_FAILED, network_data->session_id);
+	}
+}
+
+void start_waiters_free(network_tor_private * priv)
+{
+	while (priv->start_waiters != NULL)
+		start_waiter_reply(priv->start_waiters->data, TOR_DBUS_METHOD_START_RESULT_FAILED, 0);
+}
+
+/* Like Start, but only replies once Tor connected, failed or timeout_ms
+ * passed. Calls while Tor is starting wait for the same start. */
+DBusHandlerResult startandwait_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	network_tor_private *priv = user_data;
+	tor_network_data *network_data;
+	tor_start_waiter *waiter;
+	DBusError error;
+	const char *config;
+	dbus_uint32_t timeout_ms;
+
+	waiter = g_new0(tor_start_waiter, 1);
+	waiter->priv = priv;
+	waiter->message = dbus_message_ref(message);
+	waiter->start_time = g_get_monotonic_time();
+
+	dbus_error_init(&error);
+	if (dbus_message_get_args(message, &error, DBUS_TYPE_STRING, &config, DBUS_TYPE_UINT32, &timeout_ms,
+				  DBUS_TYPE_INVALID) == FALSE) {
+		TN_WARN("startandwait_callback received invalid arguments: %s", error.message);
+		dbus_error_free(&error);
+
+		start_waiter_reply(waiter, TOR_DBUS_METHOD_START_RESULT_INVALID_ARGS, 0);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
 
-	if (priv->state.dbus_failed_to_start) {
-		priv->state.dbus_failed_to_start = FALSE;
+	if (!config_is_known(config)) {
+		start_waiter_reply(waiter, TOR_DBUS_METHOD_START_RESULT_INVALID_CONFIG, 0);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	network_data = icd_tor_find_dbus_network_data(priv, TRUE);
+	if (network_data == NULL) {
+		/* We do not accept dbus commands from non-providers, or
+		 * when several providers are connected */
+
+		start_waiter_reply(waiter, TOR_DBUS_METHOD_START_RESULT_REFUSED, 0);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	if (!network_data->state.tor_running) {
+		/* Actually start Tor */
+		network_tor_state new_state;
+		memcpy(&new_state, &network_data->state, sizeof(network_tor_state));
+		new_state.active_config = g_strdup(config);
+		tor_state_change(priv, network_data, new_state, EVENT_SOURCE_DBUS_CALL_START);
+
+		if (network_data->state.dbus_failed_to_start) {
+			network_data->state.dbus_failed_to_start = FALSE;
+			start_waiter_reply(waiter, TOR_DBUS_METHOD_START_RESULT_FAILED, network_data->session_id);
+			return DBUS_HANDLER_RESULT_HANDLED;
+		}
+	} else if (!string_equal(network_data->config, config)) {
+		TN_INFO("StartAndWait for %s joins Tor running %s", config, network_data->config);
+	}
+
+	/* Maybe it is connected already */
+	waiter->network_data = network_data;
+	priv->start_waiters = g_slist_prepend(priv->start_waiters, waiter);
+	start_waiters_update(priv, network_data);
+	if (g_slist_find(priv->start_waiters, waiter) == NULL)
+		return DBUS_HANDLER_RESULT_HANDLED;
+
+	if (timeout_ms == 0)
+		timeout_ms = TOR_BOOTSTRAP_TIMEOUT * 1000;
+	waiter->timeout_id = g_timeout_add(timeout_ms, start_waiter_timeout_cb, waiter);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+DBusHandlerResult prestart_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	network_tor_private *priv = user_data;
+	DBusError error;
+	const char *config;
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	/* Only useful before a connection is up */
+	if (icd_tor_any_tor_running(priv)) {
+		return start_reply(TOR_DBUS_METHOD_START_RESULT_ALREADY_RUNNING, reply);
+	}
+
+	dbus_error_init(&error);
+	if (dbus_message_get_args(message, &error, DBUS_TYPE_STRING, &config, DBUS_TYPE_INVALID) == FALSE) {
+		TN_WARN("prestart_callback received invalid arguments: %s", error.message);
+		dbus_error_free(&error);
+
+		return start_reply(TOR_DBUS_METHOD_START_RESULT_INVALID_ARGS, reply);
+	}
+
+	if (!config_is_known(config)) {
+		return start_reply(TOR_DBUS_METHOD_START_RESULT_INVALID_CONFIG, reply);
+	}
+
+	if (prestart_tor(priv, config) != 0) {
 		return start_reply(TOR_DBUS_METHOD_START_RESULT_FAILED, reply);
 	}
 
@@ -92,6 +299,7 @@ DBusHandlerResult start_callback(DBusConnection * connection, DBusMessage * mess
 DBusHandlerResult stop_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
 {
 	network_tor_private *priv = user_data;
+	tor_network_data *network_data;
 
 	DBusMessage *reply = dbus_message_new_method_return(message);
 	if (!reply) {
@@ -99,30 +307,54 @@ DBusHandlerResult stop_callback(DBusConnection * connection, DBusMessage * messa
 		return DBUS_HANDLER_RESULT_NEED_MEMORY;
 	}
 
-	if (!priv->state.service_provider_mode) {
-		/* We do not accept dbus commands from non-providers */
+	network_data = icd_tor_find_dbus_network_data(priv, TRUE);
+	if (network_data == NULL) {
+		/* We do not accept dbus commands from non-providers, or
+		 * when several providers are connected */
 
 		return start_reply(TOR_DBUS_METHOD_STOP_RESULT_REFUSED, reply);
 	}
 
 	/* Tor not running? */
-	if (priv->state.tor_running == FALSE) {
+	if (network_data->state.tor_running == FALSE) {
 		return start_reply(TOR_DBUS_METHOD_STOP_RESULT_NOT_RUNNING, reply);
 	}
 
 	/* Actually stop Tor */
 	network_tor_state new_state;
-	memcpy(&new_state, &priv->state, sizeof(network_tor_state));
-	tor_state_change(priv, NULL, new_state, EVENT_SOURCE_DBUS_CALL_STOP);
+	memcpy(&new_state, &network_data->state, sizeof(network_tor_state));
+	tor_state_change(priv, network_data, new_state, EVENT_SOURCE_DBUS_CALL_STOP);
 
 	return start_reply(TOR_DBUS_METHOD_STOP_RESULT_OK, reply);
 }
 
+/* StatusChanged and GetStatus names for a state */
+void status_names(network_tor_state * state, const char **status, const char **mode)
+{
+	if (!state->tor_running) {
+		*status = ICD_TOR_SIGNALS_STATUS_STATE_STOPPED;
+	} else {
+		if (state->tor_bootstrapped) {
+			*status = ICD_TOR_SIGNALS_STATUS_STATE_CONNECTED;
+		} else {
+			*status = ICD_TOR_SIGNALS_STATUS_STATE_STARTED;
+		}
+	}
+
+	if (!state->service_provider_mode) {
+		*mode = ICD_TOR_SIGNALS_STATUS_MODE_NORMAL;
+	} else {
+		*mode = ICD_TOR_SIGNALS_STATUS_MODE_PROVIDER;
+	}
+}
+
 DBusHandlerResult getstatus_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
 {
 	const char *state = NULL;
 	const char *mode = NULL;
 	network_tor_private *priv = user_data;
+	network_tor_state *status = &priv->state;
+	tor_network_data *network_data;
 
 	DBusMessage *reply = dbus_message_new_method_return(message);
 	if (!reply) {
@@ -130,22 +362,11 @@ DBusHandlerResult getstatus_callback(DBusConnection * connection, DBusMessage *
 		return DBUS_HANDLER_RESULT_NEED_MEMORY;
 	}
 
-	/* TODO: DRY this */
-	if (!priv->state.tor_running) {
-		state = ICD_TOR_SIGNALS_STATUS_STATE_STOPPED;
-	} else {
-		if (priv->state.tor_bootstrapped) {
-			state = ICD_TOR_SIGNALS_STATUS_STATE_CONNECTED;
-		} else {
-			state = ICD_TOR_SIGNALS_STATUS_STATE_STARTED;
-		}
-	}
+	network_data = icd_tor_find_status_network_data(priv);
+	if (network_data != NULL)
+		status = &network_data->state;
 
-	if (!priv->state.service_provider_mode) {
-		mode = ICD_TOR_SIGNALS_STATUS_MODE_NORMAL;
-	} else {
-		mode = ICD_TOR_SIGNALS_STATUS_MODE_PROVIDER;
-	}
+	status_names(status, &state, &mode);
 
 	dbus_message_append_args(reply, DBUS_TYPE_STRING, &state, DBUS_TYPE_STRING, &mode, DBUS_TYPE_INVALID);
 
@@ -161,10 +382,35 @@ DBusHandlerResult getstatus_callback(DBusConnection * connection, DBusMessage *
 	return DBUS_HANDLER_RESULT_HANDLED;
 }
 
-void emit_status_signal(network_tor_state state)
+/* What went out last for a session, and what is about to */
+struct _tor_status_session {
+	const char *state;
+	const char *mode;
+
+	gboolean pending;
+	const char *pending_state;
+	const char *pending_mode;
+};
+typedef struct _tor_status_session tor_status_session;
+
+static gboolean status_session_alive(network_tor_private * priv, guint32 session_id)
 {
-	const char *status = NULL;
-	const char *mode = NULL;
+	GSList *l;
+
+	for (l = priv->network_data_list; l; l = l->next) {
+		tor_network_data *network_data = (tor_network_data *) l->data;
+
+		if (network_data->session_id == session_id)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void send_status_signal(network_tor_private * priv, guint32 session_id, const char *status,
+			       const char *mode)
+{
+	dbus_uint32_t generation;
 	DBusMessage *msg = NULL;
 
 	msg = dbus_message_new_signal(ICD_TOR_DBUS_PATH, ICD_TOR_DBUS_INTERFACE, "StatusChanged");
@@ -173,24 +419,166 @@ void emit_status_signal(network_tor_state state)
 		return;
 	}
 
-	/* TODO: DRY this */
-	if (!state.tor_running) {
-		status = ICD_TOR_SIGNALS_STATUS_STATE_STOPPED;
-	} else {
-		if (state.tor_bootstrapped) {
-			status = ICD_TOR_SIGNALS_STATUS_STATE_CONNECTED;
-		} else {
-			status = ICD_TOR_SIGNALS_STATUS_STATE_STARTED;
+	generation = ++priv->status_generation;
+	dbus_message_append_args(msg, DBUS_TYPE_STRING, &status, DBUS_TYPE_STRING, &mode,
+				 DBUS_TYPE_UINT32, &generation, DBUS_TYPE_UINT32, &session_id, DBUS_TYPE_INVALID);
+
+	icd_dbus_send_system_msg(msg);
+
+	dbus_message_unref(msg);
+}
+
+static gboolean status_flush_cb(gpointer user_data)
+{
+	network_tor_private *priv = user_data;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	priv->status_flush_id = 0;
+
+	g_hash_table_iter_init(&iter, priv->status_sessions);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		guint32 session_id = GPOINTER_TO_UINT(key);
+		tor_status_session *session = value;
+
+		if (session->pending) {
+			session->pending = FALSE;
+
+			/* Went somewhere and came back within the same iteration */
+			if (string_equal(session->state, session->pending_state)
+			    && string_equal(session->mode, session->pending_mode)) {
+				priv->status_suppressed++;
+			} else {
+				session->state = session->pending_state;
+				session->mode = session->pending_mode;
+				send_status_signal(priv, session_id, session->state, session->mode);
+				priv->status_emitted++;
+			}
 		}
+
+		/* The Stopped of a disconnected IAP was the last one */
+		if (!status_session_alive(priv, session_id))
+			g_hash_table_iter_remove(&iter);
 	}
 
-	if (!state.service_provider_mode) {
-		mode = ICD_TOR_SIGNALS_STATUS_MODE_NORMAL;
-	} else {
-		mode = ICD_TOR_SIGNALS_STATUS_MODE_PROVIDER;
+	return G_SOURCE_REMOVE;
+}
+
+/* StatusChanged goes out once the main loop comes back, only the last state
+ * of a burst is sent and only if it differs from what was sent before */
+void emit_status_signal(network_tor_private * priv, guint32 session_id, network_tor_state state)
+{
+	const char *status = NULL;
+	const char *mode = NULL;
+	tor_status_session *session;
+
+	status_names(&state, &status, &mode);
+
+	session = g_hash_table_lookup(priv->status_sessions, GUINT_TO_POINTER(session_id));
+	if (session == NULL) {
+		session = g_new0(tor_status_session, 1);
+		g_hash_table_insert(priv->status_sessions, GUINT_TO_POINTER(session_id), session);
+	}
+
+	if (session->pending) {
+		/* Replaced before it went out */
+		priv->status_suppressed++;
+	} else if (string_equal(session->state, status) && string_equal(session->mode, mode)) {
+		priv->status_suppressed++;
+		return;
+	}
+
+	session->pending = TRUE;
+	session->pending_state = status;
+	session->pending_mode = mode;
+
+	if (priv->status_flush_id == 0)
+		priv->status_flush_id = g_idle_add(status_flush_cb, priv);
+}
+
+DBusHandlerResult getsignalcounters_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	network_tor_private *priv = user_data;
+	dbus_uint64_t emitted = priv->status_emitted;
+	dbus_uint64_t suppressed = priv->status_suppressed;
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	dbus_message_append_args(reply, DBUS_TYPE_UINT64, &emitted, DBUS_TYPE_UINT64, &suppressed,
+				 DBUS_TYPE_INVALID);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Bootstrap status of the IAP GetStatus reports on */
+static void bootstrap_status(network_tor_private * priv, dbus_int32_t * progress, const char **tag,
+			     const char **summary)
+{
+	tor_network_data *network_data = icd_tor_find_status_network_data(priv);
+
+	if (network_data == NULL)
+		return;
+
+	*progress = network_data->bootstrap_progress;
+	if (network_data->bootstrap_tag)
+		*tag = network_data->bootstrap_tag;
+	if (network_data->bootstrap_summary)
+		*summary = network_data->bootstrap_summary;
+}
+
+DBusHandlerResult getbootstrapprogress_callback(DBusConnection * connection, DBusMessage * message,
+						void *user_data)
+{
+	network_tor_private *priv = user_data;
+	dbus_int32_t progress = 0;
+	const char *tag = "", *summary = "";
+
+	bootstrap_status(priv, &progress, &tag, &summary);
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	dbus_message_append_args(reply, DBUS_TYPE_INT32, &progress, DBUS_TYPE_STRING, &tag,
+				 DBUS_TYPE_STRING, &summary, DBUS_TYPE_INVALID);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+void emit_bootstrap_signal(network_tor_private * priv)
+{
+	dbus_int32_t progress = 0;
+	const char *tag = "", *summary = "";
+	DBusMessage *msg = NULL;
+
+	bootstrap_status(priv, &progress, &tag, &summary);
+
+	msg = dbus_message_new_signal(ICD_TOR_DBUS_PATH, ICD_TOR_DBUS_INTERFACE, ICD_TOR_SIGNAL_BOOTSTRAPPROGRESS);
+	if (msg == NULL) {
+		TN_WARN("Could not construct dbus message for BootstrapProgress signal");
+		return;
 	}
 
-	dbus_message_append_args(msg, DBUS_TYPE_STRING, &status, DBUS_TYPE_STRING, &mode, DBUS_TYPE_INVALID);
+	dbus_message_append_args(msg, DBUS_TYPE_INT32, &progress, DBUS_TYPE_STRING, &tag,
+				 DBUS_TYPE_STRING, &summary, DBUS_TYPE_INVALID);
 
 	icd_dbus_send_system_msg(msg);
 
@@ -0,0 +1,318 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "libicd_tor.h"
+#include "dbus_tor.h"
+#include "libicd_network_tor.h"
+
+/* Tor keeps building circuits and fetching directory information while
+ * nothing uses it. After dormant_timeout seconds without new user streams, or
+ * as soon as the display turns off, every bootstrapped Tor is sent SIGNAL
+ * DORMANT, and SIGNAL ACTIVE again on the next stream or when the display
+ * turns on. Tor also wakes up by itself for new streams, we only send ACTIVE
+ * so the state stays in sync. */
+#define MCE_SIGNAL_IF "com.nokia.mce.signal"
+#define MCE_DISPLAY_SIG "display_status_ind"
+#define MCE_DISPLAY_SIG_FILTER "member='" MCE_DISPLAY_SIG "'"
+
+/* Tor's housekeeping runs once a second while active, not while dormant */
+#define TOR_ACTIVE_WAKEUPS_PER_SECOND 1
+
+/* Whether control belongs to a Tor that finished bootstrapping */
+static gboolean dormant_control_bootstrapped(network_tor_private * priv, tor_control * control)
+{
+	GSList *l;
+
+	for (l = priv->network_data_list; l; l = l->next) {
+		tor_network_data *network_data = (tor_network_data *) l->data;
+		tor_control *nd_control = network_data->shared ? priv->shared.control : network_data->control;
+
+		if (nd_control == control && network_data->state.tor_bootstrapped)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Send signal to every Tor we have a control connection to, DORMANT only
+ * to bootstrapped ones. Returns how many got it. */
+static guint dormant_signal(network_tor_private * priv, const char *signal, gboolean bootstrapped_only)
+{
+	gchar *command = g_strdup_printf("SIGNAL %s", signal);
+	guint sent = 0;
+	GSList *l;
+
+	for (l = priv->network_data_list; l; l = l->next) {
+		tor_network_data *network_data = (tor_network_data *) l->data;
+
+		if (network_data->shared || !tor_control_is_ready(network_data->control))
+			continue;
+		if (bootstrapped_only && !network_data->state.tor_bootstrapped)
+			continue;
+		if (tor_control_send(network_data->control, command, NULL, NULL) == 0)
+			sent++;
+	}
+
+	if (priv->shared.networks != NULL && tor_control_is_ready(priv->shared.control)
+	    && (!bootstrapped_only || dormant_control_bootstrapped(priv, priv->shared.control))) {
+		if (tor_control_send(priv->shared.control, command, NULL, NULL) == 0)
+			sent++;
+	}
+
+	g_free(command);
+
+	return sent;
+}
+
+static void dormant_warmup_pause(network_tor_private * priv, gboolean paused)
+{
+	GSList *l;
+
+	for (l = priv->network_data_list; l; l = l->next)
+		tor_warmup_set_paused(((tor_network_data *) l->data)->warmup, paused);
+}
+
+static void dormant_enter(network_tor_private * priv, const char *reason)
+{
+	tor_dormant *dormant = &priv->dormant;
+
+	if (dormant->dormant || dormant->timeout == 0)
+		return;
+
+	if (dormant_signal(priv, "DORMANT", TRUE) == 0)
+		return;
+
+	TN_INFO("Tor is going dormant: %s", reason);
+	dormant->dormant = TRUE;
+	dormant->dormant_since = g_get_monotonic_time();
+	dormant->dormant_count++;
+	dormant_warmup_pause(priv, TRUE);
+}
+
+/* Close the current dormant period, if there is one */
+static void dormant_leave(network_tor_private * priv)
+{
+	tor_dormant *dormant = &priv->dormant;
+
+	if (!dormant->dormant)
+		return;
+
+	dormant->dormant = FALSE;
+	dormant->dormant_us += g_get_monotonic_time() - dormant->dormant_since;
+	dormant_warmup_pause(priv, FALSE);
+}
+
+/* Whether a stream from local port belongs to a warm-up of any IAP, as a
+ * shared Tor reports the streams of all of them */
+static gboolean dormant_warmup_stream(network_tor_private * priv, guint16 port)
+{
+	GSList *l;
+
+	for (l = priv->network_data_list; l; l = l->next) {
+		if (tor_warmup_owns_port(((tor_network_data *) l->data)->warmup, port))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* "STREAM <id> <status> <circuit> <target> [key=value...]": only new streams
+ * someone asked for count, not Tor's own directory fetches or our warm-up */
+void dormant_stream_event(network_tor_private * priv, const char *event)
+{
+	gchar **fields = g_strsplit(event, " ", -1);
+	gboolean user = TRUE;
+	int i;
+
+	if (g_strv_length(fields) < 5
+	    || (strcmp(fields[2], "NEW") != 0 && strcmp(fields[2], "NEWRESOLVE") != 0)) {
+		g_strfreev(fields);
+		return;
+	}
+
+	for (i = 5; fields[i] != NULL && user; i++) {
+		if (g_str_has_prefix(fields[i], "PURPOSE=")) {
+			const char *purpose = fields[i] + strlen("PURPOSE=");
+
+			user = strcmp(purpose, "USER") == 0 || strcmp(purpose, "DNS_REQUEST") == 0;
+		} else if (g_str_has_prefix(fields[i], "SOURCE_ADDR=")) {
+			const char *colon = strrchr(fields[i], ':');
+
+			if (colon != NULL)
+				user = !dormant_warmup_stream(priv, atoi(colon + 1));
+		}
+	}
+	g_strfreev(fields);
+
+	if (user)
+		dormant_activity(priv);
+}
+
+static gboolean dormant_idle_cb(gpointer user_data)
+{
+	network_tor_private *priv = user_data;
+	tor_dormant *dormant = &priv->dormant;
+	gint64 idle_s = (g_get_monotonic_time() - dormant->last_activity) / G_USEC_PER_SEC;
+
+	dormant->idle_id = 0;
+
+	/* Activity does not move the timer, it is checked here instead */
+	if (idle_s < dormant->timeout) {
+		dormant->idle_id = g_timeout_add_seconds(dormant->timeout - idle_s, dormant_idle_cb, priv);
+		return G_SOURCE_REMOVE;
+	}
+
+	dormant_enter(priv, "no streams");
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Something uses Tor, wake it if needed and start over waiting for idle */
+void dormant_activity(network_tor_private * priv)
+{
+	tor_dormant *dormant = &priv->dormant;
+
+	if (dormant->timeout == 0)
+		return;
+
+	dormant->last_activity = g_get_monotonic_time();
+
+	if (dormant->dormant) {
+		TN_INFO("Tor is waking up");
+		dormant_signal(priv, "ACTIVE", FALSE);
+		dormant_leave(priv);
+	}
+
+	if (dormant->idle_id == 0)
+		dormant->idle_id = g_timeout_add_seconds(dormant->timeout, dormant_idle_cb, priv);
+}
+
+/* A Tor finished bootstrapping, so it is wanted */
+void dormant_tor_ready(network_tor_private * priv)
+{
+	priv->dormant.timeout = MAX(get_dormant_timeout(), 0);
+	dormant_activity(priv);
+}
+
+/* Called after every state change, the period ends with the last Tor */
+void dormant_update(network_tor_private * priv)
+{
+	tor_dormant *dormant = &priv->dormant;
+
+	if (icd_tor_any_tor_running(priv))
+		return;
+
+	dormant_leave(priv);
+	if (dormant->idle_id != 0) {
+		g_source_remove(dormant->idle_id);
+		dormant->idle_id = 0;
+	}
+}
+
+/* SETEVENTS for a new control connection. Streams are wanted even without a
+ * dormant timeout, it can be set while the connection stays up. */
+const char *dormant_setevents(network_tor_private * priv)
+{
+	return "SETEVENTS STATUS_CLIENT STREAM";
+}
+
+static DBusHandlerResult dormant_display_sig(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	network_tor_private *priv = user_data;
+	const char *status = NULL;
+
+	if (!dbus_message_is_signal(message, MCE_SIGNAL_IF, MCE_DISPLAY_SIG))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if (!dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &status, DBUS_TYPE_INVALID))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if (strcmp(status, "off") == 0)
+		dormant_enter(priv, "display off");
+	else if (strcmp(status, "on") == 0 && priv->dormant.dormant)
+		dormant_activity(priv);
+
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+void dormant_init(network_tor_private * priv)
+{
+	priv->dormant.timeout = MAX(get_dormant_timeout(), 0);
+
+	if (!icd_dbus_connect_system_bcast_signal(MCE_SIGNAL_IF, dormant_display_sig, priv, MCE_DISPLAY_SIG_FILTER))
+		TN_WARN("Unable to listen to display signals, going dormant on idle only");
+}
+
+void dormant_free(network_tor_private * priv)
+{
+	tor_dormant *dormant = &priv->dormant;
+
+	icd_dbus_disconnect_system_bcast_signal(MCE_SIGNAL_IF, dormant_display_sig, priv, MCE_DISPLAY_SIG_FILTER);
+
+	if (dormant->idle_id != 0) {
+		g_source_remove(dormant->idle_id);
+		dormant->idle_id = 0;
+	}
+
+	dormant_leave(priv);
+	TN_INFO("Tor was dormant %u times, for %" G_GINT64_FORMAT " s", dormant->dormant_count,
+		dormant->dormant_us / G_USEC_PER_SEC);
+}
+
+/* Returns (boolean dormant, uint64 ms dormant, uint32 times dormant, uint64
+ * wakeups avoided), the dormant time including the current period */
+DBusHandlerResult getdormantstats_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	network_tor_private *priv = user_data;
+	tor_dormant *dormant = &priv->dormant;
+	gint64 dormant_us = dormant->dormant_us;
+	dbus_bool_t is_dormant = dormant->dormant;
+	dbus_uint64_t dormant_ms, wakeups_avoided;
+	dbus_uint32_t dormant_count = dormant->dormant_count;
+
+	if (dormant->dormant)
+		dormant_us += g_get_monotonic_time() - dormant->dormant_since;
+	dormant_ms = dormant_us / 1000;
+	wakeups_avoided = dormant_us / G_USEC_PER_SEC * TOR_ACTIVE_WAKEUPS_PER_SECOND;
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	dbus_message_append_args(reply, DBUS_TYPE_BOOLEAN, &is_dormant, DBUS_TYPE_UINT64, &dormant_ms,
+				 DBUS_TYPE_UINT32, &dormant_count, DBUS_TYPE_UINT64, &wakeups_avoided,
+				 DBUS_TYPE_INVALID);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
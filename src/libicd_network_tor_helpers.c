@@ -19,8 +19,38 @@
  *
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
 #include "libicd_network_tor.h"
 
+/* Stack for the launcher child, it only has to get as far as execv */
+#define SPAWN_STACK_SIZE (64 * 1024)
+
+#define SPAWN_MAX_GROUPS 64
+
+/* The plain variants take 16 bit ids on arm and i386 */
+#ifdef SYS_setuid32
+#define SPAWN_SYS_SETGROUPS SYS_setgroups32
+#define SPAWN_SYS_SETGID SYS_setgid32
+#define SPAWN_SYS_SETUID SYS_setuid32
+#else
+#define SPAWN_SYS_SETGROUPS SYS_setgroups
+#define SPAWN_SYS_SETGID SYS_setgid
+#define SPAWN_SYS_SETUID SYS_setuid
+#endif
+
+static void shared_detach(tor_network_data * network_data, gboolean park);
+static gboolean shared_exit_cb(gpointer user_data);
+
 /* XXX: Taken from ipv4 module */
 gboolean string_equal(const char *a, const char *b)
 {
@@ -50,61 +80,287 @@ tor_network_data *icd_tor_find_first_network_data(network_tor_private * private)
 	return NULL;
 }
 
+static gchar *network_key(const gchar * network_type, guint network_attrs, const gchar * network_id)
+{
+	return g_strdup_printf("%u\x1f%s\x1f%s", network_attrs, network_type ? network_type : "",
+			       network_id ? network_id : "");
+}
+
 tor_network_data *icd_tor_find_network_data(const gchar * network_type,
 					    guint network_attrs,
 					    const gchar * network_id, network_tor_private * private)
+{
+	tor_network_data *found;
+	gchar *key = network_key(network_type, network_attrs, network_id);
+
+	found = g_hash_table_lookup(private->network_data_by_key, key);
+	g_free(key);
+
+	return found;
+}
+
+tor_network_data *icd_tor_find_network_data_by_pid(network_tor_private * private, pid_t pid)
+{
+	if (pid == 0)
+		return NULL;
+
+	return g_hash_table_lookup(private->network_data_by_pid, GINT_TO_POINTER(pid));
+}
+
+/* The Tor service provider IAP, preferably one in the given Tor state */
+tor_network_data *icd_tor_find_provider_network_data(network_tor_private * private, gboolean tor_running)
 {
 	GSList *l;
+	tor_network_data *provider = NULL;
 
 	for (l = private->network_data_list; l; l = l->next) {
 		tor_network_data *found = (tor_network_data *) l->data;
 
-		if (!found)
-			TN_WARN("tor network data is NULL");
-		else {
-			if (found->network_attrs == network_attrs &&
-			    string_equal(found->network_type, network_type) &&
-			    string_equal(found->network_id, network_id)) {
-				return found;
-			}
-		}
+		if (!found->state.service_provider_mode)
+			continue;
+
+		if (found->state.tor_running == tor_running)
+			return found;
+
+		if (provider == NULL)
+			provider = found;
 	}
 
-	return NULL;
+	return provider;
+}
+
+/* The provider IAP Start and Stop act on, NULL if there is none or several
+ * of them and it is unclear which one is meant */
+tor_network_data *icd_tor_find_dbus_network_data(network_tor_private * private, gboolean tor_running)
+{
+	GSList *l;
+	guint providers = 0;
+
+	for (l = private->network_data_list; l; l = l->next) {
+		tor_network_data *found = (tor_network_data *) l->data;
+
+		if (found->state.service_provider_mode)
+			providers++;
+	}
+
+	if (providers > 1) {
+		TN_WARN("%u provider IAPs are connected, refusing the call", providers);
+		return NULL;
+	}
+
+	return icd_tor_find_provider_network_data(private, tor_running);
+}
+
+/* The IAP GetStatus and the properties describe: the provider's, or else the
+ * most recent one */
+tor_network_data *icd_tor_find_status_network_data(network_tor_private * private)
+{
+	tor_network_data *network_data = icd_tor_find_provider_network_data(private, TRUE);
+
+	if (network_data == NULL)
+		network_data = icd_tor_find_first_network_data(private);
+
+	return network_data;
+}
+
+/* Whether network_data was not freed in the meantime */
+gboolean icd_tor_network_data_alive(network_tor_private * private, tor_network_data * network_data)
+{
+	return g_slist_find(private->network_data_list, network_data) != NULL;
+}
+
+gboolean icd_tor_any_tor_running(network_tor_private * private)
+{
+	GSList *l;
+
+	for (l = private->network_data_list; l; l = l->next) {
+		tor_network_data *found = (tor_network_data *) l->data;
+
+		if (found->state.tor_running)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+void network_index_add(tor_network_data * network_data)
+{
+	network_tor_private *priv = network_data->private;
+
+	network_data->network_key = network_key(network_data->network_type, network_data->network_attrs,
+						network_data->network_id);
+
+	if (g_hash_table_lookup(priv->network_data_by_key, network_data->network_key) != NULL)
+		TN_ERR("ip_up called for %s, which is already connected", network_data->network_id);
+
+	priv->network_data_list = g_slist_prepend(priv->network_data_list, network_data);
+	/* Replace the key too, the old one goes with the old network_data */
+	g_hash_table_replace(priv->network_data_by_key, network_data->network_key, network_data);
 }
 
-/* pathname and arg are like in execv, returns pid, 0 is error */
+void network_set_tor_pid(tor_network_data * network_data, pid_t pid)
+{
+	network_tor_private *priv = network_data->private;
+
+	if (network_data->tor_pid != 0)
+		g_hash_table_remove(priv->network_data_by_pid, GINT_TO_POINTER(network_data->tor_pid));
+
+	network_data->tor_pid = pid;
+
+	if (pid != 0)
+		g_hash_table_insert(priv->network_data_by_pid, GINT_TO_POINTER(pid), network_data);
+
+	properties_changed(priv);
+}
+
+/* Credentials of the user we launch as, looked up once */
+static struct {
+	gchar *username;
+	uid_t uid;
+	gid_t gid;
+	gid_t groups[SPAWN_MAX_GROUPS];
+	int ngroups;
+} spawn_creds;
+
+struct spawn_child_args {
+	const char *pathname;
+	char **args;
+	sigset_t sigmask;
+	int max_fd;
+	/* Already running as the user, there is nothing to drop */
+	gboolean same_user;
+
+	/* Set by the child when execv failed, we share its memory */
+	int error;
+};
+
+static gboolean spawn_lookup_creds(const char *username)
+{
+	struct passwd *ent;
+
+	if (spawn_creds.username && !strcmp(spawn_creds.username, username))
+		return TRUE;
+
+	ent = getpwnam(username);
+	if (ent == NULL)
+		return FALSE;
+
+	if (ent->pw_uid == 0) {
+		TN_CRIT("spawn_as: refusing to run as %s, it is root\n", username);
+		return FALSE;
+	}
+
+	spawn_creds.uid = ent->pw_uid;
+	spawn_creds.gid = ent->pw_gid;
+	spawn_creds.ngroups = SPAWN_MAX_GROUPS;
+	if (getgrouplist(username, ent->pw_gid, spawn_creds.groups, &spawn_creds.ngroups) < 0) {
+		spawn_creds.groups[0] = ent->pw_gid;
+		spawn_creds.ngroups = 1;
+	}
+
+	g_free(spawn_creds.username);
+	spawn_creds.username = g_strdup(username);
+
+	return TRUE;
+}
+
+/* Runs on the parent's memory until execv, so only async-signal-safe calls
+ * and raw syscalls here: the libc setuid() wrappers would try to synchronise
+ * with the parent's threads. */
+static int spawn_child(void *data)
+{
+	struct spawn_child_args *child = data;
+	struct sigaction sa;
+	int fd, sig;
+
+	/* Don't run any of the parent's signal handlers in here */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	for (sig = 1; sig < NSIG; sig++)
+		sigaction(sig, &sa, NULL);
+	sigprocmask(SIG_SETMASK, &child->sigmask, NULL);
+
+	fd = open("/dev/null", O_RDWR);
+	if (fd < 0)
+		goto fail;
+	if (dup2(fd, STDIN_FILENO) < 0 || dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0)
+		goto fail;
+
+	/* Don't leak ICd's sockets and files to Tor */
+	for (fd = STDERR_FILENO + 1; fd < child->max_fd; fd++)
+		close(fd);
+
+	if (!child->same_user) {
+		if (syscall(SPAWN_SYS_SETGROUPS, spawn_creds.ngroups, spawn_creds.groups) != 0)
+			goto fail;
+		if (syscall(SPAWN_SYS_SETGID, spawn_creds.gid) != 0)
+			goto fail;
+		if (syscall(SPAWN_SYS_SETUID, spawn_creds.uid) != 0)
+			goto fail;
+	}
+
+	execv(child->pathname, child->args);
+
+ fail:
+	child->error = errno ? errno : ECHILD;
+	_exit(127);
+}
+
+/* pathname and arg are like in execv, returns pid, 0 is error. The process
+ * never keeps our own (root) credentials. */
 pid_t spawn_as(const char *username, const char *pathname, char *args[])
 {
-	struct passwd *ent = getpwnam(username);
-	if (ent == NULL) {
-		TN_CRIT("spawn_as: getpwnam failed\n");
+	struct spawn_child_args child;
+	struct rlimit rl;
+	sigset_t all;
+	char *stack;
+	pid_t pid;
+
+	memset(&child, 0, sizeof(child));
+
+	if (username == NULL || *username == '\0') {
+		TN_CRIT("spawn_as: no user to run as\n");
+		return 0;
+	}
+	if (!spawn_lookup_creds(username)) {
+		TN_CRIT("spawn_as: no usable user %s\n", username);
 		return 0;
 	}
 
-	pid_t pid = fork();
+	child.pathname = pathname;
+	child.args = args;
+	/* Never for ICd, which runs as root, but the tests do not */
+	child.same_user = getuid() == spawn_creds.uid && getgid() == spawn_creds.gid;
+	child.max_fd = 1024;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < 65536)
+		child.max_fd = rl.rlim_cur;
+
+	stack = g_malloc(SPAWN_STACK_SIZE);
+
+	/* The child restores the mask once its handlers are reset */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &child.sigmask);
+
+	/* The parent is suspended until the child called execv or exited, so
+	 * there is no copy of ICd's address space like with fork() */
+	pid = clone(spawn_child, stack + SPAWN_STACK_SIZE, CLONE_VM | CLONE_VFORK | SIGCHLD, &child);
+
+	pthread_sigmask(SIG_SETMASK, &child.sigmask, NULL);
+	g_free(stack);
+
 	if (pid < 0) {
-		TN_CRIT("spawn_as: fork() failed\n");
+		TN_CRIT("spawn_as: clone() failed: %s\n", strerror(errno));
 		return 0;
-	} else if (pid == 0) {
-		if (setgid(ent->pw_gid)) {
-			TN_CRIT("setgid failed\n");
-			exit(1);
-		}
-		if (setuid(ent->pw_uid)) {
-			TN_CRIT("setuid failed\n");
-			exit(1);
-		}
-		execv(pathname, args);
+	}
 
-		TN_CRIT("execv failed\n");
-		exit(1);
-	} else {
-		TN_DEBUG("spawn_as got pid: %d\n", pid);
-		return pid;
+	if (child.error != 0) {
+		TN_CRIT("spawn_as: could not execute %s: %s\n", pathname, strerror(child.error));
+		waitpid(pid, NULL, 0);
+		return 0;
 	}
 
-	return 0;		// Failure
+	TN_DEBUG("spawn_as got pid: %d\n", pid);
+	return pid;
 }
 
 void network_free_all(tor_network_data * network_data)
@@ -113,120 +369,1438 @@ void network_free_all(tor_network_data * network_data)
 	if (priv->network_data_list) {
 		priv->network_data_list = g_slist_remove(priv->network_data_list, network_data);
 	}
+	if (network_data->network_key != NULL
+	    && g_hash_table_lookup(priv->network_data_by_key, network_data->network_key) == network_data)
+		g_hash_table_remove(priv->network_data_by_key, network_data->network_key);
+	network_set_tor_pid(network_data, 0);
+
+	shared_detach(network_data, FALSE);
+	if (network_data->shared_exit_id) {
+		g_source_remove(network_data->shared_exit_id);
+		network_data->shared_exit_id = 0;
+	}
+
+	bootstrap_watch_stop(network_data);
+	transproxy_job_cancel(network_data->transproxy_job);
+	timeline_finish(network_data, FALSE);
 
+	g_free(network_data->config);
+	g_free(network_data->torrc);
+	g_free(network_data->reload_config);
+	g_free(network_data->reload_torrc);
+	g_free(network_data->bootstrap_tag);
+	g_free(network_data->bootstrap_summary);
 	g_free(network_data->network_type);
 	g_free(network_data->network_id);
+	g_free(network_data->network_key);
+	free(network_data->state.active_config);
 
 	network_data->private = NULL;
 
 	g_free(network_data);
 }
 
-void network_stop_all(tor_network_data * network_data)
+/* The IAP other than network_data whose own Tor runs config */
+static tor_network_data *tor_owner_find(tor_network_data * network_data, const char *config)
+{
+	GSList *l;
+
+	for (l = network_data->private->network_data_list; l; l = l->next) {
+		tor_network_data *other = (tor_network_data *) l->data;
+
+		if (other != network_data && other->tor_pid != 0 && string_equal(other->config, config))
+			return other;
+	}
+
+	return NULL;
+}
+
+/* An IAP using the Tor of network_data */
+static tor_network_data *tor_borrower_find(tor_network_data * network_data)
+{
+	GSList *l;
+
+	if (network_data->tor_pid == 0)
+		return NULL;
+
+	for (l = network_data->private->network_data_list; l; l = l->next) {
+		tor_network_data *other = (tor_network_data *) l->data;
+
+		if (other != network_data && other->borrowed && string_equal(other->config, network_data->config))
+			return other;
+	}
+
+	return NULL;
+}
+
+/* Leave our Tor running for an IAP that uses it. Returns FALSE if there is
+ * none, else network_data gets its pid exit from the main loop. */
+static gboolean tor_hand_over(tor_network_data * network_data)
+{
+	tor_network_data *heir = tor_borrower_find(network_data);
+	pid_t pid = network_data->tor_pid;
+
+	if (heir == NULL)
+		return FALSE;
+
+	TN_INFO("Tor (pid %d) handed over to %s", pid, heir->network_id);
+
+	network_set_tor_pid(network_data, 0);
+	heir->borrowed = FALSE;
+	network_set_tor_pid(heir, pid);
+
+	network_data->shared_exit_id = g_idle_add(shared_exit_cb, network_data);
+
+	return TRUE;
+}
+
+/* Our Tor quit, which is a Tor exit for the IAPs using it too */
+void tor_borrowers_exited(tor_network_data * network_data)
 {
-	if (network_data->transproxy_enabled) {
-		transproxy_onoff(FALSE, NULL);
+	network_tor_private *priv = network_data->private;
+	GSList *borrowers = NULL, *l;
+	tor_network_data *borrower;
+
+	while ((borrower = tor_borrower_find(network_data)) != NULL) {
+		borrower->borrowed = FALSE;
+		borrowers = g_slist_prepend(borrowers, borrower);
 	}
-	if (network_data->tor_pid != 0) {
+
+	for (l = borrowers; l; l = l->next) {
+		borrower = (tor_network_data *) l->data;
+
+		if (!icd_tor_network_data_alive(priv, borrower))
+			continue;
+
+		network_tor_state new_state;
+		memcpy(&new_state, &borrower->state, sizeof(network_tor_state));
+		new_state.tor_running = FALSE;
+		new_state.tor_bootstrapped = FALSE;
+
+		tor_state_change(priv, borrower, new_state, EVENT_SOURCE_TOR_PID_EXIT);
+	}
+	g_slist_free(borrowers);
+}
+
+void network_stop_all(tor_network_data * network_data)
+{
+	transproxy_onoff(network_data, FALSE, NULL);
+	if (network_data->shared) {
+		shared_detach(network_data, FALSE);
+		network_data->shared_exit_id = g_idle_add(shared_exit_cb, network_data);
+	} else if (network_data->borrowed) {
+		network_data->borrowed = FALSE;
+		network_data->shared_exit_id = g_idle_add(shared_exit_cb, network_data);
+	} else if (network_data->tor_pid != 0 && !tor_hand_over(network_data)) {
 		kill(network_data->tor_pid, SIGTERM);
 	}
-	if (network_data->wait_for_tor_pid != 0) {
-		kill(network_data->wait_for_tor_pid, SIGTERM);
+	bootstrap_watch_stop(network_data);
+}
+
+/* Returns the value of KEY=value or KEY="quoted value" in a status line */
+static gchar *parse_status_value(const char *status, const char *key)
+{
+	gchar *needle = g_strconcat(" ", key, "=", NULL);
+	const char *value = strstr(status, needle);
+	GString *ret;
+
+	if (value == NULL) {
+		g_free(needle);
+		return NULL;
+	}
+	value += strlen(needle);
+	g_free(needle);
+
+	if (*value != '"')
+		return g_strndup(value, strcspn(value, " \n"));
+
+	ret = g_string_new(NULL);
+	for (value++; *value && *value != '"'; value++) {
+		if (*value == '\\' && value[1] != '\0')
+			value++;
+		g_string_append_c(ret, *value);
 	}
+
+	return g_string_free(ret, FALSE);
 }
 
-int transproxy_onoff(gboolean on, char *config)
+/* Returns the PROGRESS= value of a BOOTSTRAP status line, or -1 */
+static int parse_bootstrap_status(const char *status, gchar ** tag, gchar ** summary)
 {
-	GError *error = NULL;
-	int exit_code = 0;
-	int ret = 0;
+	gchar *progress;
+	int ret;
 
-	const char *action = NULL;
-	char *cmdline = NULL;
+	if (strstr(status, " BOOTSTRAP ") == NULL)
+		return -1;
 
-	if (on) {
-		action = "enable";
-		cmdline = g_strdup_printf("/usr/bin/libicd-tor-transproxy %s %s", action, config);
-	} else {
-		action = "disable";
-		cmdline = g_strdup_printf("/usr/bin/libicd-tor-transproxy %s %s", action, "config_is_irrelevant");
+	progress = parse_status_value(status, "PROGRESS");
+	if (progress == NULL)
+		return -1;
+	ret = atoi(progress);
+	g_free(progress);
+
+	*tag = parse_status_value(status, "TAG");
+	*summary = parse_status_value(status, "SUMMARY");
+
+	return ret;
+}
+
+void set_bootstrap_progress(tor_network_data * network_data, int progress, const char *tag, const char *summary)
+{
+	network_tor_private *priv = network_data->private;
+	gboolean changed = network_data->bootstrap_progress != progress;
+
+	network_data->bootstrap_progress = progress;
+	g_free(network_data->bootstrap_tag);
+	network_data->bootstrap_tag = g_strdup(tag ? tag : "");
+	g_free(network_data->bootstrap_summary);
+	network_data->bootstrap_summary = g_strdup(summary ? summary : "");
+
+	/* Tor repeats phases (and warns) at the same percentage, don't spam.
+	 * Only the IAP the status is about is reported. */
+	if (changed && network_data == icd_tor_find_status_network_data(priv)) {
+		emit_bootstrap_signal(priv);
+		properties_changed(priv);
 	}
+}
 
-	g_spawn_command_line_sync(cmdline, NULL, NULL, &exit_code, &error);
+static void bootstrap_finished(tor_network_data * network_data, gboolean bootstrapped)
+{
+	network_tor_private *priv = network_data->private;
 
-	if (error) {
-		ret = 1;
-		TN_WARN("Failed to %s transproxy rules: %s", action, error->message);
-		g_clear_error(&error);
-		goto done;
+	if (network_data->bootstrap_timeout_id) {
+		g_source_remove(network_data->bootstrap_timeout_id);
+		network_data->bootstrap_timeout_id = 0;
 	}
+	network_data->resuming = FALSE;
+
+	if (bootstrapped)
+		timeline_mark(network_data, TOR_STAGE_BOOTSTRAPPED);
 
-	if (exit_code != 0) {
-		ret = 1;
-		TN_WARN("%s transproxy rules failed to apply with exit code: %d", action, exit_code);
-		goto done;
+	/* Keep the control connection around while Tor runs */
+	if (!bootstrapped) {
+		onion_control_lost(network_data->private, network_data->control);
+		tor_control_free(network_data->control);
+		network_data->control = NULL;
 	}
 
-	ret = 0;
+	network_tor_state new_state;
+	memcpy(&new_state, &network_data->state, sizeof(network_tor_state));
+	new_state.tor_bootstrapped_running = FALSE;
+	new_state.tor_bootstrapped = bootstrapped;
 
- done:
-	if (cmdline)
-		g_free(cmdline);
-	return ret;
+	tor_state_change(priv, network_data, new_state, EVENT_SOURCE_TOR_BOOTSTRAPPED);
 }
 
-int startup_tor(tor_network_data * network_data, char *config)
+static void bootstrap_progress(tor_network_data * network_data, const char *status)
 {
-	char config_filename[256];
-	if (snprintf(config_filename, 256, "/etc/tor/torrc-network-%s", config)
-	    >= 256) {
-		TN_WARN("Unable to allocate torrc config filename\n");
-		return 1;
+	gchar *tag = NULL, *summary = NULL;
+	int progress = parse_bootstrap_status(status, &tag, &summary);
+
+	if (progress < 0 || network_data->bootstrap_timeout_id == 0) {
+		g_free(tag);
+		g_free(summary);
+		return;
 	}
 
-	char *config_content = generate_config(config);
-	GError *error = NULL;
-	g_file_set_contents(config_filename, config_content, strlen(config_content), &error);
-	if (error != NULL) {
-		g_clear_error(&error);
-		TN_WARN("Unable to write Tor config file\n");
-		return 1;
+	TN_DEBUG("Tor bootstrap progress: %d%% (%s)", progress, summary);
+	set_bootstrap_progress(network_data, progress, tag, summary);
+	g_free(tag);
+	g_free(summary);
+
+	if (progress >= 100) {
+		TN_INFO("Tor finished bootstrapping");
+		bootstrap_finished(network_data, TRUE);
+	}
+}
+
+static void circuit_established_reply(tor_control * control, int code, const char *reply, gpointer user_data)
+{
+	tor_network_data *network_data = user_data;
+
+	if (code != 250) {
+		TN_WARN("Could not get circuit status: %d %s", code, reply);
+		return;
 	}
 
-	char *argss[] = { "/usr/bin/tor", "-f", config_filename, NULL };
-	pid_t pid = spawn_as("debian-tor", "/usr/bin/tor", argss);
-	if (pid == 0) {
-		TN_WARN("Failed to start Tor\n");
-		return 1;
+	if (network_data->bootstrap_timeout_id != 0 && strstr(reply, "status/circuit-established=1")) {
+		TN_INFO("Tor resumed from warm standby");
+		set_bootstrap_progress(network_data, 100, "done", "Done");
+		bootstrap_finished(network_data, TRUE);
+	}
+}
+
+static void bootstrap_phase_reply(tor_control * control, int code, const char *reply, gpointer user_data)
+{
+	if (code != 250) {
+		TN_WARN("Could not get bootstrap phase: %d %s", code, reply);
+		return;
 	}
 
-	TN_INFO("Got tor_pid: %d\n", pid);
-	network_data->tor_pid = pid;
-	network_data->private->watch_cb(pid, network_data->private->watch_cb_token);
+	bootstrap_progress(user_data, reply);
+}
+
+static void bootstrap_event_cb(tor_control * control, const char *event, gpointer user_data)
+{
+	tor_network_data *network_data = user_data;
 
-	network_data->transproxy_enabled = config_has_transproxy(config);
+	if (g_str_has_prefix(event, "STREAM ")) {
+		dormant_stream_event(network_data->private, event);
+		return;
+	}
+
+	if (!g_str_has_prefix(event, "STATUS_CLIENT "))
+		return;
 
-	if (network_data->transproxy_enabled) {
-		transproxy_onoff(TRUE, config);
+	if (network_data->resuming && strstr(event, " CIRCUIT_ESTABLISHED")) {
+		circuit_established_reply(control, 250, "status/circuit-established=1", network_data);
+		return;
 	}
 
-	gchar *gc_controlport = g_strjoin("/", GC_TOR, config, GC_CONTROLPORT, NULL);
-	GConfClient *gconf = gconf_client_get_default();
-	gint control_port = gconf_client_get_int(gconf, gc_controlport, NULL);
-	g_object_unref(gconf);
-	g_free(gc_controlport);
-	char cport[64];
-	snprintf(cport, 64, "%d", control_port);
+	bootstrap_progress(network_data, event);
+}
+
+static void bridges_setconf_reply(tor_control * control, int code, const char *reply, gpointer user_data)
+{
+	if (code != 250)
+		TN_WARN("Tor refused the probed bridges: %d %s", code, reply);
+}
 
-	char *argsv[] = { "/usr/bin/libicd-tor-wait-bootstrapped", cport, NULL };
+/* Hand Tor the fastest bridges and let it connect, once both the probe and
+ * the control connection are done. The torrc keeps all bridges, so it only
+ * changes with the configuration. */
+static void bridges_apply(tor_network_data * network_data)
+{
+	const tor_config *config;
+	GString *command;
+	gchar **lines, *bridges;
+	int i;
 
-	pid = spawn_as("debian-tor", "/usr/bin/libicd-tor-wait-bootstrapped", argsv);
-	if (pid == 0) {
-		TN_WARN("Failed to start wait for bootstrapping script\n");
+	if (!network_data->bridges_pending || network_data->bridges_probe != NULL
+	    || !tor_control_is_ready(network_data->control))
+		return;
+
+	network_data->bridges_pending = FALSE;
+
+	config = config_get(network_data->config);
+	if (config != NULL && config->bridges_enabled && config->bridges) {
+		bridges = tor_bridges_select(config->bridges,
+					     config->bridges_max > 0 ? config->bridges_max : TOR_BRIDGES_DEFAULT_MAX);
+		command = g_string_new("SETCONF");
+		lines = g_strsplit(bridges, "\n", -1);
+		for (i = 0; lines[i] != NULL; i++) {
+			gchar *quoted;
+
+			if (!g_str_has_prefix(lines[i], "Bridge "))
+				continue;
+
+			quoted = tor_control_quote(lines[i] + strlen("Bridge "));
+			if (quoted == NULL) {
+				TN_WARN("Skipping bridge line with control characters in it");
+				continue;
+			}
+			g_string_append_printf(command, " Bridge=%s", quoted);
+			g_free(quoted);
+		}
+		g_strfreev(lines);
+		g_free(bridges);
+
+		if (command->len > strlen("SETCONF"))
+			tor_control_send(network_data->control, command->str, bridges_setconf_reply, NULL);
+		g_string_free(command, TRUE);
+	}
+
+	tor_control_send(network_data->control, "SETCONF DisableNetwork=0", NULL, NULL);
+}
+
+static void bridges_probed_cb(gpointer user_data)
+{
+	tor_network_data *network_data = user_data;
+
+	/* The probe freed itself */
+	network_data->bridges_probe = NULL;
+	bridges_apply(network_data);
+}
+
+/* Probe the bridges of config that have no recent result. Returns TRUE if
+ * Tor has to keep its network off until bridges_apply() ran. */
+static gboolean bridges_probe_start(tor_network_data * network_data, const char *config)
+{
+	const tor_config *tc = config_get(config);
+
+	if (tc == NULL || !tc->bridges_enabled || tc->bridges == NULL)
+		return FALSE;
+
+	tor_bridges_probe_free(network_data->bridges_probe);
+	network_data->bridges_probe = tor_bridges_probe_new(tc->bridges, TOR_BRIDGES_PROBE_TIMEOUT_MS,
+							    bridges_probed_cb, network_data);
+	network_data->bridges_pending = TRUE;
+
+	return TRUE;
+}
+
+/* Take over the probe of the Tor in warm standby that is being resumed,
+ * instead of connecting to the same bridges again */
+static gboolean bridges_probe_resume(tor_network_data * network_data, const char *config)
+{
+	network_tor_private *priv = network_data->private;
+
+	if (priv->standby_bridges_probe == NULL)
+		return bridges_probe_start(network_data, config);
+
+	tor_bridges_probe_free(network_data->bridges_probe);
+	network_data->bridges_probe = priv->standby_bridges_probe;
+	priv->standby_bridges_probe = NULL;
+	tor_bridges_probe_set_callback(network_data->bridges_probe, bridges_probed_cb, network_data);
+	network_data->bridges_pending = TRUE;
+
+	return TRUE;
+}
+
+static void bridges_probe_stop(tor_network_data * network_data)
+{
+	tor_bridges_probe_free(network_data->bridges_probe);
+	network_data->bridges_probe = NULL;
+	network_data->bridges_pending = FALSE;
+}
+
+/* A LOADCONF lost with the connection never gets its reply, so it is
+ * sent again once we are back */
+static void bootstrap_lost_cb(tor_control * control, gpointer user_data)
+{
+	tor_network_data *network_data = user_data;
+
+	onion_control_lost(network_data->private, control);
+
+	if (network_data->reload_torrc == NULL)
+		return;
+
+	TN_WARN("Lost the Tor control connection while reloading");
+
+	g_free(network_data->reload_config);
+	network_data->reload_config = NULL;
+	g_free(network_data->reload_torrc);
+	network_data->reload_torrc = NULL;
+	network_data->reload_again = TRUE;
+}
+
+static void bootstrap_ready_cb(tor_control * control, gpointer user_data)
+{
+	tor_network_data *network_data = user_data;
+
+	if (network_data->reload_again && network_data->reload_torrc == NULL) {
+		network_tor_state new_state;
+
+		network_data->reload_again = FALSE;
+		memcpy(&new_state, &network_data->state, sizeof(network_tor_state));
+		tor_state_change(network_data->private, network_data, new_state, EVENT_SOURCE_CONFIG_CHANGE);
+		if (!icd_tor_network_data_alive(network_data->private, network_data)
+		    || network_data->control != control)
+			return;
+	}
+
+	/* Also after reconnecting, which lost the onion services. Attached IAPs
+	 * come and go, the shared Tor's own connection holds them instead. */
+	if (!network_data->shared)
+		onion_restore(control, network_data->config);
+
+	if (network_data->bootstrap_timeout_id == 0) {
+		/* Reconnected after bootstrapping, only streams matter now */
+		tor_control_send(control, dormant_setevents(network_data->private), NULL, NULL);
+		return;
+	}
+
+	timeline_mark(network_data, TOR_STAGE_CONTROL_READY);
+
+	if (network_data->resuming) {
+		if (!network_data->bridges_pending)
+			tor_control_send(control, "SETCONF DisableNetwork=0", NULL, NULL);
+		tor_control_send(control, "SIGNAL ACTIVE", NULL, NULL);
+	}
+	bridges_apply(network_data);
+
+	/* Subscribe first, then ask, so we cannot miss the last phase */
+	tor_control_send(control, dormant_setevents(network_data->private), NULL, NULL);
+	if (network_data->resuming)
+		tor_control_send(control, "GETINFO status/circuit-established", circuit_established_reply,
+				 network_data);
+	else
+		tor_control_send(control, "GETINFO status/bootstrap-phase", bootstrap_phase_reply, network_data);
+}
+
+static gboolean bootstrap_timeout_cb(gpointer user_data)
+{
+	tor_network_data *network_data = user_data;
+
+	TN_WARN("Tor did not bootstrap within %d seconds", TOR_BOOTSTRAP_TIMEOUT);
+
+	network_data->bootstrap_timeout_id = 0;
+	bootstrap_finished(network_data, FALSE);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Circuits for the warm-up profile of the configuration Tor runs */
+void warmup_start(tor_network_data * network_data)
+{
+	const tor_config *config = config_get(network_data->config);
+	int socks_port;
+
+	tor_warmup_free(network_data->warmup);
+	network_data->warmup = NULL;
+
+	if (config == NULL || config->warmup == NULL)
+		return;
+
+	socks_port = network_data->socks_port ? network_data->socks_port : config->socks_port;
+	network_data->warmup = tor_warmup_new(socks_port, config->warmup, MAX(config->warmup_refresh, 0),
+					      &network_data->private->warmup_stats);
+}
+
+void bootstrap_watch_stop(tor_network_data * network_data)
+{
+	bridges_probe_stop(network_data);
+
+	tor_warmup_free(network_data->warmup);
+	network_data->warmup = NULL;
+
+	if (network_data->bootstrap_timeout_id) {
+		g_source_remove(network_data->bootstrap_timeout_id);
+		network_data->bootstrap_timeout_id = 0;
+	}
+
+	onion_control_lost(network_data->private, network_data->control);
+	tor_control_free(network_data->control);
+	network_data->control = NULL;
+}
+
+void standby_stop(network_tor_private * priv)
+{
+	if (priv->standby_tor_pid != 0) {
+		TN_INFO("Stopping Tor in warm standby (pid %d)", priv->standby_tor_pid);
+		kill(priv->standby_tor_pid, SIGTERM);
+		priv->standby_tor_pid = 0;
+	}
+
+	tor_bridges_probe_free(priv->standby_bridges_probe);
+	priv->standby_bridges_probe = NULL;
+
+	onion_control_lost(priv, priv->standby_control);
+	tor_control_free(priv->standby_control);
+	priv->standby_control = NULL;
+	g_free(priv->standby_config);
+	priv->standby_config = NULL;
+	g_free(priv->standby_torrc);
+	priv->standby_torrc = NULL;
+	priv->standby_prestarted = FALSE;
+}
+
+/* Instead of stopping Tor, cut it off from the network and keep it (and its
+ * guards, consensus and descriptors) around for the next connection. Returns
+ * TRUE if Tor was parked, in which case the caller should not expect a pid
+ * exit. */
+gboolean network_park_tor(tor_network_data * network_data)
+{
+	network_tor_private *priv = network_data->private;
+
+	/* The shared Tor keeps running for the others */
+	if (network_data->shared) {
+		shared_detach(network_data, TRUE);
+		return TRUE;
+	}
+
+	if (network_data->tor_pid == 0 || network_data->config == NULL)
+		return FALSE;
+
+	/* Another IAP still uses it, network_stop_all() hands it over */
+	if (tor_borrower_find(network_data) != NULL)
+		return FALSE;
+
+	if (!tor_control_is_ready(network_data->control) || !get_warm_standby_enabled())
+		return FALSE;
+
+	/* Only one Tor is kept in standby */
+	standby_stop(priv);
+
+	if (tor_control_send(network_data->control, "SETCONF DisableNetwork=1", NULL, NULL) != 0)
+		return FALSE;
+
+	transproxy_onoff(network_data, FALSE, NULL);
+	tor_warmup_free(network_data->warmup);
+	network_data->warmup = NULL;
+
+	if (network_data->bootstrap_timeout_id) {
+		g_source_remove(network_data->bootstrap_timeout_id);
+		network_data->bootstrap_timeout_id = 0;
+	}
+	network_data->resuming = FALSE;
+
+	TN_INFO("Parking Tor (pid %d) in warm standby", network_data->tor_pid);
+
+	/* Replies still on their way must not reach network_data once the
+	 * control connection is no longer its own */
+	tor_control_set_callbacks(network_data->control, NULL, NULL, NULL);
+	tor_control_cancel(network_data->control, network_data);
+	g_free(network_data->reload_config);
+	network_data->reload_config = NULL;
+	g_free(network_data->reload_torrc);
+	network_data->reload_torrc = NULL;
+	network_data->reload_again = FALSE;
+	priv->standby_tor_pid = network_data->tor_pid;
+	priv->standby_control = network_data->control;
+	priv->standby_config = network_data->config;
+	priv->standby_torrc = network_data->torrc;
+
+	network_set_tor_pid(network_data, 0);
+	network_data->control = NULL;
+	network_data->config = NULL;
+	network_data->torrc = NULL;
+
+	set_bootstrap_progress(network_data, 0, NULL, NULL);
+
+	return TRUE;
+}
+
+/* Take over Tor from warm standby if it runs the configuration we want */
+static gboolean standby_resume(tor_network_data * network_data, const char *config, const char *torrc)
+{
+	network_tor_private *priv = network_data->private;
+
+	if (priv->standby_tor_pid == 0)
+		return FALSE;
+
+	if (!string_equal(priv->standby_config, config) || !string_equal(priv->standby_torrc, torrc)
+	    || priv->standby_control == NULL) {
+		standby_stop(priv);
+		return FALSE;
+	}
+
+	TN_INFO("Resuming Tor (pid %d) from warm standby", priv->standby_tor_pid);
+
+	network_data->timeline.start_kind = priv->standby_prestarted ? "pre-started" : "warm standby";
+
+	network_set_tor_pid(network_data, priv->standby_tor_pid);
+	network_data->control = priv->standby_control;
+	network_data->config = priv->standby_config;
+	network_data->torrc = priv->standby_torrc;
+
+	priv->standby_tor_pid = 0;
+	priv->standby_control = NULL;
+	priv->standby_config = NULL;
+	priv->standby_torrc = NULL;
+
+	transproxy_onoff(network_data, config_has_transproxy(config), config);
+
+	/* The network stays off until the fastest bridges are set */
+	bridges_probe_resume(network_data, config);
+
+	tor_control_set_callbacks(network_data->control, bootstrap_ready_cb, bootstrap_event_cb, network_data);
+	tor_control_set_lost_callback(network_data->control, bootstrap_lost_cb);
+
+	network_data->resuming = TRUE;
+	network_data->bootstrap_timeout_id = g_timeout_add_seconds(TOR_BOOTSTRAP_TIMEOUT,
+								   bootstrap_timeout_cb, network_data);
+
+	/* A pre-started Tor might not have opened its control port yet */
+	if (tor_control_is_ready(network_data->control))
+		bootstrap_ready_cb(network_data->control, network_data);
+
+	return TRUE;
+}
+
+static void transproxy_done(int result, gpointer user_data)
+{
+	tor_network_data *network_data = user_data;
+	network_tor_private *priv = network_data->private;
+
+	network_data->transproxy_job = NULL;
+
+	network_tor_state new_state;
+	memcpy(&new_state, &network_data->state, sizeof(network_tor_state));
+
+	tor_state_change(priv, network_data, new_state,
+			 result == 0 ? EVENT_SOURCE_TRANSPROXY_APPLIED : EVENT_SOURCE_TRANSPROXY_FAILED);
+}
+
+/* Rules are applied in the background, enabling them ends up in
+ * tor_state_change() as EVENT_SOURCE_TRANSPROXY_APPLIED or _FAILED */
+void transproxy_onoff(tor_network_data * network_data, gboolean on, const char *config)
+{
+	network_tor_private *priv = network_data->private;
+	GSList *l;
+
+	transproxy_job_cancel(network_data->transproxy_job);
+	network_data->transproxy_job = NULL;
+	network_data->transproxy_wanted = on;
+
+	/* There is one set of rules, the first IAP asking for it keeps it */
+	for (l = priv->network_data_list; on && l; l = l->next) {
+		tor_network_data *other = (tor_network_data *) l->data;
+
+		if (other != network_data && other->transproxy_enabled) {
+			TN_INFO("Transproxy enabled for %s, %s takes it over when it goes",
+				other->network_id, network_data->network_id);
+			on = FALSE;
+		}
+	}
+
+	if (on) {
+		network_data->transproxy_job = transproxy_enable(config, transproxy_done, network_data);
+	} else if (network_data->transproxy_enabled) {
+		tor_network_data *heir = NULL;
+
+		for (l = priv->network_data_list; l && heir == NULL; l = l->next) {
+			tor_network_data *other = (tor_network_data *) l->data;
+
+			if (other != network_data && other->transproxy_wanted && other->config)
+				heir = other;
+		}
+
+		/* IAPs on the shared Tor use the same rules, which stay as they
+		 * are. Other new rules replace ours in one go, so nothing slips
+		 * past Tor in between. */
+		if (heir && heir->shared && network_data->shared) {
+			TN_INFO("Transproxy on the shared Tor kept for %s", heir->network_id);
+			heir->transproxy_enabled = TRUE;
+		} else if (heir) {
+			TN_INFO("Transproxy handed over to %s", heir->network_id);
+			transproxy_job_cancel(heir->transproxy_job);
+			heir->transproxy_job = transproxy_enable(heir->config, transproxy_done, heir);
+			heir->transproxy_enabled = TRUE;
+		} else {
+			transproxy_disable();
+		}
+	}
+
+	network_data->transproxy_enabled = on;
+	properties_changed(priv);
+}
+
+/* Collect all lines setting key, so they can be compared as a whole */
+static gchar *torrc_lines_for(gchar ** lines, const char *key)
+{
+	GString *ret = g_string_new(NULL);
+	gsize key_len = strlen(key);
+
+	for (; *lines; lines++) {
+		if (strncmp(*lines, key, key_len) == 0 && (*lines)[key_len] == ' ') {
+			g_string_append(ret, *lines);
+			g_string_append_c(ret, '\n');
+		}
+	}
+
+	return g_string_free(ret, FALSE);
+}
+
+/* Listeners and the DataDirectory cannot be changed without a restart, the
+ * rest is reloaded in place */
+static gboolean torrc_needs_restart(const char *old_torrc, const char *new_torrc)
+{
+	static const char *restart_keys[] = {
+		"SocksPort", "ControlPort", "TransPort", "DNSPort", "DataDirectory", NULL
+	};
+	gchar **old_lines, **new_lines;
+	gboolean restart = FALSE;
+	int i;
+
+	if (old_torrc == NULL)
+		return TRUE;
+
+	old_lines = g_strsplit(old_torrc, "\n", -1);
+	new_lines = g_strsplit(new_torrc, "\n", -1);
+
+	for (i = 0; restart_keys[i] != NULL && !restart; i++) {
+		gchar *old_value = torrc_lines_for(old_lines, restart_keys[i]);
+		gchar *new_value = torrc_lines_for(new_lines, restart_keys[i]);
+
+		if (strcmp(old_value, new_value) != 0) {
+			TN_INFO("%s changed, Tor needs a restart", restart_keys[i]);
+			restart = TRUE;
+		}
+
+		g_free(old_value);
+		g_free(new_value);
+	}
+
+	g_strfreev(old_lines);
+	g_strfreev(new_lines);
+
+	return restart;
+}
+
+static void reload_reply(tor_control * control, int code, const char *reply, gpointer user_data)
+{
+	tor_network_data *network_data = user_data;
+	network_tor_private *priv = network_data->private;
+	gchar *config = network_data->reload_config;
+	gchar *torrc = network_data->reload_torrc;
+	gboolean again = network_data->reload_again;
+
+	network_data->reload_config = NULL;
+	network_data->reload_torrc = NULL;
+	network_data->reload_again = FALSE;
+
+	if (code != 250) {
+		TN_WARN("Tor refused new configuration: %d %s", code, reply);
+
+		/* We no longer know what Tor runs, have it restarted */
+		g_free(network_data->torrc);
+		network_data->torrc = NULL;
+		g_free(config);
+		g_free(torrc);
+		again = TRUE;
+	} else {
+		TN_INFO("Tor reloaded configuration %s", config);
+
+		gboolean transproxy = config_has_transproxy(config);
+		if (network_data->transproxy_enabled != transproxy)
+			transproxy_onoff(network_data, transproxy, config);
+
+		g_free(network_data->config);
+		network_data->config = config;
+		g_free(network_data->torrc);
+		network_data->torrc = torrc;
+
+		/* LOADCONF put back all bridges of the torrc */
+		if (bridges_probe_start(network_data, config))
+			bridges_apply(network_data);
+	}
+
+	if (again) {
+		network_tor_state new_state;
+		memcpy(&new_state, &network_data->state, sizeof(network_tor_state));
+		tor_state_change(priv, network_data, new_state, EVENT_SOURCE_CONFIG_CHANGE);
+	}
+}
+
+/* Bring a running Tor in line with (possibly another) configuration.
+ * Returns 0 if there was nothing to do or Tor is reloading, 1 if Tor needs to
+ * be restarted for the new configuration to take effect. */
+int reconfigure_tor(tor_network_data * network_data, const char *config)
+{
+	char *torrc;
+	GString *command;
+	gchar **lines;
+	int i;
+
+	if (network_data->shared && config != NULL) {
+		torrc = generate_config(config);
+		if (!string_equal(network_data->config, config) || !string_equal(network_data->torrc, torrc)) {
+			/* Reattach, to a restarted shared Tor once all IAPs let go */
+			g_free(torrc);
+			return 1;
+		}
+		g_free(torrc);
+
+		if (network_data->transproxy_enabled != config_has_transproxy(config)) {
+			transproxy_onoff(network_data, !network_data->transproxy_enabled, config);
+		}
+		return 0;
+	}
+
+	if (network_data->tor_pid == 0 || config == NULL)
+		return 0;
+
+	/* Only one LOADCONF in flight, look again when it is done */
+	if (network_data->reload_torrc != NULL) {
+		network_data->reload_again = TRUE;
+		return 0;
+	}
+
+	torrc = generate_config(config);
+	if (torrc == NULL)
+		return 1;
+
+	if (string_equal(network_data->config, config) && string_equal(network_data->torrc, torrc)) {
+		g_free(torrc);
+
+		if (network_data->transproxy_enabled != config_has_transproxy(config)) {
+			transproxy_onoff(network_data, !network_data->transproxy_enabled, config);
+		}
+		return 0;
+	}
+
+	if (torrc_needs_restart(network_data->torrc, torrc) || !tor_control_is_ready(network_data->control)) {
+		g_free(torrc);
+		return 1;
+	}
+
+	gchar *filename = g_strdup_printf(TOR_TORRC_PATH, config);
+	if (!g_file_set_contents(filename, torrc, -1, NULL)) {
+		TN_WARN("Unable to write Tor config file %s", filename);
+	}
+	g_free(filename);
+
+	command = g_string_new("+LOADCONF\r\n");
+	lines = g_strsplit(torrc, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		if (lines[i][0] == '.')
+			g_string_append_c(command, '.');
+		g_string_append(command, lines[i]);
+		g_string_append(command, "\r\n");
+	}
+	g_string_append_c(command, '.');
+	g_strfreev(lines);
+
+	TN_INFO("Reloading Tor with configuration %s", config);
+	if (tor_control_send(network_data->control, command->str, reload_reply, network_data) != 0) {
+		g_string_free(command, TRUE);
+		g_free(torrc);
+		return 1;
+	}
+	g_string_free(command, TRUE);
+
+	network_data->reload_config = g_strdup(config);
+	network_data->reload_torrc = torrc;
+
+	return 0;
+}
+
+/* Write the torrc for config and launch Tor on it, returns the pid or 0.
+ * network_data is only used to time the stages and can be NULL. */
+static pid_t launch_tor(network_tor_private * priv, tor_network_data * network_data, const char *config,
+			const char *torrc)
+{
+	char config_filename[256];
+	if (snprintf(config_filename, 256, TOR_TORRC_PATH, config)
+	    >= 256) {
+		TN_WARN("Unable to allocate torrc config filename\n");
+		return 0;
+	}
+
+	GError *error = NULL;
+	g_file_set_contents(config_filename, torrc, strlen(torrc), &error);
+	if (error != NULL) {
+		g_clear_error(&error);
+		TN_WARN("Unable to write Tor config file\n");
+		return 0;
+	}
+	timeline_mark(network_data, TOR_STAGE_TORRC_WRITTEN);
+
+	char *argss[] = { TOR_BINARY, "-f", config_filename, NULL };
+	pid_t pid = spawn_as(TOR_USER, TOR_BINARY, argss);
+	if (pid == 0) {
+		TN_WARN("Failed to start Tor\n");
+		return 0;
+	}
+
+	TN_INFO("Got tor_pid: %d\n", pid);
+	timeline_mark(network_data, TOR_STAGE_SPAWNED);
+	priv->watch_cb(pid, priv->watch_cb_token);
+
+	return pid;
+}
+
+static tor_control *control_connect(const char *config, tor_control_ready_fn ready_cb,
+				    tor_control_event_fn event_cb, gpointer user_data)
+{
+	tor_control *control;
+
+	gint control_port = config_get_control_port(config);
+	char *datadir = config_get_datadir(config);
+	if (datadir == NULL) {
+		TN_WARN("No DataDirectory configured, cannot find control cookie\n");
+		return NULL;
+	}
+	gchar *cookie_path = g_build_filename(datadir, "control_auth_cookie", NULL);
+	g_free(datadir);
+
+	control = tor_control_new(control_port, cookie_path, ready_cb, event_cb, user_data);
+	g_free(cookie_path);
+
+	return control;
+}
+
+static void shared_setconf_reply(tor_control * control, int code, const char *reply, gpointer user_data)
+{
+	if (code != 250)
+		TN_WARN("Shared Tor refused listeners: %d %s", code, reply);
+}
+
+/* Open the listeners of the attached IAPs next to the ones in the torrc.
+ * SETCONF replaces every SocksPort and TransPort line, so all are sent. */
+static void shared_set_ports(network_tor_private * priv)
+{
+	tor_shared_daemon *shared = &priv->shared;
+	const tor_config *config = config_get(shared->config);
+	GString *command;
+	GSList *l;
+
+	if (config == NULL || !tor_control_is_ready(shared->control))
+		return;
+
+	command = g_string_new("SETCONF");
+	g_string_append_printf(command, " SocksPort=%d", config->socks_port);
+	for (l = shared->networks; l; l = l->next) {
+		tor_network_data *network_data = (tor_network_data *) l->data;
+		g_string_append_printf(command, " SocksPort=%d", network_data->socks_port);
+	}
+	g_string_append_printf(command, " TransPort=\"%d " TOR_TRANSPORT_ISOLATION "\"", config->trans_port);
+	for (l = shared->networks; l; l = l->next) {
+		tor_network_data *network_data = (tor_network_data *) l->data;
+		g_string_append_printf(command, " TransPort=\"%d " TOR_TRANSPORT_ISOLATION "\"",
+				       network_data->trans_port);
+	}
+
+	tor_control_send(shared->control, command->str, shared_setconf_reply, NULL);
+	g_string_free(command, TRUE);
+}
+
+static void shared_ready_cb(tor_control * control, gpointer user_data)
+{
+	network_tor_private *priv = user_data;
+
+	shared_set_ports(priv);
+	onion_restore(control, priv->shared.config);
+}
+
+static void shared_lost_cb(tor_control * control, gpointer user_data)
+{
+	onion_control_lost(user_data, control);
+}
+
+void shared_stop(network_tor_private * priv)
+{
+	tor_shared_daemon *shared = &priv->shared;
+
+	if (shared->pid != 0) {
+		TN_INFO("Stopping shared Tor (pid %d)", shared->pid);
+		kill(shared->pid, SIGTERM);
+		shared->pid = 0;
+	}
+
+	onion_control_lost(priv, shared->control);
+	tor_control_free(shared->control);
+	shared->control = NULL;
+	g_free(shared->config);
+	shared->config = NULL;
+	g_free(shared->torrc);
+	shared->torrc = NULL;
+}
+
+/* The last IAP let go, keep the shared Tor in warm standby like a Tor of
+ * our own, or stop it */
+static void shared_release(network_tor_private * priv, gboolean park)
+{
+	tor_shared_daemon *shared = &priv->shared;
+
+	if (!park || shared->pid == 0 || !tor_control_is_ready(shared->control) || !get_warm_standby_enabled()) {
+		shared_stop(priv);
+		return;
+	}
+
+	standby_stop(priv);
+
+	/* Down to the torrc listeners again */
+	shared_set_ports(priv);
+	if (tor_control_send(shared->control, "SETCONF DisableNetwork=1", NULL, NULL) != 0) {
+		shared_stop(priv);
+		return;
+	}
+
+	TN_INFO("Parking shared Tor (pid %d) in warm standby", shared->pid);
+
+	tor_control_set_callbacks(shared->control, NULL, NULL, NULL);
+	priv->standby_tor_pid = shared->pid;
+	priv->standby_control = shared->control;
+	priv->standby_config = shared->config;
+	priv->standby_torrc = shared->torrc;
+
+	shared->pid = 0;
+	shared->control = NULL;
+	shared->config = NULL;
+	shared->torrc = NULL;
+}
+
+/* Start the shared Tor for network_data, from warm standby if possible */
+static int shared_launch(tor_network_data * network_data, const char *config, const char *torrc)
+{
+	network_tor_private *priv = network_data->private;
+	tor_shared_daemon *shared = &priv->shared;
+
+	if (priv->standby_tor_pid != 0 && string_equal(priv->standby_config, config)
+	    && string_equal(priv->standby_torrc, torrc) && priv->standby_control != NULL) {
+		TN_INFO("Shared Tor (pid %d) taken from warm standby", priv->standby_tor_pid);
+
+		network_data->timeline.start_kind = priv->standby_prestarted ? "pre-started" : "warm standby";
+		/* bootstrap_ready_cb() turns the network back on */
+		network_data->resuming = TRUE;
+
+		shared->pid = priv->standby_tor_pid;
+		shared->control = priv->standby_control;
+		shared->config = priv->standby_config;
+		shared->torrc = priv->standby_torrc;
+
+		priv->standby_tor_pid = 0;
+		priv->standby_control = NULL;
+		priv->standby_config = NULL;
+		priv->standby_torrc = NULL;
+
+		tor_control_set_callbacks(shared->control, shared_ready_cb, NULL, priv);
+		tor_control_set_lost_callback(shared->control, shared_lost_cb);
+		bridges_probe_resume(network_data, config);
+		return 0;
+	}
+
+	/* It would fight over the ports */
+	standby_stop(priv);
+
+	/* network_data sets the fastest bridges for everyone once probed */
+	pid_t pid;
+	if (bridges_probe_start(network_data, config)) {
+		gchar *probe_torrc = g_strconcat(torrc, "DisableNetwork 1\n", NULL);
+		pid = launch_tor(priv, network_data, config, probe_torrc);
+		g_free(probe_torrc);
+	} else {
+		pid = launch_tor(priv, network_data, config, torrc);
+	}
+	if (pid == 0) {
+		bridges_probe_stop(network_data);
+		return 1;
+	}
+
+	TN_INFO("Started shared Tor (pid %d) for configuration %s", pid, config);
+
+	shared->pid = pid;
+	shared->config = g_strdup(config);
+	shared->torrc = g_strdup(torrc);
+	shared->control = control_connect(config, shared_ready_cb, NULL, priv);
+	if (shared->control == NULL) {
+		shared_stop(priv);
+		return 1;
+	}
+	tor_control_set_lost_callback(shared->control, shared_lost_cb);
+
+	set_bootstrap_progress(network_data, 0, NULL, NULL);
+
+	return 0;
+}
+
+/* Use the Tor owner runs on config, like an IAP attached to the shared Tor
+ * but on the torrc listeners. Same return values as startup_tor(). */
+static int tor_borrow(tor_network_data * network_data, tor_network_data * owner, const char *config,
+		      const char *torrc)
+{
+	if (!string_equal(owner->torrc, torrc)) {
+		TN_WARN("Configuration %s changed since %s started Tor on it", config, owner->network_id);
+		return 1;
+	}
+
+	TN_INFO("%s uses the Tor (pid %d) of %s", network_data->network_id, owner->tor_pid, owner->network_id);
+
+	network_data->timeline.start_kind = "shared";
+	network_data->borrowed = TRUE;
+
+	g_free(network_data->config);
+	network_data->config = g_strdup(config);
+	g_free(network_data->torrc);
+	network_data->torrc = g_strdup(torrc);
+
+	/* Taken over when owner goes */
+	transproxy_onoff(network_data, config_has_transproxy(config), config);
+
+	/* Tor reports it is bootstrapped right away if it already was */
+	network_data->control = control_connect(config, bootstrap_ready_cb, bootstrap_event_cb, network_data);
+	if (network_data->control == NULL) {
+		return 2;
+	}
+	network_data->bootstrap_timeout_id = g_timeout_add_seconds(TOR_BOOTSTRAP_TIMEOUT,
+								   bootstrap_timeout_cb, network_data);
+
+	return 0;
+}
+
+/* Give network_data its own listeners on the shared Tor, launching it first
+ * if needed. Same return values as startup_tor(). */
+static int shared_attach(tor_network_data * network_data, const char *config, const char *torrc)
+{
+	network_tor_private *priv = network_data->private;
+	tor_shared_daemon *shared = &priv->shared;
+	int slot;
+
+	if (shared->pid != 0 && (!string_equal(shared->config, config) || !string_equal(shared->torrc, torrc))) {
+		if (shared->networks != NULL) {
+			TN_WARN("Shared Tor runs configuration %s, cannot attach %s with %s", shared->config,
+				network_data->network_id, config);
+			return 1;
+		}
+		shared_stop(priv);
+	}
+
+	for (slot = 0; slot < TOR_SHARED_MAX_NETWORKS; slot++) {
+		if (!shared->slots[slot])
+			break;
+	}
+	if (slot == TOR_SHARED_MAX_NETWORKS) {
+		TN_WARN("No listeners left on the shared Tor for %s", network_data->network_id);
+		return 1;
+	}
+
+	if (shared->pid == 0) {
+		if (shared_launch(network_data, config, torrc) != 0)
+			return 1;
+	} else {
+		network_data->timeline.start_kind = "shared";
+	}
+
+	shared->slots[slot] = TRUE;
+	shared->networks = g_slist_prepend(shared->networks, network_data);
+	network_data->shared = TRUE;
+	network_data->shared_slot = slot;
+	network_data->socks_port = TOR_SHARED_PORT_BASE + 2 * slot;
+	network_data->trans_port = TOR_SHARED_PORT_BASE + 2 * slot + 1;
+
+	g_free(network_data->config);
+	network_data->config = g_strdup(config);
+	g_free(network_data->torrc);
+	network_data->torrc = g_strdup(torrc);
+
+	TN_INFO("Attached %s to shared Tor (pid %d), SocksPort %d TransPort %d", network_data->network_id,
+		shared->pid, network_data->socks_port, network_data->trans_port);
+	shared_set_ports(priv);
+
+	transproxy_onoff(network_data, config_has_transproxy(config), config);
+
+	/* Tor reports it is bootstrapped right away if it already was */
+	network_data->control = control_connect(config, bootstrap_ready_cb, bootstrap_event_cb, network_data);
+	if (network_data->control == NULL) {
+		return 2;
+	}
+	network_data->bootstrap_timeout_id = g_timeout_add_seconds(TOR_BOOTSTRAP_TIMEOUT,
+								   bootstrap_timeout_cb, network_data);
+
+	return 0;
+}
+
+static void shared_detach(tor_network_data * network_data, gboolean park)
+{
+	network_tor_private *priv = network_data->private;
+	tor_shared_daemon *shared = &priv->shared;
+
+	if (!network_data->shared)
+		return;
+
+	TN_INFO("Detaching %s from shared Tor", network_data->network_id);
+
+	shared->networks = g_slist_remove(shared->networks, network_data);
+	shared->slots[network_data->shared_slot] = FALSE;
+
+	/* Still marked shared, so the rules stay for the other IAPs */
+	transproxy_onoff(network_data, FALSE, NULL);
+
+	/* The others must not wait for bridges this IAP no longer sets */
+	if (network_data->bridges_pending && shared->networks != NULL)
+		tor_control_send(shared->control, "SETCONF DisableNetwork=0", NULL, NULL);
+
+	network_data->shared = FALSE;
+	network_data->socks_port = 0;
+	network_data->trans_port = 0;
+
+	bootstrap_watch_stop(network_data);
+
+	if (shared->networks == NULL)
+		shared_release(priv, park);
+	else
+		shared_set_ports(priv);
+}
+
+static gboolean shared_exit_cb(gpointer user_data)
+{
+	tor_network_data *network_data = user_data;
+	network_tor_private *priv = network_data->private;
+
+	network_data->shared_exit_id = 0;
+
+	network_tor_state new_state;
+	memcpy(&new_state, &network_data->state, sizeof(network_tor_state));
+	new_state.tor_running = FALSE;
+	new_state.tor_bootstrapped = FALSE;
+
+	tor_state_change(priv, network_data, new_state, EVENT_SOURCE_TOR_PID_EXIT);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* The shared Tor quit, which is a Tor exit for every IAP on it */
+void shared_exited(network_tor_private * priv)
+{
+	tor_shared_daemon *shared = &priv->shared;
+	GSList *networks, *l;
+
+	TN_WARN("Shared Tor (pid %d) stopped", shared->pid);
+
+	networks = shared->networks;
+	shared->networks = NULL;
+	memset(shared->slots, 0, sizeof(shared->slots));
+	shared->pid = 0;
+	shared_stop(priv);
+
+	for (l = networks; l; l = l->next) {
+		tor_network_data *network_data = (tor_network_data *) l->data;
+		network_data->shared = FALSE;
+		network_data->socks_port = 0;
+		network_data->trans_port = 0;
+	}
+
+	for (l = networks; l; l = l->next) {
+		tor_network_data *network_data = (tor_network_data *) l->data;
+
+		if (!icd_tor_network_data_alive(priv, network_data))
+			continue;
+
+		network_tor_state new_state;
+		memcpy(&new_state, &network_data->state, sizeof(network_tor_state));
+		new_state.tor_running = FALSE;
+		new_state.tor_bootstrapped = FALSE;
+
+		tor_state_change(priv, network_data, new_state, EVENT_SOURCE_TOR_PID_EXIT);
+	}
+	g_slist_free(networks);
+}
+
+static void standby_bridges_probed_cb(gpointer user_data)
+{
+	network_tor_private *priv = user_data;
+
+	/* The probe freed itself, the results are cached */
+	priv->standby_bridges_probe = NULL;
+}
+
+/* Launch Tor with its network disabled, so it can load its state from the
+ * DataDirectory before we are connected. The next start with the same
+ * configuration picks it up like a Tor in warm standby. Only for provider
+ * mode, system-wide mode starts Tor with every IAP anyway. */
+int prestart_tor(network_tor_private * priv, const char *config)
+{
+	if (config == NULL || !get_prestart_enabled() || priv->state.system_wide_enabled)
+		return 1;
+
+	if (priv->standby_tor_pid != 0 && string_equal(priv->standby_config, config))
+		return 0;
+
+	/* It would fight over the ports with the running ones */
+	if (icd_tor_any_tor_running(priv))
+		return 1;
+
+	char *torrc = generate_config(config);
+	if (torrc == NULL) {
+		TN_WARN("Unable to generate a Tor config for %s", config);
+		return 1;
+	}
+
+	standby_stop(priv);
+
+	gchar *prestart_torrc = g_strconcat(torrc, "DisableNetwork 1\n", NULL);
+
+	pid_t pid = launch_tor(priv, NULL, config, prestart_torrc);
+	g_free(prestart_torrc);
+	if (pid == 0) {
+		g_free(torrc);
+		return 1;
+	}
+
+	TN_INFO("Pre-started Tor (pid %d) for configuration %s", pid, config);
+
+	/* Only to have recent results once it is resumed */
+	const tor_config *tc = config_get(config);
+	if (tc != NULL && tc->bridges_enabled)
+		priv->standby_bridges_probe = tor_bridges_probe_new(tc->bridges, TOR_BRIDGES_PROBE_TIMEOUT_MS,
+								    standby_bridges_probed_cb, priv);
+
+	priv->standby_tor_pid = pid;
+	priv->standby_config = g_strdup(config);
+	priv->standby_torrc = torrc;
+	priv->standby_prestarted = TRUE;
+	priv->standby_control = control_connect(config, NULL, NULL, NULL);
+	if (priv->standby_control == NULL) {
+		standby_stop(priv);
+		return 1;
+	}
+
+	return 0;
+}
+
+int startup_tor(tor_network_data * network_data, char *config)
+{
+	char *config_content;
+	tor_network_data *owner;
+
+	config_content = generate_config(config);
+	if (config_content == NULL) {
+		TN_WARN("Unable to generate a Tor config for %s", config ? config : "(none)");
+		return 1;
+	}
+	timeline_start(network_data);
+	timeline_mark(network_data, TOR_STAGE_TORRC_GENERATED);
+
+	owner = tor_owner_find(network_data, config);
+
+	if (get_shared_daemon_enabled()) {
+		int ret = 1;
+
+		/* Started before the shared Tor was enabled, on the same ports */
+		if (owner != NULL)
+			TN_WARN("Configuration %s is already in use by %s", config, owner->network_id);
+		else
+			ret = shared_attach(network_data, config, config_content);
+		g_free(config_content);
+		return ret;
+	}
+
+	/* A second Tor on the same configuration would fight over its ports */
+	if (owner != NULL) {
+		int ret = tor_borrow(network_data, owner, config, config_content);
+		g_free(config_content);
+		return ret;
+	}
+
+	if (network_data->private->shared.networks != NULL
+	    && string_equal(network_data->private->shared.config, config)) {
+		TN_WARN("Configuration %s is in use by the shared Tor", config);
+		g_free(config_content);
+		return 1;
+	}
+
+	if (standby_resume(network_data, config, config_content)) {
+		g_free(config_content);
+		return 0;
+	}
+
+	/* Bridges without a recent result are probed while Tor starts up, with
+	 * its network off until the fastest ones are set */
+	pid_t pid;
+
+	if (bridges_probe_start(network_data, config)) {
+		gchar *probe_torrc = g_strconcat(config_content, "DisableNetwork 1\n", NULL);
+		pid = launch_tor(network_data->private, network_data, config, probe_torrc);
+		g_free(probe_torrc);
+	} else {
+		pid = launch_tor(network_data->private, network_data, config, config_content);
+	}
+	if (pid == 0) {
+		bridges_probe_stop(network_data);
+		g_free(config_content);
+		return 1;
+	}
+
+	g_free(network_data->config);
+	network_data->config = g_strdup(config);
+	g_free(network_data->torrc);
+	network_data->torrc = config_content;
+
+	set_bootstrap_progress(network_data, 0, NULL, NULL);
+	network_set_tor_pid(network_data, pid);
+
+	/* Applied while Tor bootstraps */
+	transproxy_onoff(network_data, config_has_transproxy(config), config);
+
+	network_data->control = control_connect(config, bootstrap_ready_cb, bootstrap_event_cb, network_data);
+	if (network_data->control == NULL) {
 		return 2;
 	}
-	network_data->wait_for_tor_pid = pid;
-	network_data->private->watch_cb(pid, network_data->private->watch_cb_token);
+	tor_control_set_lost_callback(network_data->control, bootstrap_lost_cb);
+	network_data->bootstrap_timeout_id = g_timeout_add_seconds(TOR_BOOTSTRAP_TIMEOUT,
+								   bootstrap_timeout_cb, network_data);
 
 	return 0;
 }
@@ -0,0 +1,551 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "libicd_tor.h"
+#include "dbus_tor.h"
+#include "libicd_network_tor.h"
+
+/* Onion services added with ADD_ONION live as long as the control connection
+ * they were added on, so they never outlive Tor or need cleaning up. Their
+ * keys are kept in <DataDirectory>/onion_services/<name> as three lines
+ * (service id, key, ports), and every time a control connection becomes
+ * ready they are added again, which takes seconds instead of a restart. */
+#define TOR_ONION_DIR "onion_services"
+#define TOR_ONION_NAME_MAX 64
+#define TOR_ONION_TIMEOUT 30
+
+/* An AddOnion or RemoveOnion call waiting for Tor */
+struct _tor_onion_request {
+	network_tor_private *priv;
+	DBusMessage *message;
+	/* AddOnion, which also replies with the address */
+	gboolean add;
+	tor_control *control;
+	gchar *name;
+	gchar *ports;
+	gchar *path;
+	guint timeout_id;
+};
+typedef struct _tor_onion_request tor_onion_request;
+
+static gboolean onion_name_valid(const char *name)
+{
+	size_t len = strlen(name);
+	size_t i;
+
+	if (len == 0 || len > TOR_ONION_NAME_MAX)
+		return FALSE;
+
+	for (i = 0; i < len; i++) {
+		if (!g_ascii_isalnum(name[i]) && name[i] != '-' && name[i] != '_')
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Turns "80 443,127.0.0.1:8443" into " Port=80 Port=443,127.0.0.1:8443" */
+static gchar *onion_port_args(const char *ports)
+{
+	GString *args;
+	gchar **specs;
+	int i;
+
+	for (i = 0; ports[i] != '\0'; i++) {
+		if (!g_ascii_isalnum(ports[i]) && strchr(" ,.:[]/_-", ports[i]) == NULL)
+			return NULL;
+	}
+
+	args = g_string_new(NULL);
+	specs = g_strsplit(ports, " ", -1);
+	for (i = 0; specs[i] != NULL; i++) {
+		if (specs[i][0] != '\0')
+			g_string_append_printf(args, " Port=%s", specs[i]);
+	}
+	g_strfreev(specs);
+
+	if (args->len == 0) {
+		g_string_free(args, TRUE);
+		return NULL;
+	}
+
+	return g_string_free(args, FALSE);
+}
+
+static gchar *onion_dir(const char *config)
+{
+	char *datadir = config_get_datadir(config);
+	gchar *dir;
+
+	if (datadir == NULL)
+		return NULL;
+
+	dir = g_build_filename(datadir, TOR_ONION_DIR, NULL);
+	g_free(datadir);
+
+	return dir;
+}
+
+/* Reads a key file, returns FALSE if there is none or it is damaged */
+static gboolean onion_load(const char *path, gchar ** service_id, gchar ** key, gchar ** ports)
+{
+	gchar *contents;
+	gchar **lines;
+	gboolean ok;
+
+	if (!g_file_get_contents(path, &contents, NULL, NULL))
+		return FALSE;
+
+	lines = g_strsplit(contents, "\n", 4);
+	g_free(contents);
+
+	ok = g_strv_length(lines) >= 3 && lines[0][0] != '\0' && lines[1][0] != '\0' && lines[2][0] != '\0';
+	if (ok) {
+		*service_id = g_strdup(lines[0]);
+		*key = g_strdup(lines[1]);
+		*ports = g_strdup(lines[2]);
+	}
+	g_strfreev(lines);
+
+	return ok;
+}
+
+static gboolean onion_save(const char *path, const char *service_id, const char *key, const char *ports)
+{
+	gchar *dir = g_path_get_dirname(path);
+	gchar *contents;
+	gboolean ok;
+
+	if (g_mkdir_with_parents(dir, 0700) != 0) {
+		TN_WARN("Unable to create %s: %s", dir, strerror(errno));
+		g_free(dir);
+		return FALSE;
+	}
+	g_free(dir);
+
+	contents = g_strdup_printf("%s\n%s\n%s\n", service_id, key, ports);
+	ok = g_file_set_contents(path, contents, -1, NULL) && chmod(path, 0600) == 0;
+	g_free(contents);
+
+	if (!ok)
+		TN_WARN("Unable to write onion service key %s", path);
+
+	return ok;
+}
+
+/* Value of key= in an ADD_ONION reply */
+static gchar *onion_reply_value(const char *reply, const char *key)
+{
+	gchar **lines = g_strsplit(reply, "\n", -1);
+	gchar *value = NULL;
+	size_t len = strlen(key);
+	int i;
+
+	for (i = 0; lines[i] != NULL && value == NULL; i++) {
+		if (strncmp(lines[i], key, len) == 0 && lines[i][len] == '=')
+			value = g_strdup(lines[i] + len + 1);
+	}
+	g_strfreev(lines);
+
+	return value;
+}
+
+/* The control connection onion services go to: the one of the Tor the
+ * provider (or else the most recent connection) runs */
+static tor_control *onion_control(network_tor_private * priv, const char **config)
+{
+	tor_network_data *network_data = icd_tor_find_status_network_data(priv);
+
+	if (network_data == NULL || !network_data->state.tor_running)
+		return NULL;
+
+	if (network_data->shared) {
+		*config = priv->shared.config;
+		return tor_control_is_ready(priv->shared.control) ? priv->shared.control : NULL;
+	}
+
+	*config = network_data->config;
+	return tor_control_is_ready(network_data->control) ? network_data->control : NULL;
+}
+
+/* Whether control was not freed since the request was sent on it. Parking
+ * Tor in warm standby hands its connection over to standby_control. */
+static gboolean onion_control_alive(network_tor_private * priv, tor_control * control)
+{
+	GSList *l;
+
+	if (control == priv->shared.control || control == priv->standby_control)
+		return TRUE;
+
+	for (l = priv->network_data_list; l; l = l->next) {
+		tor_network_data *network_data = (tor_network_data *) l->data;
+		if (network_data->control == control)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Replies (int32 result, string address) to AddOnion, address can be NULL
+ * when it failed, or (int32 result) to RemoveOnion */
+static void onion_request_reply(tor_onion_request * request, dbus_int32_t return_code, const char *address)
+{
+	network_tor_private *priv = request->priv;
+	DBusMessage *reply;
+
+	priv->onion_requests = g_slist_remove(priv->onion_requests, request);
+	if (request->timeout_id != 0)
+		g_source_remove(request->timeout_id);
+	if (request->control != NULL && onion_control_alive(priv, request->control))
+		tor_control_cancel(request->control, request);
+
+	reply = dbus_message_new_method_return(request->message);
+	if (reply != NULL) {
+		if (request->add) {
+			if (address == NULL)
+				address = "";
+			dbus_message_append_args(reply, DBUS_TYPE_INT32, &return_code, DBUS_TYPE_STRING, &address,
+						 DBUS_TYPE_INVALID);
+		} else {
+			dbus_message_append_args(reply, DBUS_TYPE_INT32, &return_code, DBUS_TYPE_INVALID);
+		}
+		if (icd_dbus_send_system_msg(reply) == FALSE) {
+			TN_WARN("icd_dbus_send_system_msg failed");
+		}
+		dbus_message_unref(reply);
+	}
+
+	dbus_message_unref(request->message);
+	g_free(request->name);
+	g_free(request->ports);
+	g_free(request->path);
+	g_free(request);
+}
+
+static gboolean onion_request_timeout_cb(gpointer user_data)
+{
+	tor_onion_request *request = user_data;
+
+	TN_WARN("Tor did not answer for onion service %s within %d seconds", request->name, TOR_ONION_TIMEOUT);
+
+	request->timeout_id = 0;
+	onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_FAILED, NULL);
+
+	return G_SOURCE_REMOVE;
+}
+
+static tor_onion_request *onion_request_new(network_tor_private * priv, DBusMessage * message)
+{
+	tor_onion_request *request = g_new0(tor_onion_request, 1);
+
+	request->priv = priv;
+	request->message = dbus_message_ref(message);
+	priv->onion_requests = g_slist_prepend(priv->onion_requests, request);
+
+	return request;
+}
+
+static void onion_request_send(tor_onion_request * request, const char *command, tor_control_reply_fn reply_cb)
+{
+	request->timeout_id = g_timeout_add_seconds(TOR_ONION_TIMEOUT, onion_request_timeout_cb, request);
+	if (tor_control_send(request->control, command, reply_cb, request) != 0) {
+		request->control = NULL;
+		onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_FAILED, NULL);
+	}
+}
+
+/* Requests sent on a control connection that is lost or about to be freed
+ * will never see their reply, fail them now instead of on the timeout */
+void onion_control_lost(network_tor_private * priv, tor_control * control)
+{
+	GSList *l = priv->onion_requests;
+
+	if (control == NULL)
+		return;
+
+	while (l != NULL) {
+		tor_onion_request *request = l->data;
+
+		l = l->next;
+		if (request->control != control)
+			continue;
+
+		TN_WARN("Lost the Tor control connection for onion service %s", request->name);
+		/* Its pending replies are already gone */
+		request->control = NULL;
+		onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_FAILED, NULL);
+	}
+}
+
+void onion_requests_free(network_tor_private * priv)
+{
+	while (priv->onion_requests != NULL)
+		onion_request_reply(priv->onion_requests->data, TOR_DBUS_METHOD_ONION_RESULT_FAILED, NULL);
+}
+
+static void restore_reply(tor_control * control, int code, const char *reply, gpointer user_data)
+{
+	gchar *name = user_data;
+
+	/* 550 if it is still there from before, on the same connection */
+	if (code != 250 && code != 550)
+		TN_WARN("Tor refused onion service %s: %d %s", name, code, reply);
+
+	g_free(name);
+}
+
+/* Add the onion services kept for config again, on a control connection
+ * that just became ready */
+void onion_restore(tor_control * control, const char *config)
+{
+	gchar *dir = onion_dir(config);
+	const gchar *name;
+	GDir *gdir;
+
+	if (dir == NULL)
+		return;
+
+	gdir = g_dir_open(dir, 0, NULL);
+	if (gdir == NULL) {
+		g_free(dir);
+		return;
+	}
+
+	while ((name = g_dir_read_name(gdir)) != NULL) {
+		gchar *path, *service_id, *key, *ports, *args;
+
+		if (!onion_name_valid(name))
+			continue;
+
+		path = g_build_filename(dir, name, NULL);
+		if (onion_load(path, &service_id, &key, &ports)) {
+			args = onion_port_args(ports);
+			if (args != NULL) {
+				gchar *command = g_strdup_printf("ADD_ONION %s%s", key, args);
+				gchar *user_data = g_strdup(name);
+
+				TN_INFO("Restoring onion service %s (%s.onion)", name, service_id);
+				/* On failure the connection is gone, and with it the callback */
+				if (tor_control_send(control, command, restore_reply, user_data) != 0)
+					g_free(user_data);
+				g_free(command);
+				g_free(args);
+			}
+			g_free(service_id);
+			g_free(key);
+			g_free(ports);
+		}
+		g_free(path);
+	}
+
+	g_dir_close(gdir);
+	g_free(dir);
+}
+
+static void add_onion_reply(tor_control * control, int code, const char *reply, gpointer user_data)
+{
+	tor_onion_request *request = user_data;
+	gchar *service_id, *key, *address;
+
+	if (code != 250) {
+		TN_WARN("Tor refused onion service %s: %d %s", request->name, code, reply);
+		onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_FAILED, NULL);
+		return;
+	}
+
+	service_id = onion_reply_value(reply, "ServiceID");
+	key = onion_reply_value(reply, "PrivateKey");
+
+	/* No PrivateKey when we passed in the one we had */
+	if (key == NULL) {
+		gchar *old_id = NULL, *old_ports = NULL;
+
+		if (onion_load(request->path, &old_id, &key, &old_ports)) {
+			g_free(old_id);
+			g_free(old_ports);
+		}
+	}
+
+	if (service_id == NULL || key == NULL || !onion_save(request->path, service_id, key, request->ports)) {
+		onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_FAILED, NULL);
+	} else {
+		address = g_strdup_printf("%s.onion", service_id);
+		TN_INFO("Added onion service %s (%s)", request->name, address);
+		onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_OK, address);
+		g_free(address);
+	}
+
+	g_free(service_id);
+	g_free(key);
+}
+
+/* AddOnion(string name, string ports) publishes an onion service on the
+ * running Tor, replying (int32 result, string address). ports holds Tor's
+ * "virtport[,target]" separated by spaces. A name that was added before
+ * keeps its address and gets the new ports. */
+DBusHandlerResult addonion_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	network_tor_private *priv = user_data;
+	tor_onion_request *request = onion_request_new(priv, message);
+	const char *name, *ports, *config = NULL;
+	gchar *dir, *args, *service_id, *key, *old_ports, *command;
+	DBusError error;
+
+	request->add = TRUE;
+
+	dbus_error_init(&error);
+	if (dbus_message_get_args(message, &error, DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &ports,
+				  DBUS_TYPE_INVALID) == FALSE) {
+		TN_WARN("addonion_callback received invalid arguments: %s", error.message);
+		dbus_error_free(&error);
+
+		onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_INVALID_ARGS, NULL);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	args = onion_port_args(ports);
+	if (!onion_name_valid(name) || args == NULL) {
+		g_free(args);
+		onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_INVALID_ARGS, NULL);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	request->control = onion_control(priv, &config);
+	dir = request->control ? onion_dir(config) : NULL;
+	if (dir == NULL) {
+		g_free(args);
+		request->control = NULL;
+		onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_NOT_RUNNING, NULL);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	request->name = g_strdup(name);
+	request->ports = g_strdup(ports);
+	request->path = g_build_filename(dir, name, NULL);
+	g_free(dir);
+
+	if (onion_load(request->path, &service_id, &key, &old_ports)) {
+		/* Replace it, DEL_ONION fails harmlessly if it is not there */
+		gchar *del = g_strdup_printf("DEL_ONION %s", service_id);
+		tor_control_send(request->control, del, NULL, NULL);
+		g_free(del);
+
+		command = g_strdup_printf("ADD_ONION %s%s", key, args);
+		g_free(service_id);
+		g_free(key);
+		g_free(old_ports);
+	} else {
+		command = g_strdup_printf("ADD_ONION NEW:ED25519-V3%s", args);
+	}
+	g_free(args);
+
+	onion_request_send(request, command, add_onion_reply);
+	g_free(command);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void del_onion_reply(tor_control * control, int code, const char *reply, gpointer user_data)
+{
+	tor_onion_request *request = user_data;
+
+	/* 552 when it was not published on this Tor, the key is gone anyway */
+	if (code != 250 && code != 552)
+		TN_WARN("Tor refused removing onion service %s: %d %s", request->name, code, reply);
+
+	TN_INFO("Removed onion service %s", request->name);
+	onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_OK, NULL);
+}
+
+/* RemoveOnion(string name) takes down an onion service and forgets its key,
+ * replying (int32 result). Without Tor running only the key is removed. */
+DBusHandlerResult removeonion_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	network_tor_private *priv = user_data;
+	tor_onion_request *request = onion_request_new(priv, message);
+	const char *name, *config = NULL;
+	gchar *active_config = NULL;
+	gchar *dir, *service_id, *key, *ports, *command;
+	DBusError error;
+
+	dbus_error_init(&error);
+	if (dbus_message_get_args(message, &error, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID) == FALSE) {
+		TN_WARN("removeonion_callback received invalid arguments: %s", error.message);
+		dbus_error_free(&error);
+
+		onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_INVALID_ARGS, NULL);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	if (!onion_name_valid(name)) {
+		onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_INVALID_ARGS, NULL);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	request->control = onion_control(priv, &config);
+	if (request->control == NULL)
+		config = active_config = get_active_config();
+
+	dir = config ? onion_dir(config) : NULL;
+	g_free(active_config);
+	if (dir == NULL) {
+		request->control = NULL;
+		onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_NOT_FOUND, NULL);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	request->name = g_strdup(name);
+	request->path = g_build_filename(dir, name, NULL);
+	g_free(dir);
+
+	if (!onion_load(request->path, &service_id, &key, &ports)) {
+		request->control = NULL;
+		onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_NOT_FOUND, NULL);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+	g_free(key);
+	g_free(ports);
+
+	/* Forget it first, so a reconnect cannot bring it back */
+	if (unlink(request->path) != 0)
+		TN_WARN("Unable to remove onion service key %s: %s", request->path, strerror(errno));
+
+	if (request->control == NULL) {
+		g_free(service_id);
+		onion_request_reply(request, TOR_DBUS_METHOD_ONION_RESULT_OK, NULL);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	command = g_strdup_printf("DEL_ONION %s", service_id);
+	g_free(service_id);
+
+	onion_request_send(request, command, del_onion_reply);
+	g_free(command);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
@@ -0,0 +1,288 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <glib.h>
+
+#include "libicd_tor.h"
+#include "dbus_tor.h"
+#include "libicd_network_tor.h"
+
+#define DBUS_PROPERTIES_INTERFACE "org.freedesktop.DBus.Properties"
+
+static const struct {
+	const char *name;
+	int type;
+	size_t offset;
+} properties[] = {
+	{"State", DBUS_TYPE_STRING, offsetof(tor_properties, state)},
+	{"Mode", DBUS_TYPE_STRING, offsetof(tor_properties, mode)},
+	{"ActiveConfig", DBUS_TYPE_STRING, offsetof(tor_properties, active_config)},
+	{"BootstrapPercent", DBUS_TYPE_INT32, offsetof(tor_properties, bootstrap_percent)},
+	{"TorPid", DBUS_TYPE_INT32, offsetof(tor_properties, tor_pid)},
+	{"TransproxyEnabled", DBUS_TYPE_BOOLEAN, offsetof(tor_properties, transproxy_enabled)},
+	{"SocksPort", DBUS_TYPE_INT32, offsetof(tor_properties, socks_port)},
+	{NULL,}
+};
+
+#define PROPERTY(props, i) ((void *)((char *)(props) + properties[i].offset))
+
+static void properties_read(network_tor_private * priv, tor_properties * props)
+{
+	tor_network_data *network_data = icd_tor_find_status_network_data(priv);
+	network_tor_state *state = network_data ? &network_data->state : &priv->state;
+	const char *config = NULL;
+
+	status_names(state, &props->state, &props->mode);
+
+	if (network_data != NULL)
+		config = network_data->config ? network_data->config : state->active_config;
+	props->active_config = g_strdup(config ? config : "");
+
+	props->bootstrap_percent = network_data ? network_data->bootstrap_progress : 0;
+	props->tor_pid = 0;
+	props->transproxy_enabled = FALSE;
+	props->socks_port = 0;
+
+	if (network_data != NULL && state->tor_running) {
+		const tor_config *tc = config_get(network_data->config);
+
+		props->tor_pid = network_data->shared ? priv->shared.pid : network_data->tor_pid;
+		props->transproxy_enabled = network_data->transproxy_enabled;
+		if (network_data->socks_port != 0)
+			props->socks_port = network_data->socks_port;
+		else if (tc != NULL)
+			props->socks_port = tc->socks_port;
+	}
+}
+
+static gboolean property_equal(tor_properties * a, tor_properties * b, int i)
+{
+	if (properties[i].type == DBUS_TYPE_STRING)
+		return string_equal(*(const char **)PROPERTY(a, i), *(const char **)PROPERTY(b, i));
+
+	return *(dbus_int32_t *) PROPERTY(a, i) == *(dbus_int32_t *) PROPERTY(b, i);
+}
+
+static void append_property(DBusMessageIter * iter, tor_properties * props, int i)
+{
+	DBusMessageIter variant;
+	char signature[2] = { properties[i].type, '\0' };
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, signature, &variant);
+	dbus_message_iter_append_basic(&variant, properties[i].type, PROPERTY(props, i));
+	dbus_message_iter_close_container(iter, &variant);
+}
+
+static void append_dict_entry(DBusMessageIter * dict, tor_properties * props, int i)
+{
+	DBusMessageIter entry;
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &properties[i].name);
+	append_property(&entry, props, i);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static gboolean properties_flush_cb(gpointer user_data)
+{
+	network_tor_private *priv = user_data;
+	const char *interface = ICD_TOR_DBUS_INTERFACE;
+	tor_properties now;
+	DBusMessageIter iter, dict, invalidated;
+	DBusMessage *msg;
+	int i, changed = 0;
+
+	priv->properties_flush_id = 0;
+
+	properties_read(priv, &now);
+
+	for (i = 0; properties[i].name != NULL; i++) {
+		if (!property_equal(&priv->properties, &now, i))
+			changed++;
+	}
+
+	if (changed == 0) {
+		g_free(now.active_config);
+		return G_SOURCE_REMOVE;
+	}
+
+	msg = dbus_message_new_signal(ICD_TOR_DBUS_PATH, DBUS_PROPERTIES_INTERFACE, "PropertiesChanged");
+	if (msg == NULL) {
+		TN_WARN("Could not construct dbus message for PropertiesChanged signal");
+		g_free(now.active_config);
+		return G_SOURCE_REMOVE;
+	}
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interface);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+	for (i = 0; properties[i].name != NULL; i++) {
+		if (!property_equal(&priv->properties, &now, i))
+			append_dict_entry(&dict, &now, i);
+	}
+	dbus_message_iter_close_container(&iter, &dict);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &invalidated);
+	dbus_message_iter_close_container(&iter, &invalidated);
+
+	icd_dbus_send_system_msg(msg);
+	dbus_message_unref(msg);
+
+	g_free(priv->properties.active_config);
+	memcpy(&priv->properties, &now, sizeof(tor_properties));
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Something a property is derived from changed, PropertiesChanged goes out
+ * once the main loop is idle, with the properties that really changed */
+void properties_changed(network_tor_private * priv)
+{
+	if (priv->properties_flush_id == 0)
+		priv->properties_flush_id = g_idle_add(properties_flush_cb, priv);
+}
+
+void properties_init(network_tor_private * priv)
+{
+	properties_read(priv, &priv->properties);
+}
+
+void properties_free(network_tor_private * priv)
+{
+	if (priv->properties_flush_id != 0) {
+		g_source_remove(priv->properties_flush_id);
+		priv->properties_flush_id = 0;
+	}
+
+	g_free(priv->properties.active_config);
+	priv->properties.active_config = NULL;
+}
+
+static DBusHandlerResult properties_error(DBusMessage * message, const char *name, const char *text)
+{
+	DBusMessage *err_msg = dbus_message_new_error(message, name, text);
+
+	if (err_msg == NULL)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+	icd_dbus_send_system_msg(err_msg);
+	dbus_message_unref(err_msg);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Get(s interface, s name) -> v */
+DBusHandlerResult properties_get_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	network_tor_private *priv = user_data;
+	const char *interface, *name;
+	DBusMessageIter iter;
+	tor_properties now;
+	int i;
+
+	if (!dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &name,
+				   DBUS_TYPE_INVALID))
+		return properties_error(message, DBUS_ERROR_INVALID_ARGS, "Expected interface and property name");
+
+	if (strcmp(interface, ICD_TOR_DBUS_INTERFACE) != 0)
+		return properties_error(message, DBUS_ERROR_UNKNOWN_INTERFACE, "Unknown interface");
+
+	for (i = 0; properties[i].name != NULL; i++) {
+		if (strcmp(properties[i].name, name) == 0)
+			break;
+	}
+	if (properties[i].name == NULL)
+		return properties_error(message, DBUS_ERROR_UNKNOWN_PROPERTY, "Unknown property");
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	properties_read(priv, &now);
+	dbus_message_iter_init_append(reply, &iter);
+	append_property(&iter, &now, i);
+	g_free(now.active_config);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* GetAll(s interface) -> a{sv} */
+DBusHandlerResult properties_getall_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	network_tor_private *priv = user_data;
+	const char *interface;
+	DBusMessageIter iter, dict;
+	tor_properties now;
+	int i;
+
+	if (!dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &interface, DBUS_TYPE_INVALID))
+		return properties_error(message, DBUS_ERROR_INVALID_ARGS, "Expected interface");
+
+	if (strcmp(interface, ICD_TOR_DBUS_INTERFACE) != 0)
+		return properties_error(message, DBUS_ERROR_UNKNOWN_INTERFACE, "Unknown interface");
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	properties_read(priv, &now);
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+	for (i = 0; properties[i].name != NULL; i++)
+		append_dict_entry(&dict, &now, i);
+	dbus_message_iter_close_container(&iter, &dict);
+	g_free(now.active_config);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* All properties follow Tor, none can be set */
+DBusHandlerResult properties_set_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	DBusMessageIter iter;
+	const char *interface;
+
+	if (!dbus_message_iter_init(message, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+		return properties_error(message, DBUS_ERROR_INVALID_ARGS, "Expected interface, name and value");
+
+	dbus_message_iter_get_basic(&iter, &interface);
+	if (strcmp(interface, ICD_TOR_DBUS_INTERFACE) != 0)
+		return properties_error(message, DBUS_ERROR_UNKNOWN_INTERFACE, "Unknown interface");
+
+	return properties_error(message, DBUS_ERROR_PROPERTY_READ_ONLY, "Properties are read-only");
+}
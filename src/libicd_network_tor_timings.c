@@ -0,0 +1,351 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "libicd_tor.h"
+#include "dbus_tor.h"
+#include "libicd_network_tor.h"
+
+static const char *stage_names[TOR_STAGE_COUNT] = {
+	[TOR_STAGE_TORRC_GENERATED] = "torrc_generated",
+	[TOR_STAGE_TORRC_WRITTEN] = "torrc_written",
+	[TOR_STAGE_SPAWNED] = "spawned",
+	[TOR_STAGE_CONTROL_READY] = "control_ready",
+	[TOR_STAGE_TRANSPROXY_APPLIED] = "transproxy_applied",
+	[TOR_STAGE_BOOTSTRAPPED] = "bootstrapped",
+	[TOR_STAGE_CONNECTED] = "connected",
+};
+
+static const char *start_kinds[TOR_START_KIND_COUNT] = {
+	"cold", "warm standby", "pre-started", "shared",
+};
+
+const char *event_source_name(int source)
+{
+	switch (source) {
+	case EVENT_SOURCE_IP_UP:
+		return "ip_up";
+	case EVENT_SOURCE_IP_DOWN:
+		return "ip_down";
+	case EVENT_SOURCE_GCONF_CHANGE:
+		return "gconf_change";
+	case EVENT_SOURCE_CONFIG_CHANGE:
+		return "config_change";
+	case EVENT_SOURCE_TOR_PID_EXIT:
+		return "tor_pid_exit";
+	case EVENT_SOURCE_TOR_BOOTSTRAPPED:
+		return "tor_bootstrapped";
+	case EVENT_SOURCE_DBUS_CALL_START:
+		return "dbus_call_start";
+	case EVENT_SOURCE_DBUS_CALL_STOP:
+		return "dbus_call_stop";
+	case EVENT_SOURCE_TRANSPROXY_APPLIED:
+		return "transproxy_applied";
+	case EVENT_SOURCE_TRANSPROXY_FAILED:
+		return "transproxy_failed";
+	}
+
+	return "unknown";
+}
+
+static gint timeline_now_ms(tor_timeline * timeline)
+{
+	return (gint) ((g_get_monotonic_time() - timeline->start_time) / 1000);
+}
+
+void timeline_start(tor_network_data * network_data)
+{
+	tor_timeline *timeline = &network_data->timeline;
+	int i;
+
+	memset(timeline, 0, sizeof(tor_timeline));
+	timeline->active = TRUE;
+	timeline->start_time = g_get_monotonic_time();
+	timeline->start_wall = g_get_real_time();
+	timeline->start_kind = "cold";
+
+	for (i = 0; i < TOR_STAGE_COUNT; i++)
+		timeline->stage_ms[i] = -1;
+}
+
+void timeline_mark(tor_network_data * network_data, enum tor_stage stage)
+{
+	tor_timeline *timeline;
+
+	if (network_data == NULL)
+		return;
+
+	timeline = &network_data->timeline;
+	if (!timeline->active || timeline->stage_ms[stage] >= 0)
+		return;
+
+	timeline->stage_ms[stage] = timeline_now_ms(timeline);
+}
+
+void timeline_event(tor_network_data * network_data, int source)
+{
+	tor_timeline *timeline;
+
+	if (network_data == NULL)
+		return;
+
+	timeline = &network_data->timeline;
+	if (!timeline->active || timeline->n_events >= TOR_TIMELINE_EVENTS)
+		return;
+
+	timeline->events[timeline->n_events].source = source;
+	timeline->events[timeline->n_events].ms = timeline_now_ms(timeline);
+	timeline->n_events++;
+}
+
+void timeline_finish(tor_network_data * network_data, gboolean success)
+{
+	tor_timeline *timeline = &network_data->timeline;
+	tor_timings *timings;
+	int i;
+
+	if (!timeline->active || network_data->private == NULL)
+		return;
+
+	timings = &network_data->private->timings;
+	timeline->active = FALSE;
+	timeline->success = success;
+
+	TN_INFO("Tor (%s start) %s after %d ms", timeline->start_kind, success ? "connected" : "failed",
+		timeline_now_ms(timeline));
+
+	memcpy(&timings->history[timings->history_next], timeline, sizeof(tor_timeline));
+	timings->history_next = (timings->history_next + 1) % TOR_TIMINGS_HISTORY;
+	if (timings->history_len < TOR_TIMINGS_HISTORY)
+		timings->history_len++;
+
+	/* Failed attempts would skew the percentiles */
+	if (!success)
+		return;
+
+	for (i = 0; i < TOR_START_KIND_COUNT; i++) {
+		if (g_strcmp0(timeline->start_kind, start_kinds[i]) == 0) {
+			timings->kind_count[i]++;
+			timings->kind_total_ms[i] += timeline_now_ms(timeline);
+			break;
+		}
+	}
+
+	for (i = 0; i < TOR_STAGE_COUNT; i++) {
+		if (timeline->stage_ms[i] < 0)
+			continue;
+
+		timings->samples[i][timings->samples_next[i]] = timeline->stage_ms[i];
+		timings->samples_next[i] = (timings->samples_next[i] + 1) % TOR_TIMINGS_SAMPLES;
+		if (timings->samples_len[i] < TOR_TIMINGS_SAMPLES)
+			timings->samples_len[i]++;
+	}
+}
+
+static int compare_int(const void *a, const void *b)
+{
+	return *(const gint *)a - *(const gint *)b;
+}
+
+/* Nearest rank percentile of sorted samples */
+static dbus_int32_t percentile(const gint * sorted, guint len, guint pct)
+{
+	guint rank;
+
+	if (len == 0)
+		return -1;
+
+	rank = (pct * len + 99) / 100;
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void append_timeline(DBusMessageIter * array, tor_timeline * timeline)
+{
+	DBusMessageIter entry, list, pair;
+	dbus_int64_t start = timeline->start_wall / G_USEC_PER_SEC;
+	dbus_bool_t success = timeline->success;
+	const char *kind = timeline->start_kind ? timeline->start_kind : "";
+	guint i;
+
+	dbus_message_iter_open_container(array, DBUS_TYPE_STRUCT, NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_INT64, &start);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &kind);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_BOOLEAN, &success);
+
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_ARRAY, "(si)", &list);
+	for (i = 0; i < TOR_STAGE_COUNT; i++) {
+		dbus_int32_t ms = timeline->stage_ms[i];
+
+		if (ms < 0)
+			continue;
+
+		dbus_message_iter_open_container(&list, DBUS_TYPE_STRUCT, NULL, &pair);
+		dbus_message_iter_append_basic(&pair, DBUS_TYPE_STRING, &stage_names[i]);
+		dbus_message_iter_append_basic(&pair, DBUS_TYPE_INT32, &ms);
+		dbus_message_iter_close_container(&list, &pair);
+	}
+	dbus_message_iter_close_container(&entry, &list);
+
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_ARRAY, "(si)", &list);
+	for (i = 0; i < timeline->n_events; i++) {
+		const char *name = event_source_name(timeline->events[i].source);
+		dbus_int32_t ms = timeline->events[i].ms;
+
+		dbus_message_iter_open_container(&list, DBUS_TYPE_STRUCT, NULL, &pair);
+		dbus_message_iter_append_basic(&pair, DBUS_TYPE_STRING, &name);
+		dbus_message_iter_append_basic(&pair, DBUS_TYPE_INT32, &ms);
+		dbus_message_iter_close_container(&list, &pair);
+	}
+	dbus_message_iter_close_container(&entry, &list);
+
+	dbus_message_iter_close_container(array, &entry);
+}
+
+/* Returns a(xsba(si)a(si)): the last timelines, newest first, as start time,
+ * start kind, success, (stage, ms) and (state change, ms), followed by
+ * a(suiii): per stage the number of samples and the 50th, 90th and 99th
+ * percentile in ms */
+DBusHandlerResult gettimings_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	network_tor_private *priv = user_data;
+	tor_timings *timings = &priv->timings;
+	DBusMessageIter iter, array, entry;
+	guint i;
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(xsba(si)a(si))", &array);
+	for (i = 1; i <= timings->history_len; i++) {
+		guint idx = (timings->history_next + TOR_TIMINGS_HISTORY - i) % TOR_TIMINGS_HISTORY;
+
+		append_timeline(&array, &timings->history[idx]);
+	}
+	dbus_message_iter_close_container(&iter, &array);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(suiii)", &array);
+	for (i = 0; i < TOR_STAGE_COUNT; i++) {
+		gint sorted[TOR_TIMINGS_SAMPLES];
+		dbus_uint32_t count = timings->samples_len[i];
+		dbus_int32_t p50, p90, p99;
+
+		memcpy(sorted, timings->samples[i], count * sizeof(gint));
+		qsort(sorted, count, sizeof(gint), compare_int);
+		p50 = percentile(sorted, count, 50);
+		p90 = percentile(sorted, count, 90);
+		p99 = percentile(sorted, count, 99);
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &stage_names[i]);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &count);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_INT32, &p50);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_INT32, &p90);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_INT32, &p99);
+		dbus_message_iter_close_container(&array, &entry);
+	}
+	dbus_message_iter_close_container(&iter, &array);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Returns a(suu): per start kind the number of successful starts and their
+ * average ms until connected, to see what warm standby and pre-starting save */
+DBusHandlerResult getstartstats_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	network_tor_private *priv = user_data;
+	tor_timings *timings = &priv->timings;
+	DBusMessageIter iter, array, entry;
+	guint i;
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(suu)", &array);
+	for (i = 0; i < TOR_START_KIND_COUNT; i++) {
+		dbus_uint32_t count = timings->kind_count[i];
+		dbus_uint32_t avg = count ? timings->kind_total_ms[i] / count : 0;
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &start_kinds[i]);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &count);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &avg);
+		dbus_message_iter_close_container(&array, &entry);
+	}
+	dbus_message_iter_close_container(&iter, &array);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Returns (uint32 cold count, uint32 cold average ms, uint32 warm count,
+ * uint32 warm average ms, uint32 failures) of the warm-up connections */
+DBusHandlerResult getwarmupstats_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	network_tor_private *priv = user_data;
+	tor_warmup_stats *stats = &priv->warmup_stats;
+	dbus_uint32_t cold_count = stats->cold_count;
+	dbus_uint32_t cold_avg = stats->cold_count ? stats->cold_total_ms / stats->cold_count : 0;
+	dbus_uint32_t warm_count = stats->warm_count;
+	dbus_uint32_t warm_avg = stats->warm_count ? stats->warm_total_ms / stats->warm_count : 0;
+	dbus_uint32_t failures = stats->failures;
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	dbus_message_append_args(reply, DBUS_TYPE_UINT32, &cold_count, DBUS_TYPE_UINT32, &cold_avg,
+				 DBUS_TYPE_UINT32, &warm_count, DBUS_TYPE_UINT32, &warm_avg,
+				 DBUS_TYPE_UINT32, &failures, DBUS_TYPE_INVALID);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
@@ -0,0 +1,155 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+
+#include "libicd_tor.h"
+#include "dbus_tor.h"
+#include "libicd_network_tor.h"
+
+static guint32 state_bits(network_tor_state * state)
+{
+	guint32 bits = 0;
+
+	if (state->system_wide_enabled)
+		bits |= TOR_TRACE_SYSTEM_WIDE_ENABLED;
+	if (state->iap_connected)
+		bits |= TOR_TRACE_IAP_CONNECTED;
+	if (state->service_provider_mode)
+		bits |= TOR_TRACE_SERVICE_PROVIDER_MODE;
+	if (state->tor_running)
+		bits |= TOR_TRACE_TOR_RUNNING;
+	if (state->tor_bootstrapped_running)
+		bits |= TOR_TRACE_TOR_BOOTSTRAPPED_RUNNING;
+	if (state->tor_bootstrapped)
+		bits |= TOR_TRACE_TOR_BOOTSTRAPPED;
+	if (state->gconf_transition_ongoing)
+		bits |= TOR_TRACE_GCONF_TRANSITION_ONGOING;
+	if (state->config_restart_ongoing)
+		bits |= TOR_TRACE_CONFIG_RESTART_ONGOING;
+	if (state->dbus_failed_to_start)
+		bits |= TOR_TRACE_DBUS_FAILED_TO_START;
+
+	return bits;
+}
+
+/* Records the start of a transition, the new state is filled in by
+ * trace_end(). Nothing is allocated, old entries are overwritten. */
+tor_trace_entry *trace_begin(network_tor_private * priv, tor_network_data * network_data,
+			     network_tor_state * old_state, int source)
+{
+	tor_trace_entry *entry = &priv->trace.entries[priv->trace.count % TOR_TRACE_SIZE];
+
+	priv->trace.count++;
+
+	entry->time = g_get_monotonic_time();
+	entry->source = source;
+	entry->old_state = state_bits(old_state);
+	entry->new_state = entry->old_state;
+	entry->pid = network_data ? network_data->tor_pid : 0;
+	if (network_data && network_data->network_id)
+		g_strlcpy(entry->network_id, network_data->network_id, sizeof(entry->network_id));
+	else
+		entry->network_id[0] = '\0';
+
+	return entry;
+}
+
+void trace_end(tor_trace_entry * entry, network_tor_state * new_state)
+{
+	entry->new_state = state_bits(new_state);
+}
+
+static guint trace_len(tor_trace * trace)
+{
+	return trace->count < TOR_TRACE_SIZE ? trace->count : TOR_TRACE_SIZE;
+}
+
+static tor_trace_entry *trace_nth(tor_trace * trace, guint n)
+{
+	return &trace->entries[(trace->count - trace_len(trace) + n) % TOR_TRACE_SIZE];
+}
+
+/* Written out when a connection is closed on an error */
+void trace_log(network_tor_private * priv)
+{
+	tor_trace *trace = &priv->trace;
+	gint64 now = g_get_monotonic_time();
+	guint i, len = trace_len(trace);
+
+	TN_INFO("Last %u of %llu state transitions:", len, (unsigned long long)trace->count);
+
+	for (i = 0; i < len; i++) {
+		tor_trace_entry *entry = trace_nth(trace, i);
+
+		TN_INFO("  -%lld ms %s network_id=%s pid=%d state 0x%03x -> 0x%03x",
+			(long long)(now - entry->time) / 1000, event_source_name(entry->source),
+			entry->network_id, entry->pid, entry->old_state, entry->new_state);
+	}
+}
+
+/* Returns a(xsuuis): oldest first, monotonic time in us, event source, old
+ * and new state bits, Tor pid and network id */
+DBusHandlerResult dumptrace_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	network_tor_private *priv = user_data;
+	tor_trace *trace = &priv->trace;
+	DBusMessageIter iter, array, entry;
+	guint i, len = trace_len(trace);
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(xsuuis)", &array);
+
+	for (i = 0; i < len; i++) {
+		tor_trace_entry *e = trace_nth(trace, i);
+		dbus_int64_t time = e->time;
+		const char *source = event_source_name(e->source);
+		dbus_uint32_t old_state = e->old_state;
+		dbus_uint32_t new_state = e->new_state;
+		dbus_int32_t pid = e->pid;
+		const char *network_id = e->network_id;
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_INT64, &time);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &source);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &old_state);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &new_state);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_INT32, &pid);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &network_id);
+		dbus_message_iter_close_container(&array, &entry);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		TN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
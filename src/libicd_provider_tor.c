@@ -52,6 +52,9 @@ struct _provider_tor_private {
 	icd_srv_limited_conn_fn limited_conn_fn;
 
 	GSList *network_data_list;
+
+	/* Service id we last asked the network module to pre-start Tor for */
+	gchar *prestart_service_id;
 };
 typedef struct _provider_tor_private provider_tor_private;
 
@@ -60,11 +63,28 @@ typedef struct _provider_tor_private provider_tor_private;
 #define PROVIDER_TOR_STATE_STARTED 2
 #define PROVIDER_TOR_STATE_CONNECTED 3
 
+/* StatusChanged that arrived before the reply to our Start */
+struct _tor_early_status {
+	guint32 generation;
+	guint32 session_id;
+	int state;
+};
+typedef struct _tor_early_status tor_early_status;
+
 struct _tor_network_data {
 	provider_tor_private *private;
 
 	int state;
 
+	/* Session the network module gave our Start, and the generation of the
+	 * last StatusChanged we acted on */
+	guint32 session_id;
+	guint32 generation;
+
+	/* Waiting for the Start reply, StatusChanged is kept until then */
+	gboolean start_pending;
+	GSList *early_status;
+
 	icd_srv_connect_cb_fn connect_cb;
 	gpointer connect_cb_token;
 
@@ -146,6 +166,8 @@ static void network_free_all(tor_network_data * network_data)
 		priv->network_data_list = g_slist_remove(priv->network_data_list, network_data);
 	}
 
+	g_slist_free_full(network_data->early_status, g_free);
+
 	g_free(network_data->service_type);
 	g_free(network_data->service_id);
 	g_free(network_data->network_type);
@@ -159,7 +181,8 @@ static void network_free_all(tor_network_data * network_data)
 static void network_stop_all(tor_network_data * network_data)
 {
 	DBusMessage *msg;
-	msg = dbus_message_new_method_call(ICD_TOR_DBUS_INTERFACE, ICD_TOR_DBUS_PATH, ICD_TOR_DBUS_INTERFACE, "Stop");
+	msg = dbus_message_new_method_call(ICD_TOR_DBUS_INTERFACE, ICD_TOR_DBUS_PATH, ICD_TOR_DBUS_INTERFACE,
+					   ICD_TOR_METHOD_STOP);
 
 	if (icd_dbus_send_system_mcall(msg, -1, tor_get_stop_reply, network_data) == FALSE) {
 		/* Call down callback right away */
@@ -172,25 +195,127 @@ static void network_stop_all(tor_network_data * network_data)
 	dbus_message_unref(msg);
 }
 
+static void request_prestart(provider_tor_private * priv, const char *service_id)
+{
+	DBusMessage *msg;
+
+	/* Scans report the same IAP over and over, ask only once */
+	if (g_strcmp0(priv->prestart_service_id, service_id) == 0)
+		return;
+
+	g_free(priv->prestart_service_id);
+	priv->prestart_service_id = g_strdup(service_id);
+
+	msg = dbus_message_new_method_call(ICD_TOR_DBUS_INTERFACE, ICD_TOR_DBUS_PATH, ICD_TOR_DBUS_INTERFACE,
+					   ICD_TOR_METHOD_PRESTART);
+	dbus_message_append_args(msg, DBUS_TYPE_STRING, &service_id, DBUS_TYPE_INVALID);
+
+	if (icd_dbus_send_system_mcall(msg, -1, NULL, NULL) == FALSE) {
+		TP_WARN("icd_dbus_send_system_msg failed when requesting Prestart");
+	}
+
+	dbus_message_unref(msg);
+}
+
+/* Act on a state of our own session, unless it is older than one we already
+ * acted on. A generation of 0 comes from a network module without them. */
+static void apply_status(tor_network_data * network_data, guint32 generation, int new_state)
+{
+	provider_tor_private *priv = network_data->private;
+
+	if (generation != 0 && network_data->generation != 0
+	    && (gint32) (generation - network_data->generation) <= 0) {
+		TP_DEBUG("Ignoring StatusChanged %u, already at %u", generation, network_data->generation);
+		return;
+	}
+	if (generation != 0)
+		network_data->generation = generation;
+
+	/* We could get an unexpected stop, or the expected start (after we
+	 * start it */
+	if (network_data->state > new_state) {
+		/* Tor quit, let's throw down the interface */
+
+		priv->close_fn(ICD_SRV_ERROR, "Tor process quit (unexpectedly)",
+			       network_data->service_type,
+			       network_data->service_attrs,
+			       network_data->service_id,
+			       network_data->network_type, network_data->network_attrs, network_data->network_id);
+		return;
+	}
+
+	if (new_state > network_data->state) {
+		if (new_state == PROVIDER_TOR_STATE_CONNECTED) {
+			network_data->connect_cb(ICD_SRV_SUCCESS, NULL, network_data->connect_cb_token);
+		}
+	}
+
+	if (new_state == network_data->state) {
+		/* Nothing changed. */
+	}
+
+	network_data->state = new_state;
+}
+
 static void tor_get_start_reply(DBusPendingCall * pending, gpointer user_data)
 {
 	DBusMessage *message;
 	int reply = 0;
+	dbus_uint32_t session_id = 0;
+	dbus_uint32_t generation = 0;
 	tor_network_data *network_data = user_data;
+	tor_early_status *latest = NULL;
+	GSList *l;
+
+	network_data->start_pending = FALSE;
 
 	message = dbus_pending_call_steal_reply(pending);
 
 	if (message && dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_METHOD_RETURN) {
-		dbus_message_get_args(message, NULL, DBUS_TYPE_INT32, &reply, DBUS_TYPE_INVALID);
+		if (!dbus_message_get_args(message, NULL, DBUS_TYPE_INT32, &reply, DBUS_TYPE_UINT32, &session_id,
+					   DBUS_TYPE_UINT32, &generation, DBUS_TYPE_INVALID)) {
+			/* Network module without sessions */
+			session_id = 0;
+			dbus_message_get_args(message, NULL, DBUS_TYPE_INT32, &reply, DBUS_TYPE_INVALID);
+		}
 	}
+	if (message)
+		dbus_message_unref(message);
 
 	if (reply != TOR_DBUS_METHOD_START_RESULT_OK) {
 		network_data->connect_cb(ICD_SRV_ERROR, NULL, network_data->connect_cb_token);
 		network_free_all(network_data);
+		return;
+	}
+
+	network_data->session_id = session_id;
+	TP_DEBUG("Tor started, session %u at generation %u", session_id, generation);
+
+	/* Signals of our Start are sent before its reply, catch up on the newest */
+	for (l = network_data->early_status; l; l = l->next) {
+		tor_early_status *early = l->data;
+
+		if (early->session_id != session_id)
+			continue;
+		if (latest == NULL || (gint32) (early->generation - latest->generation) > 0)
+			latest = early;
+	}
+
+	if (latest != NULL) {
+		guint32 latest_generation = latest->generation;
+		int latest_state = latest->state;
+
+		g_slist_free_full(network_data->early_status, g_free);
+		network_data->early_status = NULL;
+
+		apply_status(network_data, latest_generation, latest_state);
+		return;
 	}
 
-	/* Otherwise, we wait for status changed signal(s) - assuming we don't get
-	 * them before the method reply (yikes) */
+	g_slist_free_full(network_data->early_status, g_free);
+	network_data->early_status = NULL;
+
+	/* Otherwise, we wait for status changed signal(s) */
 	return;
 }
 
@@ -202,58 +327,66 @@ tor_provider_statuschanged_sig(DBusConnection * connection, DBusMessage * messag
 	if (dbus_message_is_signal(message, ICD_TOR_DBUS_INTERFACE, ICD_TOR_SIGNAL_STATUSCHANGED)) {
 		const char *status = NULL;
 		const char *mode = NULL;
+		dbus_uint32_t generation = 0;
+		dbus_uint32_t session_id = 0;
 		int new_state = PROVIDER_TOR_STATE_NONE;
+		GSList *l;
 
 		if (!dbus_message_get_args(message, NULL,
-					   DBUS_TYPE_STRING, &status, DBUS_TYPE_STRING, &mode, DBUS_TYPE_INVALID)) {
-			TP_WARN("Unable to parse arguments of " ICD_TOR_SIGNAL_STATUSCHANGED);
-		}
-
-		/* Find network data, check status, potentially call callbacks based on
-		 * state */
-		tor_network_data *network_data = icd_tor_find_first_network_data(priv);
-
-		if (network_data == NULL) {
-			/* We're likely just not active at all */
-			goto done;
+					   DBUS_TYPE_STRING, &status, DBUS_TYPE_STRING, &mode,
+					   DBUS_TYPE_UINT32, &generation, DBUS_TYPE_UINT32, &session_id,
+					   DBUS_TYPE_INVALID)) {
+			/* Network module without sessions */
+			generation = 0;
+			session_id = 0;
+			if (!dbus_message_get_args(message, NULL,
+						   DBUS_TYPE_STRING, &status, DBUS_TYPE_STRING, &mode,
+						   DBUS_TYPE_INVALID)) {
+				TP_WARN("Unable to parse arguments of " ICD_TOR_SIGNAL_STATUSCHANGED);
+				goto done;
+			}
 		}
 
 		if (strcmp(status, ICD_TOR_SIGNALS_STATUS_STATE_STOPPED) == 0) {
-			TP_DEBUG("New state: Stopped");
+			TP_DEBUG("New state: Stopped (%u, session %u)", generation, session_id);
 			new_state = PROVIDER_TOR_STATE_STOPPED;
 		} else if (strcmp(status, ICD_TOR_SIGNALS_STATUS_STATE_STARTED) == 0) {
-			TP_DEBUG("New state: Started");
+			TP_DEBUG("New state: Started (%u, session %u)", generation, session_id);
 			new_state = PROVIDER_TOR_STATE_STARTED;
 		} else if (strcmp(status, ICD_TOR_SIGNALS_STATUS_STATE_CONNECTED) == 0) {
-			TP_DEBUG("New state: Connected");
+			TP_DEBUG("New state: Connected (%u, session %u)", generation, session_id);
 			new_state = PROVIDER_TOR_STATE_CONNECTED;
 		}
 
-		/* We could get an unexpected stop, or the expected start (after we
-		 * start it */
-		if (network_data->state > new_state) {
-			/* Tor quit, let's throw down the interface */
-
-			priv->close_fn(ICD_SRV_ERROR, "Tor process quit (unexpectedly)",
-				       network_data->service_type,
-				       network_data->service_attrs,
-				       network_data->service_id,
-				       network_data->network_type,
-				       network_data->network_attrs, network_data->network_id);
+		if (session_id == 0) {
+			/* Find network data, check status, potentially call callbacks
+			 * based on state */
+			tor_network_data *network_data = icd_tor_find_first_network_data(priv);
+
+			/* We're likely just not active at all */
+			if (network_data != NULL)
+				apply_status(network_data, 0, new_state);
 			goto done;
 		}
 
-		if (new_state > network_data->state) {
-			if (new_state == PROVIDER_TOR_STATE_CONNECTED) {
-				network_data->connect_cb(ICD_SRV_SUCCESS, NULL, network_data->connect_cb_token);
+		for (l = priv->network_data_list; l; l = l->next) {
+			tor_network_data *network_data = (tor_network_data *) l->data;
+
+			if (network_data->start_pending) {
+				/* Might be ours, we know once Start returns */
+				tor_early_status *early = g_new0(tor_early_status, 1);
+
+				early->generation = generation;
+				early->session_id = session_id;
+				early->state = new_state;
+				network_data->early_status = g_slist_prepend(network_data->early_status, early);
+			} else if (network_data->session_id == session_id) {
+				/* Other sessions belong to another IAP, or to an
+				 * earlier Start */
+				apply_status(network_data, generation, new_state);
+				break;
 			}
 		}
-
-		if (new_state == network_data->state) {
-			/* Nothing changed. */
-		}
-
-		network_data->state = new_state;
 	}
 
  done:
@@ -301,11 +434,18 @@ static void tor_connect(const gchar * service_type,
 	network_data->private = priv;
 
 	network_data->state = PROVIDER_TOR_STATE_STOPPED;
+	network_data->start_pending = TRUE;
+
+	/* Start will use the pre-started Tor, if any; a later scan may pre-start
+	 * again */
+	g_free(priv->prestart_service_id);
+	priv->prestart_service_id = NULL;
 
 	/* Issue dbus call, and upon dbus call result, call the connect_cb */
 
 	DBusMessage *msg;
-	msg = dbus_message_new_method_call(ICD_TOR_DBUS_INTERFACE, ICD_TOR_DBUS_PATH, ICD_TOR_DBUS_INTERFACE, "Start");
+	msg = dbus_message_new_method_call(ICD_TOR_DBUS_INTERFACE, ICD_TOR_DBUS_PATH, ICD_TOR_DBUS_INTERFACE,
+					   ICD_TOR_METHOD_START);
 	dbus_message_append_args(msg, DBUS_TYPE_STRING, &service_id, DBUS_TYPE_INVALID);
 
 	if (icd_dbus_send_system_mcall(msg, -1, tor_get_start_reply, network_data) == FALSE) {
@@ -401,6 +541,8 @@ static void tor_identify(enum icd_scan_status status,
 	TP_DEBUG("tor_identify: called for: %s\n", name);
 
 	if (match) {
+		request_prestart(*private, gconf_service_id);
+
 		identify_cb(ICD_SRV_IDENTIFIED, TOR_PROVIDER_TYPE,	/* service type */
 			    name,
 			    TOR_DEFAULT_SERVICE_ATTRIBUTES,
@@ -441,7 +583,10 @@ static void tor_srv_destruct(gpointer * private)
 		network_free_all(data);
 	}
 
+	g_free(priv->prestart_service_id);
 	g_free(priv);
+
+	config_cache_free();
 	return;
 }
 
@@ -473,9 +618,13 @@ gboolean icd_srv_init(struct icd_srv_api * srv_api,
 	priv->close_fn = close;
 	priv->limited_conn_fn = limited_conn;
 
+	if (!config_cache_init())
+		TP_WARN("Could not monitor gconf for IAP changes, not caching IAPs");
+
 	if (!icd_dbus_connect_system_bcast_signal
 	    (ICD_TOR_DBUS_INTERFACE, tor_provider_statuschanged_sig, priv, ICD_TOR_SIGNAL_STATUSCHANGED_FILTER)) {
 		TP_ERR("Unable to listen to icd2 tor signals");
+		config_cache_free();
 		g_free(priv);
 		return FALSE;
 	}
@@ -4,11 +4,63 @@
 #include <glib.h>
 #include "libicd_tor_shared.h"
 
+/* Set with --with-tor-binary and --with-tor-user, ICd runs as root so
+ * these are never taken from gconf */
+#ifndef TOR_BINARY
+#define TOR_BINARY "/usr/bin/tor"
+#endif
+#ifndef TOR_USER
+#define TOR_USER "debian-tor"
+#endif
+
+/* The copy of the network module that the tests and benchmarks link takes
+ * them from the environment instead, see tests/harness.c */
+#ifdef TOR_TESTS
+char *tor_tests_env(const char *name, const char *fallback);
+#undef TOR_BINARY
+#define TOR_BINARY tor_tests_env("ICD_TOR_TEST_BINARY", "/usr/bin/tor")
+#undef TOR_USER
+#define TOR_USER tor_tests_env("ICD_TOR_TEST_USER", "debian-tor")
+#endif
+
+/* One Tor configuration, as stored in gconf under GC_TOR/<name> */
+typedef struct _tor_config {
+	gchar *name;
+	gboolean transproxy_enabled;
+	gint socks_port;
+	gint control_port;
+	gint trans_port;
+	gint dns_port;
+	gchar *datadir;
+	gboolean bridges_enabled;
+	gchar *bridges;
+	/* Fastest reachable bridges to use, 0 for TOR_BRIDGES_DEFAULT_MAX */
+	gint bridges_max;
+	gboolean hs_enabled;
+	gchar *hiddenservices;
+	/* host:port to build circuits for after bootstrapping, and how often
+	 * to do so again, in seconds */
+	gchar **warmup;
+	gint warmup_refresh;
+} tor_config;
+
+/* Stream isolation of every TransPort we open */
+#define TOR_TRANSPORT_ISOLATION "IsolateClientAddr IsolateClientProtocol IsolateDestAddr IsolateDestPort"
+
+gboolean config_cache_init(void);
+void config_cache_free(void);
+const tor_config *config_get(const char *config_name);
 gboolean config_is_known(const char *config_name);
 gboolean config_has_transproxy(const char *config_name);
 gboolean network_is_tor_provider(const char *network_id, char **ret_gconf_service_id);
 gboolean get_system_wide_enabled(void);
+gboolean get_warm_standby_enabled(void);
+gboolean get_prestart_enabled(void);
+gboolean get_shared_daemon_enabled(void);
+gint get_dormant_timeout(void);
 char *generate_config(const char *config_name);
+gint config_get_control_port(const char *config_name);
+char *config_get_datadir(const char *config_name);
 char *get_active_config(void);
 
 #define TN_DEBUG(fmt, ...) ILOG_DEBUG(("[TOR NETWORK] "fmt), ##__VA_ARGS__)
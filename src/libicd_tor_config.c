@@ -20,82 +20,395 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include <glib.h>
 #include <gconf/gconf-client.h>
 
 #include "libicd_tor.h"
 
-gboolean config_is_known(const char *config_name)
-{
+/* Configurations and IAP classifications, dropped on gconf notifications.
+ * Without config_cache_init() everything is read from gconf directly. */
+static struct {
 	GConfClient *gconf_client;
-	GSList *providers = NULL, *l = NULL;
-	gboolean match = FALSE;
+	guint notify_tor_id;
+	guint notify_network_type_id;
+	guint notify_srv_provider_id;
+	guint notify_iap_id;
 
-	gconf_client = gconf_client_get_default();
+	GHashTable *configs;
+	tor_config *uncached;
+
+	gboolean active_config_valid;
+	gchar *active_config;
+
+	GHashTable *available_ids;
+
+	/* network_id -> iap_classification */
+	GHashTable *iaps;
+} cache;
+
+/* Outcome of network_is_tor_provider() for one IAP */
+typedef struct {
+	gboolean is_provider;
+	gchar *service_id;
+} iap_classification;
+
+static void iap_classification_free(iap_classification * iap)
+{
+	g_free(iap->service_id);
+	g_free(iap);
+}
+
+static void tor_config_free(tor_config * config)
+{
+	if (config == NULL)
+		return;
+
+	g_free(config->name);
+	g_free(config->datadir);
+	g_free(config->bridges);
+	g_free(config->hiddenservices);
+	g_strfreev(config->warmup);
+	g_free(config);
+}
+
+/* Returns NULL for a name without a gconf directory or DataDirectory, Tor
+ * cannot be started from it */
+static tor_config *tor_config_load(GConfClient * gconf, const char *config_name)
+{
+	tor_config *config;
+	GSList *entries, *l;
+	gchar *dir;
+
+	dir = g_strjoin("/", GC_TOR, config_name, NULL);
+	entries = gconf_client_all_entries(gconf, dir, NULL);
+	g_free(dir);
+
+	if (entries == NULL)
+		return NULL;
+
+	config = g_new0(tor_config, 1);
+	config->name = g_strdup(config_name);
+
+	for (l = entries; l; l = l->next) {
+		GConfEntry *entry = l->data;
+		GConfValue *value = gconf_entry_get_value(entry);
+		const char *key = strrchr(gconf_entry_get_key(entry), '/');
+
+		if (value == NULL || key == NULL)
+			goto next;
+		key++;
+
+		if (value->type == GCONF_VALUE_INT) {
+			if (!strcmp(key, GC_SOCKSPORT))
+				config->socks_port = gconf_value_get_int(value);
+			else if (!strcmp(key, GC_CONTROLPORT))
+				config->control_port = gconf_value_get_int(value);
+			else if (!strcmp(key, GC_TRANSPORT))
+				config->trans_port = gconf_value_get_int(value);
+			else if (!strcmp(key, GC_DNSPORT))
+				config->dns_port = gconf_value_get_int(value);
+			else if (!strcmp(key, GC_BRIDGESMAX))
+				config->bridges_max = gconf_value_get_int(value);
+			else if (!strcmp(key, GC_WARMUPREFRESH))
+				config->warmup_refresh = gconf_value_get_int(value);
+		} else if (value->type == GCONF_VALUE_BOOL) {
+			if (!strcmp(key, GC_TPENABLED))
+				config->transproxy_enabled = gconf_value_get_bool(value);
+			else if (!strcmp(key, GC_BRIDGESENABLED))
+				config->bridges_enabled = gconf_value_get_bool(value);
+			else if (!strcmp(key, GC_HSENABLED))
+				config->hs_enabled = gconf_value_get_bool(value);
+		} else if (value->type == GCONF_VALUE_STRING) {
+			if (!strcmp(key, GC_DATADIR)) {
+				g_free(config->datadir);
+				config->datadir = g_strdup(gconf_value_get_string(value));
+			} else if (!strcmp(key, GC_BRIDGES)) {
+				g_free(config->bridges);
+				config->bridges = g_strdup(gconf_value_get_string(value));
+			} else if (!strcmp(key, GC_HIDDENSERVICES)) {
+				g_free(config->hiddenservices);
+				config->hiddenservices = g_strdup(gconf_value_get_string(value));
+			}
+		} else if (value->type == GCONF_VALUE_LIST && gconf_value_get_list_type(value) == GCONF_VALUE_STRING) {
+			if (!strcmp(key, GC_WARMUP)) {
+				GSList *item;
+				GPtrArray *targets = g_ptr_array_new();
+
+				for (item = gconf_value_get_list(value); item; item = item->next)
+					g_ptr_array_add(targets, g_strdup(gconf_value_get_string(item->data)));
+				g_ptr_array_add(targets, NULL);
+
+				g_strfreev(config->warmup);
+				config->warmup = (gchar **) g_ptr_array_free(targets, FALSE);
+			}
+		}
+
+ next:
+		gconf_entry_free(entry);
+	}
+	g_slist_free(entries);
+
+	if (config->datadir == NULL || config->datadir[0] == '\0') {
+		tor_config_free(config);
+		return NULL;
+	}
+
+	return config;
+}
 
-	providers = gconf_client_get_list(gconf_client, GC_ICD_TOR_AVAILABLE_IDS, GCONF_VALUE_STRING, NULL);
+static GHashTable *available_ids_load(GConfClient * gconf)
+{
+	GHashTable *ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	GSList *providers, *l;
+
+	providers = gconf_client_get_list(gconf, GC_ICD_TOR_AVAILABLE_IDS, GCONF_VALUE_STRING, NULL);
 	for (l = providers; l; l = l->next) {
-		if (!strcmp(l->data, config_name)) {
-			match = TRUE;
-			break;
+		/* The table takes ownership of the strings */
+		g_hash_table_insert(ids, l->data, l->data);
+	}
+	g_slist_free(providers);
+
+	return ids;
+}
+
+/* Returned pointer is owned by the cache and only valid until the main loop
+ * runs again (gconf notifications may invalidate it) */
+const tor_config *config_get(const char *config_name)
+{
+	tor_config *config;
+
+	if (config_name == NULL)
+		return NULL;
+
+	if (cache.configs == NULL) {
+		GConfClient *gconf = gconf_client_get_default();
+
+		tor_config_free(cache.uncached);
+		cache.uncached = tor_config_load(gconf, config_name);
+		g_object_unref(gconf);
+
+		return cache.uncached;
+	}
+
+	config = g_hash_table_lookup(cache.configs, config_name);
+	if (config == NULL) {
+		config = tor_config_load(cache.gconf_client, config_name);
+		if (config)
+			g_hash_table_insert(cache.configs, config->name, config);
+	}
+
+	return config;
+}
+
+static void config_cache_notify(GConfClient * client, guint connection_id, GConfEntry * entry, gpointer user_data)
+{
+	const char *key = gconf_entry_get_key(entry);
+
+	if (key == NULL)
+		return;
+
+	if (g_str_has_prefix(key, GC_TOR "/")) {
+		const char *name = key + strlen(GC_TOR "/");
+		gchar *config_name = g_strndup(name, strcspn(name, "/"));
+
+		if (cache.configs)
+			g_hash_table_remove(cache.configs, config_name);
+		g_free(config_name);
+	} else if (!strcmp(key, GC_TOR_ACTIVE)) {
+		g_free(cache.active_config);
+		cache.active_config = NULL;
+		cache.active_config_valid = FALSE;
+	} else if (g_str_has_prefix(key, GC_IAP "/")) {
+		const char *name = key + strlen(GC_IAP "/");
+		gchar *network_id = g_strndup(name, strcspn(name, "/"));
+
+		if (cache.iaps)
+			g_hash_table_remove(cache.iaps, network_id);
+		g_free(network_id);
+	} else if (!strcmp(key, GC_ICD_TOR_AVAILABLE_IDS)) {
+		if (cache.available_ids) {
+			g_hash_table_destroy(cache.available_ids);
+			cache.available_ids = NULL;
 		}
+		/* Whether an IAP is a provider depends on the available ids */
+		if (cache.iaps)
+			g_hash_table_remove_all(cache.iaps);
 	}
-	g_slist_free_full(providers, g_free);
-	g_object_unref(gconf_client);
+}
 
-	return match;
+gboolean config_cache_init(void)
+{
+	GError *error = NULL;
+
+	if (cache.gconf_client != NULL)
+		return TRUE;
+
+	cache.gconf_client = gconf_client_get_default();
+
+	gconf_client_add_dir(cache.gconf_client, GC_TOR, GCONF_CLIENT_PRELOAD_NONE, &error);
+	if (error != NULL)
+		goto err;
+	gconf_client_add_dir(cache.gconf_client, GC_NETWORK_TYPE, GCONF_CLIENT_PRELOAD_NONE, &error);
+	if (error != NULL)
+		goto err;
+	gconf_client_add_dir(cache.gconf_client, GC_ICD_TOR_SRV_PROVIDER, GCONF_CLIENT_PRELOAD_NONE, &error);
+	if (error != NULL)
+		goto err;
+	gconf_client_add_dir(cache.gconf_client, GC_IAP, GCONF_CLIENT_PRELOAD_NONE, &error);
+	if (error != NULL)
+		goto err;
+
+	cache.notify_tor_id =
+	    gconf_client_notify_add(cache.gconf_client, GC_TOR, config_cache_notify, NULL, NULL, &error);
+	if (error != NULL)
+		goto err;
+	cache.notify_network_type_id =
+	    gconf_client_notify_add(cache.gconf_client, GC_TOR_ACTIVE, config_cache_notify, NULL, NULL, &error);
+	if (error != NULL)
+		goto err;
+	cache.notify_srv_provider_id =
+	    gconf_client_notify_add(cache.gconf_client, GC_ICD_TOR_AVAILABLE_IDS, config_cache_notify, NULL, NULL,
+				    &error);
+	if (error != NULL)
+		goto err;
+	cache.notify_iap_id =
+	    gconf_client_notify_add(cache.gconf_client, GC_IAP, config_cache_notify, NULL, NULL, &error);
+	if (error != NULL)
+		goto err;
+
+	cache.configs = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) tor_config_free);
+	cache.iaps = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) iap_classification_free);
+
+	return TRUE;
+
+ err:
+	g_clear_error(&error);
+	config_cache_free();
+	return FALSE;
 }
 
-gboolean config_has_transproxy(const char *config_name)
+void config_cache_free(void)
+{
+	if (cache.gconf_client != NULL) {
+		if (cache.notify_tor_id != 0)
+			gconf_client_notify_remove(cache.gconf_client, cache.notify_tor_id);
+		if (cache.notify_network_type_id != 0)
+			gconf_client_notify_remove(cache.gconf_client, cache.notify_network_type_id);
+		if (cache.notify_srv_provider_id != 0)
+			gconf_client_notify_remove(cache.gconf_client, cache.notify_srv_provider_id);
+		if (cache.notify_iap_id != 0)
+			gconf_client_notify_remove(cache.gconf_client, cache.notify_iap_id);
+
+		gconf_client_remove_dir(cache.gconf_client, GC_TOR, NULL);
+		gconf_client_remove_dir(cache.gconf_client, GC_NETWORK_TYPE, NULL);
+		gconf_client_remove_dir(cache.gconf_client, GC_ICD_TOR_SRV_PROVIDER, NULL);
+		gconf_client_remove_dir(cache.gconf_client, GC_IAP, NULL);
+
+		g_object_unref(cache.gconf_client);
+	}
+
+	if (cache.configs)
+		g_hash_table_destroy(cache.configs);
+	if (cache.available_ids)
+		g_hash_table_destroy(cache.available_ids);
+	if (cache.iaps)
+		g_hash_table_destroy(cache.iaps);
+	tor_config_free(cache.uncached);
+	g_free(cache.active_config);
+
+	memset(&cache, 0, sizeof(cache));
+}
+
+gboolean config_is_known(const char *config_name)
 {
-	gboolean tp_enabled = FALSE;
-	GConfClient *gconf_client = gconf_client_get_default();
+	GConfClient *gconf_client;
+	GHashTable *ids;
+	gboolean match;
 
-	gchar *gc_tpenabled = g_strjoin("/", GC_TOR, config_name, GC_TPENABLED, NULL);
-	tp_enabled = gconf_client_get_bool(gconf_client, gc_tpenabled, NULL);
-	g_free(gc_tpenabled);
+	if (cache.gconf_client != NULL) {
+		if (cache.available_ids == NULL)
+			cache.available_ids = available_ids_load(cache.gconf_client);
 
+		return g_hash_table_lookup(cache.available_ids, config_name) != NULL;
+	}
+
+	gconf_client = gconf_client_get_default();
+	ids = available_ids_load(gconf_client);
 	g_object_unref(gconf_client);
 
-	return tp_enabled;
+	match = g_hash_table_lookup(ids, config_name) != NULL;
+	g_hash_table_destroy(ids);
+
+	return match;
 }
 
-gboolean network_is_tor_provider(const char *network_id, char **ret_gconf_service_id)
+gboolean config_has_transproxy(const char *config_name)
+{
+	const tor_config *config = config_get(config_name);
+
+	return config ? config->transproxy_enabled : FALSE;
+}
+
+static iap_classification *iap_classify(const char *network_id)
 {
 	GConfClient *gconf_client;
 	gchar *iap_gconf_key;
 	char *gconf_service_type = NULL;
-	char *gconf_service_id = NULL;
-	gboolean service_id_known = FALSE;
-	gboolean match = FALSE;
+	iap_classification *iap = g_new0(iap_classification, 1);
 
 	gconf_client = gconf_client_get_default();
 
-	iap_gconf_key = g_strdup_printf("/system/osso/connectivity/IAP/%s/service_type", network_id);
+	iap_gconf_key = g_strdup_printf(GC_IAP "/%s/service_type", network_id);
 	gconf_service_type = gconf_client_get_string(gconf_client, iap_gconf_key, NULL);
 	g_free(iap_gconf_key);
 
-	iap_gconf_key = g_strdup_printf("/system/osso/connectivity/IAP/%s/service_id", network_id);
-	gconf_service_id = gconf_client_get_string(gconf_client, iap_gconf_key, NULL);
+	iap_gconf_key = g_strdup_printf(GC_IAP "/%s/service_id", network_id);
+	iap->service_id = gconf_client_get_string(gconf_client, iap_gconf_key, NULL);
 	g_free(iap_gconf_key);
 	g_object_unref(gconf_client);
 
-	service_id_known = gconf_service_id && config_is_known(gconf_service_id);
+	iap->is_provider = iap->service_id && config_is_known(iap->service_id) &&
+	    (g_strcmp0(TOR_PROVIDER_TYPE, gconf_service_type) == 0);
 
-	if (ret_gconf_service_id)
-		*ret_gconf_service_id = g_strdup(gconf_service_id);
+	g_free(gconf_service_type);
+
+	return iap;
+}
 
-	match = service_id_known && (g_strcmp0(TOR_PROVIDER_TYPE, gconf_service_type) == 0);
+gboolean network_is_tor_provider(const char *network_id, char **ret_gconf_service_id)
+{
+	iap_classification *iap;
+	gboolean match;
 
-	if (gconf_service_type) {
-		g_free(gconf_service_type);
+	if (network_id == NULL) {
+		if (ret_gconf_service_id)
+			*ret_gconf_service_id = NULL;
+		return FALSE;
 	}
 
-	if (gconf_service_id) {
-		g_free(gconf_service_id);
+	if (cache.iaps != NULL) {
+		iap = g_hash_table_lookup(cache.iaps, network_id);
+		if (iap == NULL) {
+			iap = iap_classify(network_id);
+			g_hash_table_insert(cache.iaps, g_strdup(network_id), iap);
+		}
+
+		if (ret_gconf_service_id)
+			*ret_gconf_service_id = g_strdup(iap->service_id);
+
+		return iap->is_provider;
 	}
 
+	iap = iap_classify(network_id);
+
+	if (ret_gconf_service_id)
+		*ret_gconf_service_id = g_strdup(iap->service_id);
+	match = iap->is_provider;
+
+	iap_classification_free(iap);
+
 	return match;
 }
 
@@ -113,96 +426,130 @@ gboolean get_system_wide_enabled(void)
 	return enabled;
 }
 
-char *get_active_config(void)
+gboolean get_warm_standby_enabled(void)
 {
 	GConfClient *gconf;
-	char *active_config = NULL;
+	gboolean enabled = FALSE;
 
 	gconf = gconf_client_get_default();
 
-	active_config = gconf_client_get_string(gconf, GC_TOR_ACTIVE, NULL);
+	enabled = gconf_client_get_bool(gconf, GC_TOR_WARM_STANDBY, NULL);
 
 	g_object_unref(gconf);
 
-	return active_config;
+	return enabled;
 }
 
-char *generate_config(const char *config_name)
+gboolean get_prestart_enabled(void)
 {
 	GConfClient *gconf;
-	gchar *torrc;
-	gboolean bridges_enabled, hs_enabled;
-	gint socks_port, control_port, trans_port, dns_port;
-	gchar *datadir, *bridges, *hiddenservices;
+	gboolean enabled = FALSE;
 
 	gconf = gconf_client_get_default();
 
-	gchar *gc_socksport = g_strjoin("/", GC_TOR, config_name, GC_SOCKSPORT, NULL);
-	socks_port = gconf_client_get_int(gconf, gc_socksport, NULL);
-	g_free(gc_socksport);
+	enabled = gconf_client_get_bool(gconf, GC_TOR_PRESTART, NULL);
+
+	g_object_unref(gconf);
 
-	gchar *gc_controlport = g_strjoin("/", GC_TOR, config_name, GC_CONTROLPORT, NULL);
-	control_port = gconf_client_get_int(gconf, gc_controlport, NULL);
-	g_free(gc_controlport);
+	return enabled;
+}
 
-	gchar *gc_transport = g_strjoin("/", GC_TOR, config_name, GC_TRANSPORT, NULL);
-	trans_port = gconf_client_get_int(gconf, gc_transport, NULL);
-	g_free(gc_transport);
+gboolean get_shared_daemon_enabled(void)
+{
+	GConfClient *gconf;
+	gboolean enabled = FALSE;
 
-	gchar *gc_dnsport = g_strjoin("/", GC_TOR, config_name, GC_DNSPORT, NULL);
-	dns_port = gconf_client_get_int(gconf, gc_dnsport, NULL);
-	g_free(gc_dnsport);
+	gconf = gconf_client_get_default();
 
-	gchar *gc_datadir = g_strjoin("/", GC_TOR, config_name, GC_DATADIR, NULL);
-	datadir = gconf_client_get_string(gconf, gc_datadir, NULL);
-	g_free(gc_datadir);
+	enabled = gconf_client_get_bool(gconf, GC_TOR_SHARED_DAEMON, NULL);
 
-	gchar *gc_bridgesenabled = g_strjoin("/", GC_TOR, config_name, GC_BRIDGESENABLED, NULL);
-	bridges_enabled = gconf_client_get_bool(gconf, gc_bridgesenabled, NULL);
-	g_free(gc_bridgesenabled);
+	g_object_unref(gconf);
 
-	if (bridges_enabled) {
-		gchar *gc_bridges = g_strjoin("/", GC_TOR, config_name, GC_BRIDGES, NULL);
-		bridges = gconf_client_get_string(gconf, gc_bridges, NULL);
-		g_free(gc_bridges);
-	} else {
-		bridges = "";
-	}
+	return enabled;
+}
 
-	gchar *gc_hsenabled = g_strjoin("/", GC_TOR, config_name, GC_HSENABLED, NULL);
-	hs_enabled = gconf_client_get_bool(gconf, gc_hsenabled, NULL);
-	g_free(gc_hsenabled);
-
-	if (hs_enabled) {
-		gchar *gc_hiddenservices = g_strjoin("/", GC_TOR, config_name, GC_HIDDENSERVICES,
-						     NULL);
-		hiddenservices = gconf_client_get_string(gconf, gc_hiddenservices, NULL);
-		g_free(gc_hiddenservices);
-	} else {
-		hiddenservices = "";
-	}
+/* Seconds without streams before Tor goes dormant, 0 to never */
+gint get_dormant_timeout(void)
+{
+	GConfClient *gconf;
+	gint timeout = 0;
+
+	gconf = gconf_client_get_default();
+
+	timeout = gconf_client_get_int(gconf, GC_TOR_DORMANT_TIMEOUT, NULL);
 
 	g_object_unref(gconf);
 
-	torrc = g_strdup_printf(
-        /* "User debian-tor\n" */
+	return timeout;
+}
+
+char *get_active_config(void)
+{
+	GConfClient *gconf;
+	char *active_config = NULL;
+
+	if (cache.gconf_client != NULL && cache.active_config_valid)
+		return g_strdup(cache.active_config);
+
+	gconf = gconf_client_get_default();
+
+	active_config = gconf_client_get_string(gconf, GC_TOR_ACTIVE, NULL);
+
+	g_object_unref(gconf);
+
+	if (cache.gconf_client != NULL) {
+		cache.active_config = g_strdup(active_config);
+		cache.active_config_valid = TRUE;
+	}
+
+	return active_config;
+}
+
+gint config_get_control_port(const char *config_name)
+{
+	const tor_config *config = config_get(config_name);
+
+	return config ? config->control_port : 0;
+}
+
+char *config_get_datadir(const char *config_name)
+{
+	const tor_config *config = config_get(config_name);
+
+	return config ? g_strdup(config->datadir) : NULL;
+}
+
+char *generate_config(const char *config_name)
+{
+	const tor_config *config = config_get(config_name);
+	const char *bridges = "", *hiddenservices = "";
+
+	if (config == NULL)
+		return NULL;
+
+	/* All of them, the fastest are picked with SETCONF once probed */
+	if (config->bridges_enabled && config->bridges)
+		bridges = config->bridges;
+
+	if (config->hs_enabled && config->hiddenservices)
+		hiddenservices = config->hiddenservices;
+
+	return g_strdup_printf(
 		"SocksPort %d\n"
 		"ControlPort %d\n"
 		"VirtualAddrNetworkIPv4 10.192.0.0/10\n"
 		"AutomapHostsOnResolve 1\n"
-		"TransPort %d IsolateClientAddr IsolateClientProtocol IsolateDestAddr IsolateDestPort\n"
+		"TransPort %d " TOR_TRANSPORT_ISOLATION "\n"
 		"DNSPort %d\n"
 		"CookieAuthentication 1\n"
 		"DataDirectory %s\n" "%s\n"	/* bridges */
 		"%s\n",	/* hiddenservices */
-		socks_port,
-		control_port,
-		trans_port,
-		dns_port,
-		datadir,
+		config->socks_port,
+		config->control_port,
+		config->trans_port,
+		config->dns_port,
+		config->datadir,
 		bridges,
 		hiddenservices
 	);
-
-	return torrc;
 }
@@ -30,11 +30,17 @@
 #define TOR_DEFAULT_SERVICE_PRIORITY 0
 
 #define GC_TOR "/system/osso/connectivity/providers/tor"
-#define GC_ICD_TOR_AVAILABLE_IDS "/system/osso/connectivity/srv_provider/TOR/available_ids"
+#define GC_IAP "/system/osso/connectivity/IAP"
+#define GC_ICD_TOR_SRV_PROVIDER "/system/osso/connectivity/srv_provider/TOR"
+#define GC_ICD_TOR_AVAILABLE_IDS GC_ICD_TOR_SRV_PROVIDER"/available_ids"
 
 #define GC_NETWORK_TYPE "/system/osso/connectivity/network_type/TOR"
 #define GC_TOR_ACTIVE  GC_NETWORK_TYPE"/active_config"
 #define GC_TOR_SYSTEM  GC_NETWORK_TYPE"/system_wide_enabled"
+#define GC_TOR_WARM_STANDBY  GC_NETWORK_TYPE"/warm_standby"
+#define GC_TOR_PRESTART  GC_NETWORK_TYPE"/prestart"
+#define GC_TOR_SHARED_DAEMON  GC_NETWORK_TYPE"/shared_daemon"
+#define GC_TOR_DORMANT_TIMEOUT  GC_NETWORK_TYPE"/dormant_timeout"
 
 #define GC_TPENABLED       "transproxy-enabled"
 #define GC_SOCKSPORT       "socks-port"
@@ -45,17 +51,35 @@
 #define GC_RUNDIR          "rundir"
 #define GC_BRIDGES         "bridges"
 #define GC_BRIDGESENABLED  "bridges-enabled"
+#define GC_BRIDGESMAX      "bridges-max"
 #define GC_HIDDENSERVICES  "hiddenservices"
 #define GC_HSENABLED       "hiddenservices-enabled"
+#define GC_WARMUP          "warmup"
+#define GC_WARMUPREFRESH   "warmup-refresh"
 
 #define ICD_TOR_DBUS_INTERFACE "org.maemo.Tor"
 #define ICD_TOR_DBUS_PATH "/org/maemo/Tor"
 
-#define ICD_TOR_METHOD_GETSTATUS ICD_TOR_DBUS_INTERFACE".GetStatus"
+#define ICD_TOR_METHOD_START             "Start"
+#define ICD_TOR_METHOD_STARTANDWAIT      "StartAndWait"
+#define ICD_TOR_METHOD_STOP              "Stop"
+#define ICD_TOR_METHOD_GETSTATUS         "GetStatus"
+#define ICD_TOR_METHOD_GETBOOTSTRAPPROGRESS "GetBootstrapProgress"
+#define ICD_TOR_METHOD_PRESTART          "Prestart"
+#define ICD_TOR_METHOD_GETTIMINGS        "GetTimings"
+#define ICD_TOR_METHOD_GETSTARTSTATS     "GetStartStats"
+#define ICD_TOR_METHOD_DUMPTRACE         "DumpTrace"
+#define ICD_TOR_METHOD_GETSIGNALCOUNTERS "GetSignalCounters"
+#define ICD_TOR_METHOD_GETWARMUPSTATS    "GetWarmupStats"
+#define ICD_TOR_METHOD_ADDONION          "AddOnion"
+#define ICD_TOR_METHOD_REMOVEONION       "RemoveOnion"
+#define ICD_TOR_METHOD_GETDORMANTSTATS   "GetDormantStats"
 
 #define ICD_TOR_SIGNAL_STATUSCHANGED      "StatusChanged"
 #define ICD_TOR_SIGNAL_STATUSCHANGED_FILTER "member='" ICD_TOR_SIGNAL_STATUSCHANGED "'"
 
+#define ICD_TOR_SIGNAL_BOOTSTRAPPROGRESS  "BootstrapProgress"
+
 #define ICD_TOR_SIGNALS_STATUS_STATE_CONNECTED "Connected"
 #define ICD_TOR_SIGNALS_STATUS_STATE_STARTED "Started"
 #define ICD_TOR_SIGNALS_STATUS_STATE_STOPPED "Stopped"
@@ -70,6 +94,8 @@ enum TOR_DBUS_METHOD_START_RESULT {
 	TOR_DBUS_METHOD_START_RESULT_INVALID_ARGS,
 	TOR_DBUS_METHOD_START_RESULT_ALREADY_RUNNING,
 	TOR_DBUS_METHOD_START_RESULT_REFUSED,
+	/* StartAndWait only, Tor is still starting */
+	TOR_DBUS_METHOD_START_RESULT_TIMEOUT,
 };
 
 enum TOR_DBUS_METHOD_STOP_RESULT {
@@ -78,4 +104,12 @@ enum TOR_DBUS_METHOD_STOP_RESULT {
 	TOR_DBUS_METHOD_STOP_RESULT_REFUSED,
 };
 
+enum TOR_DBUS_METHOD_ONION_RESULT {
+	TOR_DBUS_METHOD_ONION_RESULT_OK,
+	TOR_DBUS_METHOD_ONION_RESULT_FAILED,
+	TOR_DBUS_METHOD_ONION_RESULT_INVALID_ARGS,
+	TOR_DBUS_METHOD_ONION_RESULT_NOT_RUNNING,
+	TOR_DBUS_METHOD_ONION_RESULT_NOT_FOUND,
+};
+
 #endif				/* __LIBICD_TOR_SHARED_H */
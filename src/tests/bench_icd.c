@@ -0,0 +1,221 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Connects and disconnects the Tor IAP through the mock ICd over and over,
+ * and prints percentiles of the end-to-end ip_up and ip_down latencies and
+ * of every startup stage the module timed (see GetTimings).
+ *
+ * Usage: bench-icd [CYCLES]
+ *
+ * Tor is fake-tor unless ICD_TOR_TEST_BINARY names another binary, a
+ * fake-tor script can be given in the file ICD_TOR_BENCH_SCRIPT, e.g. with
+ * "sleep" lines to model a slow network. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "libicd_tor.h"
+#include "harness.h"
+
+#define BENCH_NETWORK_ID "bench"
+#define BENCH_DEFAULT_CYCLES 200
+#define BENCH_TIMEOUT_MS 120000
+
+typedef struct {
+	/* Microseconds */
+	GArray *ip_up;
+	GArray *ip_down;
+	/* Stage names in the order GetTimings lists them */
+	GPtrArray *stage_names;
+	/* Milliseconds from the start of startup_tor(), by stage name */
+	GHashTable *stages;
+	guint failures;
+} bench_samples;
+
+static void bench_array_free(gpointer array)
+{
+	g_array_free(array, TRUE);
+}
+
+static gint bench_compare(gconstpointer a, gconstpointer b)
+{
+	gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank, like the module's own percentiles */
+static gint64 bench_percentile(GArray * sorted, guint pct)
+{
+	guint rank = (pct * sorted->len + 99) / 100;
+
+	return g_array_index(sorted, gint64, rank > 0 ? rank - 1 : 0);
+}
+
+static void bench_print(const char *name, GArray * samples, gdouble scale)
+{
+	if (samples->len == 0) {
+		printf("%-20s %6u\n", name, 0);
+		return;
+	}
+
+	g_array_sort(samples, bench_compare);
+	printf("%-20s %6u %9.1f %9.1f %9.1f %9.1f\n", name, samples->len,
+	       bench_percentile(samples, 50) / scale, bench_percentile(samples, 90) / scale,
+	       bench_percentile(samples, 99) / scale, g_array_index(samples, gint64, samples->len - 1) / scale);
+}
+
+/* Stages of the newest timeline in a GetTimings reply */
+static void bench_add_stages(bench_samples * samples, DBusMessage * reply)
+{
+	DBusMessageIter iter, history, timeline, stages, pair;
+	guint i;
+
+	if (!dbus_message_iter_init(reply, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+		return;
+
+	dbus_message_iter_recurse(&iter, &history);
+	if (dbus_message_iter_get_arg_type(&history) != DBUS_TYPE_STRUCT)
+		return;
+
+	/* Start time, start kind and success come first */
+	dbus_message_iter_recurse(&history, &timeline);
+	for (i = 0; i < 3; i++)
+		dbus_message_iter_next(&timeline);
+
+	dbus_message_iter_recurse(&timeline, &stages);
+	while (dbus_message_iter_get_arg_type(&stages) == DBUS_TYPE_STRUCT) {
+		const char *name;
+		dbus_int32_t ms;
+		GArray *stage;
+		gint64 value;
+
+		dbus_message_iter_recurse(&stages, &pair);
+		dbus_message_iter_get_basic(&pair, &name);
+		dbus_message_iter_next(&pair);
+		dbus_message_iter_get_basic(&pair, &ms);
+
+		stage = g_hash_table_lookup(samples->stages, name);
+		if (stage == NULL) {
+			stage = g_array_new(FALSE, FALSE, sizeof(gint64));
+			g_ptr_array_add(samples->stage_names, g_strdup(name));
+			g_hash_table_insert(samples->stages, g_strdup(name), stage);
+		}
+		value = ms;
+		g_array_append_val(stage, value);
+
+		dbus_message_iter_next(&stages);
+	}
+}
+
+static void bench_cycle(bench_samples * samples)
+{
+	harness_result result;
+	DBusMessage *reply;
+	pid_t pid;
+
+	harness_ip_up(BENCH_NETWORK_ID, &result);
+	if (!harness_wait(&result.done, BENCH_TIMEOUT_MS) || result.status != ICD_NW_SUCCESS) {
+		samples->failures++;
+		if (!result.done)
+			g_error("ip_up did not return within %d ms", BENCH_TIMEOUT_MS);
+	} else {
+		g_array_append_val(samples->ip_up, result.elapsed_us);
+	}
+	harness_result_clear(&result);
+
+	reply = harness_call(ICD_TOR_METHOD_GETTIMINGS, DBUS_TYPE_INVALID);
+	if (reply != NULL) {
+		bench_add_stages(samples, reply);
+		dbus_message_unref(reply);
+	}
+
+	pid = harness_tor_pid();
+	harness_ip_down(BENCH_NETWORK_ID, &result);
+	if (!harness_wait(&result.done, BENCH_TIMEOUT_MS))
+		g_error("ip_down did not return within %d ms", BENCH_TIMEOUT_MS);
+	g_array_append_val(samples->ip_down, result.elapsed_us);
+	harness_result_clear(&result);
+
+	/* The next cycle needs the control port */
+	if (pid != 0 && !harness_wait_pid_exit(pid, BENCH_TIMEOUT_MS))
+		g_error("Tor %d did not exit after ip_down", pid);
+}
+
+int main(int argc, char *argv[])
+{
+	bench_samples samples;
+	const char *script_path = g_getenv("ICD_TOR_BENCH_SCRIPT");
+	guint cycles = BENCH_DEFAULT_CYCLES;
+	guint i;
+
+	if (argc > 1)
+		cycles = strtoul(argv[1], NULL, 10);
+	if (cycles == 0) {
+		fprintf(stderr, "Usage: %s [CYCLES]\n", argv[0]);
+		return 1;
+	}
+
+	harness_init();
+
+	if (script_path != NULL) {
+		gchar *script = NULL;
+
+		if (!g_file_get_contents(script_path, &script, NULL, NULL))
+			g_error("Could not read %s", script_path);
+		harness_set_script(script);
+		g_free(script);
+	}
+
+	memset(&samples, 0, sizeof(samples));
+	samples.ip_up = g_array_new(FALSE, FALSE, sizeof(gint64));
+	samples.ip_down = g_array_new(FALSE, FALSE, sizeof(gint64));
+	samples.stage_names = g_ptr_array_new_with_free_func(g_free);
+	samples.stages = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, bench_array_free);
+
+	harness_start_module();
+	for (i = 0; i < cycles; i++)
+		bench_cycle(&samples);
+	harness_stop_module();
+
+	printf("%u cycles with %s, %u failed\n\n", cycles, TOR_BINARY, samples.failures);
+	printf("%-20s %6s %9s %9s %9s %9s\n", "ms", "n", "p50", "p90", "p99", "max");
+	for (i = 0; i < samples.stage_names->len; i++) {
+		const char *name = g_ptr_array_index(samples.stage_names, i);
+
+		bench_print(name, g_hash_table_lookup(samples.stages, name), 1);
+	}
+	bench_print("ip_up", samples.ip_up, 1000);
+	bench_print("ip_down", samples.ip_down, 1000);
+
+	g_ptr_array_free(samples.stage_names, TRUE);
+	g_hash_table_destroy(samples.stages);
+	g_array_free(samples.ip_up, TRUE);
+	g_array_free(samples.ip_down, TRUE);
+
+	harness_cleanup();
+
+	return samples.failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Times how long ICd is held up starting a process, with spawn_as() and
+ * with the fork() it used before, while ICd's resident set is large. Both
+ * start /bin/true as TOR_USER and the time is until they return to the
+ * caller, reaping the child is not counted.
+ *
+ * Usage: bench-spawn [SPAWNS [RSS_MB]]
+ *
+ * As root, the user is nobody unless ICD_TOR_TEST_USER says otherwise,
+ * else it is the one running the benchmark. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+
+#include "libicd_network_tor.h"
+
+#define BENCH_DEFAULT_SPAWNS 200
+#define BENCH_DEFAULT_RSS_MB 256
+#define BENCH_BINARY "/bin/true"
+
+static gint bench_compare(gconstpointer a, gconstpointer b)
+{
+	gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank, like the module's own percentiles */
+static gint64 bench_percentile(GArray * sorted, guint pct)
+{
+	guint rank = (pct * sorted->len + 99) / 100;
+
+	return g_array_index(sorted, gint64, rank > 0 ? rank - 1 : 0);
+}
+
+static void bench_print(const char *name, GArray * samples)
+{
+	if (samples->len == 0) {
+		printf("%-20s %6u\n", name, 0);
+		return;
+	}
+
+	g_array_sort(samples, bench_compare);
+	printf("%-20s %6u %9" G_GINT64_FORMAT " %9" G_GINT64_FORMAT " %9" G_GINT64_FORMAT " %9" G_GINT64_FORMAT
+	       "\n", name, samples->len, bench_percentile(samples, 50), bench_percentile(samples, 90),
+	       bench_percentile(samples, 99), g_array_index(samples, gint64, samples->len - 1));
+}
+
+/* spawn_as() as it was, before it used clone(CLONE_VM | CLONE_VFORK) */
+static pid_t bench_fork_as(const char *username, const char *pathname, char *args[])
+{
+	struct passwd *ent = getpwnam(username);
+	pid_t pid;
+
+	if (ent == NULL)
+		return 0;
+
+	pid = fork();
+	if (pid < 0) {
+		return 0;
+	} else if (pid == 0) {
+		if (getuid() != ent->pw_uid) {
+			if (setgid(ent->pw_gid) || setuid(ent->pw_uid))
+				_exit(1);
+		}
+		execv(pathname, args);
+		_exit(1);
+	}
+
+	return pid;
+}
+
+static void bench_run(GArray * samples, pid_t(*spawn) (const char *, const char *, char *[]), guint spawns)
+{
+	char *args[] = { BENCH_BINARY, NULL };
+	guint i;
+
+	for (i = 0; i < spawns; i++) {
+		gint64 start = g_get_monotonic_time(), elapsed;
+		int status;
+		pid_t pid;
+
+		pid = spawn(TOR_USER, BENCH_BINARY, args);
+		elapsed = g_get_monotonic_time() - start;
+		if (pid == 0)
+			g_error("Could not start %s as %s", BENCH_BINARY, TOR_USER);
+
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			g_error("%s as %s did not exit cleanly", BENCH_BINARY, TOR_USER);
+
+		g_array_append_val(samples, elapsed);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	GArray *clone_samples, *fork_samples;
+	guint spawns = BENCH_DEFAULT_SPAWNS;
+	guint rss_mb = BENCH_DEFAULT_RSS_MB;
+	char *rss;
+
+	if (argc > 1)
+		spawns = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		rss_mb = strtoul(argv[2], NULL, 10);
+	if (spawns == 0) {
+		fprintf(stderr, "Usage: %s [SPAWNS [RSS_MB]]\n", argv[0]);
+		return 1;
+	}
+
+	g_setenv("ICD_TOR_TEST_USER", getuid() == 0 ? "nobody" : g_get_user_name(), FALSE);
+
+	/* Touched, so it is resident and fork() has to copy its page tables */
+	rss = g_malloc((gsize) MAX(rss_mb, 1) << 20);
+	memset(rss, 1, (gsize) MAX(rss_mb, 1) << 20);
+
+	clone_samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+	fork_samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+	bench_run(fork_samples, bench_fork_as, spawns);
+	bench_run(clone_samples, spawn_as, spawns);
+
+	printf("%u spawns of %s as %s with %u MB resident\n\n", spawns, BENCH_BINARY, TOR_USER,
+	       rss_mb);
+	printf("%-20s %6s %9s %9s %9s %9s\n", "us", "n", "p50", "p90", "p99", "max");
+	bench_print("fork", fork_samples);
+	bench_print("spawn_as", clone_samples);
+
+	g_array_free(clone_samples, TRUE);
+	g_array_free(fork_samples, TRUE);
+	g_free(rss);
+
+	return 0;
+}
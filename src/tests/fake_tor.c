@@ -0,0 +1,824 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* A stand-in for Tor that only has a control port.
+ *
+ * Started as "fake-tor -f TORRC [--Option value...]" like Tor. It reads
+ * ControlPort, DataDirectory, CookieAuthentication, CookieAuthFile and
+ * DisableNetwork, writes the authentication cookie and answers AUTHENTICATE,
+ * PROTOCOLINFO, GETINFO, SETEVENTS, SETCONF, RESETCONF, +LOADCONF, SIGNAL,
+ * ADD_ONION, DEL_ONION and QUIT on 127.0.0.1:ControlPort.
+ *
+ * What it does otherwise is scripted, one action per line, in the file
+ * fake_tor_script in the DataDirectory. Without one it bootstraps right
+ * away once events are set and the network is enabled (FAKE_TOR_SCRIPT).
+ *
+ *   wait authenticated       until a controller authenticated
+ *   wait events              until a controller set STATUS_CLIENT events
+ *   wait network             until DisableNetwork is 0
+ *   wait command PREFIX      until a command starting with PREFIX came in,
+ *                            after the one an earlier wait command matched
+ *   sleep MS
+ *   bootstrap PCT TAG SUMMARY
+ *                            STATUS_CLIENT BOOTSTRAP event, and what
+ *                            GETINFO status/bootstrap-phase returns
+ *   circuit-established      STATUS_CLIENT CIRCUIT_ESTABLISHED event
+ *   event TYPE [REST]        "650 TYPE REST" to the controllers of TYPE
+ *   drop                     closes the controller connections
+ *   hang                     stops answering and running the script,
+ *                            without exiting
+ *   crash                    abort()
+ *   exit CODE
+ *
+ * Every command it gets is appended to fake_tor.log in the DataDirectory
+ * (AUTHENTICATE without the cookie), and its pid is in fake_tor.pid. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <glib.h>
+
+#define FAKE_TOR_VERSION "0.4.8.0-fake"
+#define FAKE_TOR_COOKIE_LEN 32
+
+#define FAKE_TOR_SCRIPT \
+	"wait events\n" \
+	"wait network\n" \
+	"bootstrap 5 conn Connecting to a relay\n" \
+	"bootstrap 50 loading_descriptors Loading relay descriptors\n" \
+	"bootstrap 100 done Done\n" \
+	"circuit-established\n"
+
+typedef struct {
+	int fd;
+	GIOChannel *channel;
+	guint in_id;
+	GString *inbuf;
+	gboolean authenticated;
+	gchar **events;
+	/* Collecting the lines of a +LOADCONF */
+	GString *loadconf;
+} fake_controller;
+
+static struct {
+	GMainLoop *loop;
+
+	gint control_port;
+	gchar *datadir;
+	gboolean cookie_auth;
+	gchar *cookie_file;
+	guchar cookie[FAKE_TOR_COOKIE_LEN];
+	gboolean disable_network;
+	gchar **bridges;
+
+	int listen_fd;
+	GIOChannel *listen_channel;
+	guint listen_id;
+	GSList *controllers;
+	FILE *log;
+
+	gint progress;
+	gchar *tag;
+	gchar *summary;
+	gboolean circuit_established;
+
+	guint onion_count;
+	GHashTable *onions;
+
+	gchar **script;
+	guint pc;
+	guint sleep_id;
+	gboolean hung;
+	/* Commands seen, and how far wait command looked */
+	GPtrArray *commands;
+	guint commands_matched;
+} tor;
+
+static void script_run(void);
+
+static void fake_log(const char *line)
+{
+	if (tor.log == NULL)
+		return;
+
+	fprintf(tor.log, "%s\n", line);
+	fflush(tor.log);
+}
+
+static void controller_send(fake_controller * controller, const char *reply)
+{
+	size_t len = strlen(reply), done = 0;
+
+	while (done < len) {
+		ssize_t ret = send(controller->fd, reply + done, len - done, MSG_NOSIGNAL);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* The reader is gone or stuck, it notices soon enough */
+			return;
+		}
+		done += ret;
+	}
+}
+
+static void controller_free(fake_controller * controller)
+{
+	tor.controllers = g_slist_remove(tor.controllers, controller);
+
+	if (controller->in_id)
+		g_source_remove(controller->in_id);
+	g_io_channel_unref(controller->channel);
+	close(controller->fd);
+	g_string_free(controller->inbuf, TRUE);
+	if (controller->loadconf)
+		g_string_free(controller->loadconf, TRUE);
+	g_strfreev(controller->events);
+	g_free(controller);
+}
+
+static gboolean controller_wants(fake_controller * controller, const char *event)
+{
+	guint i;
+
+	for (i = 0; controller->events && controller->events[i]; i++) {
+		if (strcmp(controller->events[i], event) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void fake_event(const char *type, const char *rest)
+{
+	gchar *line = g_strdup_printf("650 %s%s%s\r\n", type, rest ? " " : "", rest ? rest : "");
+	GSList *l;
+
+	for (l = tor.controllers; l; l = l->next) {
+		fake_controller *controller = l->data;
+
+		if (controller->authenticated && controller_wants(controller, type))
+			controller_send(controller, line);
+	}
+	g_free(line);
+}
+
+static gchar *bootstrap_phase(void)
+{
+	return g_strdup_printf("NOTICE BOOTSTRAP PROGRESS=%d TAG=%s SUMMARY=\"%s\"", tor.progress, tor.tag,
+			       tor.summary);
+}
+
+/* Config parsing, shared by the torrc, the command line and SETCONF */
+
+static gint parse_port(const char *value)
+{
+	const char *colon = strrchr(value, ':');
+
+	return atoi(colon ? colon + 1 : value);
+}
+
+static gboolean parse_bool(const char *value)
+{
+	return strcmp(value, "1") == 0;
+}
+
+static void config_set(const char *key, const char *value)
+{
+	if (g_ascii_strcasecmp(key, "ControlPort") == 0) {
+		tor.control_port = parse_port(value);
+	} else if (g_ascii_strcasecmp(key, "DataDirectory") == 0) {
+		g_free(tor.datadir);
+		tor.datadir = g_strdup(value);
+	} else if (g_ascii_strcasecmp(key, "CookieAuthentication") == 0) {
+		tor.cookie_auth = parse_bool(value);
+	} else if (g_ascii_strcasecmp(key, "CookieAuthFile") == 0) {
+		g_free(tor.cookie_file);
+		tor.cookie_file = g_strdup(value);
+	} else if (g_ascii_strcasecmp(key, "DisableNetwork") == 0) {
+		tor.disable_network = parse_bool(value);
+	}
+}
+
+static void config_parse(const char *torrc)
+{
+	gchar **lines = g_strsplit(torrc, "\n", -1);
+	guint i;
+
+	for (i = 0; lines[i] != NULL; i++) {
+		gchar *line = g_strstrip(lines[i]);
+		gchar *value;
+
+		if (line[0] == '#' || line[0] == '\0')
+			continue;
+
+		value = line + strcspn(line, " \t");
+		if (*value != '\0')
+			*value++ = '\0';
+		config_set(line, g_strstrip(value));
+	}
+	g_strfreev(lines);
+}
+
+/* SETCONF values may be QuotedStrings */
+static const char *parse_value(const char *p, GString * value)
+{
+	g_string_truncate(value, 0);
+
+	if (*p != '"') {
+		while (*p != '\0' && *p != ' ')
+			g_string_append_c(value, *p++);
+		return p;
+	}
+
+	for (p++; *p != '\0' && *p != '"'; p++) {
+		if (*p == '\\' && p[1] != '\0')
+			p++;
+		g_string_append_c(value, *p);
+	}
+
+	return *p == '"' ? p + 1 : p;
+}
+
+static gboolean setconf(const char *args)
+{
+	GPtrArray *bridges = g_ptr_array_new();
+	GString *key = g_string_new(NULL);
+	GString *value = g_string_new(NULL);
+	gboolean bridges_set = FALSE;
+	const char *p = args;
+
+	while (*p != '\0') {
+		while (*p == ' ')
+			p++;
+		if (*p == '\0')
+			break;
+
+		g_string_truncate(key, 0);
+		while (*p != '\0' && *p != '=' && *p != ' ')
+			g_string_append_c(key, *p++);
+
+		g_string_truncate(value, 0);
+		if (*p == '=')
+			p = parse_value(p + 1, value);
+
+		if (g_ascii_strcasecmp(key->str, "Bridge") == 0) {
+			bridges_set = TRUE;
+			g_ptr_array_add(bridges, g_strdup(value->str));
+		} else {
+			config_set(key->str, value->str);
+		}
+	}
+
+	if (bridges_set) {
+		g_ptr_array_add(bridges, NULL);
+		g_strfreev(tor.bridges);
+		tor.bridges = (gchar **) g_ptr_array_free(bridges, FALSE);
+	} else {
+		g_ptr_array_free(bridges, TRUE);
+	}
+	g_string_free(key, TRUE);
+	g_string_free(value, TRUE);
+
+	return TRUE;
+}
+
+/* Commands */
+
+static gboolean authenticate(fake_controller * controller, const char *args)
+{
+	guchar cookie[FAKE_TOR_COOKIE_LEN];
+	guint i;
+
+	if (!tor.cookie_auth)
+		return TRUE;
+
+	if (strlen(args) != FAKE_TOR_COOKIE_LEN * 2)
+		return FALSE;
+
+	for (i = 0; i < FAKE_TOR_COOKIE_LEN; i++) {
+		if (!g_ascii_isxdigit(args[2 * i]) || !g_ascii_isxdigit(args[2 * i + 1]))
+			return FALSE;
+		cookie[i] = g_ascii_xdigit_value(args[2 * i]) << 4 | g_ascii_xdigit_value(args[2 * i + 1]);
+	}
+
+	return memcmp(cookie, tor.cookie, FAKE_TOR_COOKIE_LEN) == 0;
+}
+
+static void getinfo(fake_controller * controller, const char *args)
+{
+	gchar **keys = g_strsplit(args, " ", -1);
+	GString *reply = g_string_new(NULL);
+	guint i;
+
+	for (i = 0; keys[i] != NULL; i++) {
+		if (keys[i][0] == '\0')
+			continue;
+
+		if (strcmp(keys[i], "status/bootstrap-phase") == 0) {
+			gchar *phase = bootstrap_phase();
+
+			g_string_append_printf(reply, "250-%s=%s\r\n", keys[i], phase);
+			g_free(phase);
+		} else if (strcmp(keys[i], "status/circuit-established") == 0) {
+			g_string_append_printf(reply, "250-%s=%d\r\n", keys[i], tor.circuit_established);
+		} else if (strcmp(keys[i], "version") == 0) {
+			g_string_append_printf(reply, "250-%s=%s\r\n", keys[i], FAKE_TOR_VERSION);
+		} else if (strcmp(keys[i], "network-liveness") == 0) {
+			g_string_append_printf(reply, "250-%s=%s\r\n", keys[i], tor.disable_network ? "down" : "up");
+		} else {
+			g_string_printf(reply, "552 Unrecognized key \"%s\"\r\n", keys[i]);
+			controller_send(controller, reply->str);
+			goto out;
+		}
+	}
+	g_string_append(reply, "250 OK\r\n");
+	controller_send(controller, reply->str);
+
+ out:
+	g_string_free(reply, TRUE);
+	g_strfreev(keys);
+}
+
+static void add_onion(fake_controller * controller, const char *args)
+{
+	gchar *id;
+	GString *reply;
+
+	if (args[0] == '\0' || strchr(args, ':') == NULL) {
+		controller_send(controller, "512 Missing argument to ADD_ONION\r\n");
+		return;
+	}
+
+	/* Onion v3 addresses are 56 base32 characters */
+	id = g_strdup_printf("%056u", ++tor.onion_count);
+	g_strdelimit(id, "0", 'a');
+	g_hash_table_add(tor.onions, id);
+
+	reply = g_string_new(NULL);
+	g_string_append_printf(reply, "250-ServiceID=%s\r\n", id);
+	if (g_str_has_prefix(args, "NEW:") && strstr(args, "DiscardPK") == NULL)
+		g_string_append_printf(reply, "250-PrivateKey=ED25519-V3:%s\r\n", "fakekey");
+	g_string_append(reply, "250 OK\r\n");
+	controller_send(controller, reply->str);
+	g_string_free(reply, TRUE);
+}
+
+static void del_onion(fake_controller * controller, const char *args)
+{
+	if (g_hash_table_remove(tor.onions, args))
+		controller_send(controller, "250 OK\r\n");
+	else
+		controller_send(controller, "552 Unknown Onion Service id\r\n");
+}
+
+static void fake_signal(fake_controller * controller, const char *args)
+{
+	static const char *signals[] = {
+		"RELOAD", "HUP", "SHUTDOWN", "INT", "DUMP", "USR1", "DEBUG", "USR2", "HALT", "TERM",
+		"NEWNYM", "CLEARDNSCACHE", "HEARTBEAT", "ACTIVE", "DORMANT", NULL,
+	};
+	guint i;
+
+	for (i = 0; signals[i] != NULL; i++) {
+		if (strcmp(args, signals[i]) == 0)
+			break;
+	}
+
+	if (signals[i] == NULL) {
+		controller_send(controller, "552 Unrecognized signal code\r\n");
+		return;
+	}
+
+	controller_send(controller, "250 OK\r\n");
+	if (strcmp(args, "SHUTDOWN") == 0 || strcmp(args, "HALT") == 0 || strcmp(args, "INT") == 0
+	    || strcmp(args, "TERM") == 0)
+		exit(0);
+}
+
+/* Returns FALSE when the controller was closed */
+static gboolean command(fake_controller * controller, const char *line)
+{
+	gchar *keyword = g_strndup(line, strcspn(line, " "));
+	const char *args = line + strlen(keyword);
+
+	while (*args == ' ')
+		args++;
+
+	if (g_ascii_strcasecmp(keyword, "AUTHENTICATE") == 0)
+		fake_log("AUTHENTICATE");
+	else
+		fake_log(line);
+	g_ptr_array_add(tor.commands, g_strdup(line));
+
+	if (g_ascii_strcasecmp(keyword, "AUTHENTICATE") == 0) {
+		if (!authenticate(controller, args)) {
+			controller_send(controller, "515 Authentication failed: Wrong length on authentication cookie.\r\n");
+			controller_free(controller);
+			g_free(keyword);
+			return FALSE;
+		}
+		controller->authenticated = TRUE;
+		controller_send(controller, "250 OK\r\n");
+	} else if (g_ascii_strcasecmp(keyword, "PROTOCOLINFO") == 0) {
+		gchar *reply = g_strdup_printf("250-PROTOCOLINFO 1\r\n"
+					       "250-AUTH METHODS=%s%s%s%s\r\n"
+					       "250-VERSION Tor=\"%s\"\r\n"
+					       "250 OK\r\n",
+					       tor.cookie_auth ? "COOKIE,SAFECOOKIE" : "NULL",
+					       tor.cookie_auth ? " COOKIEFILE=\"" : "",
+					       tor.cookie_auth ? tor.cookie_file : "",
+					       tor.cookie_auth ? "\"" : "", FAKE_TOR_VERSION);
+
+		controller_send(controller, reply);
+		g_free(reply);
+	} else if (g_ascii_strcasecmp(keyword, "QUIT") == 0) {
+		controller_send(controller, "250 closing connection\r\n");
+		controller_free(controller);
+		g_free(keyword);
+		return FALSE;
+	} else if (!controller->authenticated) {
+		controller_send(controller, "514 Authentication required.\r\n");
+		controller_free(controller);
+		g_free(keyword);
+		return FALSE;
+	} else if (g_ascii_strcasecmp(keyword, "GETINFO") == 0) {
+		getinfo(controller, args);
+	} else if (g_ascii_strcasecmp(keyword, "SETEVENTS") == 0) {
+		g_strfreev(controller->events);
+		controller->events = g_strsplit(args, " ", -1);
+		controller_send(controller, "250 OK\r\n");
+	} else if (g_ascii_strcasecmp(keyword, "SETCONF") == 0 || g_ascii_strcasecmp(keyword, "RESETCONF") == 0) {
+		setconf(args);
+		controller_send(controller, "250 OK\r\n");
+	} else if (g_ascii_strcasecmp(keyword, "+LOADCONF") == 0) {
+		controller->loadconf = g_string_new(NULL);
+	} else if (g_ascii_strcasecmp(keyword, "SIGNAL") == 0) {
+		fake_signal(controller, args);
+	} else if (g_ascii_strcasecmp(keyword, "ADD_ONION") == 0) {
+		add_onion(controller, args);
+	} else if (g_ascii_strcasecmp(keyword, "DEL_ONION") == 0) {
+		del_onion(controller, args);
+	} else {
+		gchar *reply = g_strdup_printf("510 Unrecognized command \"%s\"\r\n", keyword);
+
+		controller_send(controller, reply);
+		g_free(reply);
+	}
+	g_free(keyword);
+
+	return TRUE;
+}
+
+/* A line of a +LOADCONF, the reply comes with the closing "." */
+static void loadconf_line(fake_controller * controller, const char *line)
+{
+	if (strcmp(line, ".") != 0) {
+		/* Dot-stuffed */
+		g_string_append(controller->loadconf, line[0] == '.' ? line + 1 : line);
+		g_string_append_c(controller->loadconf, '\n');
+		return;
+	}
+
+	config_parse(controller->loadconf->str);
+	g_string_free(controller->loadconf, TRUE);
+	controller->loadconf = NULL;
+	controller_send(controller, "250 OK\r\n");
+}
+
+static gboolean controller_in(GIOChannel * source, GIOCondition condition, gpointer user_data)
+{
+	fake_controller *controller = user_data;
+	char buf[4096];
+	ssize_t len;
+	char *eol;
+
+	len = recv(controller->fd, buf, sizeof(buf), 0);
+	if (len < 0 && (errno == EINTR || errno == EAGAIN))
+		return G_SOURCE_CONTINUE;
+	if (len <= 0) {
+		controller->in_id = 0;
+		controller_free(controller);
+		return G_SOURCE_REMOVE;
+	}
+
+	g_string_append_len(controller->inbuf, buf, len);
+	while (!tor.hung && (eol = strstr(controller->inbuf->str, "\r\n")) != NULL) {
+		gchar *line = g_strndup(controller->inbuf->str, eol - controller->inbuf->str);
+
+		g_string_erase(controller->inbuf, 0, eol - controller->inbuf->str + 2);
+
+		if (controller->loadconf != NULL) {
+			loadconf_line(controller, line);
+		} else if (!command(controller, line)) {
+			/* controller is gone, and with it its source */
+			g_free(line);
+			script_run();
+			return G_SOURCE_REMOVE;
+		}
+		g_free(line);
+	}
+
+	/* Commands may be what the script waits for */
+	script_run();
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean control_accept(GIOChannel * source, GIOCondition condition, gpointer user_data)
+{
+	fake_controller *controller;
+	int fd = accept(tor.listen_fd, NULL, NULL);
+
+	if (fd < 0)
+		return G_SOURCE_CONTINUE;
+
+	controller = g_new0(fake_controller, 1);
+	controller->fd = fd;
+	controller->channel = g_io_channel_unix_new(fd);
+	controller->inbuf = g_string_new(NULL);
+	controller->in_id = g_io_add_watch(controller->channel, G_IO_IN | G_IO_HUP | G_IO_ERR, controller_in,
+					   controller);
+	tor.controllers = g_slist_append(tor.controllers, controller);
+
+	return G_SOURCE_CONTINUE;
+}
+
+/* The script */
+
+static gboolean script_wait_done(const char *what)
+{
+	GSList *l;
+	guint i;
+
+	if (strcmp(what, "network") == 0)
+		return !tor.disable_network;
+
+	if (strcmp(what, "authenticated") == 0 || strcmp(what, "events") == 0) {
+		for (l = tor.controllers; l; l = l->next) {
+			fake_controller *controller = l->data;
+
+			if (what[0] == 'a' && controller->authenticated)
+				return TRUE;
+			if (what[0] == 'e' && controller_wants(controller, "STATUS_CLIENT"))
+				return TRUE;
+		}
+		return FALSE;
+	}
+
+	if (g_str_has_prefix(what, "command ")) {
+		const char *prefix = what + strlen("command ");
+
+		for (i = tor.commands_matched; i < tor.commands->len; i++) {
+			if (g_str_has_prefix(g_ptr_array_index(tor.commands, i), prefix)) {
+				tor.commands_matched = i + 1;
+				return TRUE;
+			}
+		}
+		return FALSE;
+	}
+
+	g_printerr("fake-tor: cannot wait for %s\n", what);
+	exit(2);
+}
+
+static gboolean script_sleep_cb(gpointer user_data)
+{
+	tor.sleep_id = 0;
+	tor.pc++;
+	script_run();
+
+	return G_SOURCE_REMOVE;
+}
+
+static void script_drop(void)
+{
+	while (tor.controllers)
+		controller_free(tor.controllers->data);
+}
+
+static void script_hang(void)
+{
+	GSList *l;
+
+	/* Connections stay open, nothing is read from them anymore */
+	tor.hung = TRUE;
+	for (l = tor.controllers; l; l = l->next) {
+		fake_controller *controller = l->data;
+
+		if (controller->in_id) {
+			g_source_remove(controller->in_id);
+			controller->in_id = 0;
+		}
+	}
+	if (tor.listen_id) {
+		g_source_remove(tor.listen_id);
+		tor.listen_id = 0;
+	}
+}
+
+/* Runs the script from where it is until it has to wait */
+static void script_run(void)
+{
+	while (!tor.hung && tor.sleep_id == 0 && tor.script[tor.pc] != NULL) {
+		gchar *line = g_strstrip(tor.script[tor.pc]);
+		gchar **args;
+
+		if (line[0] == '#' || line[0] == '\0') {
+			tor.pc++;
+			continue;
+		}
+
+		args = g_strsplit(line, " ", 4);
+
+		if (strcmp(args[0], "wait") == 0 && args[1] != NULL) {
+			if (!script_wait_done(line + strlen("wait "))) {
+				g_strfreev(args);
+				return;
+			}
+		} else if (strcmp(args[0], "sleep") == 0 && args[1] != NULL) {
+			tor.sleep_id = g_timeout_add(atoi(args[1]), script_sleep_cb, NULL);
+			g_strfreev(args);
+			return;
+		} else if (strcmp(args[0], "bootstrap") == 0 && args[1] != NULL && args[2] != NULL) {
+			gchar *phase;
+
+			tor.progress = atoi(args[1]);
+			g_free(tor.tag);
+			tor.tag = g_strdup(args[2]);
+			g_free(tor.summary);
+			tor.summary = g_strdup(args[3] ? args[3] : "");
+
+			phase = bootstrap_phase();
+			fake_event("STATUS_CLIENT", phase);
+			g_free(phase);
+		} else if (strcmp(args[0], "circuit-established") == 0) {
+			tor.circuit_established = TRUE;
+			fake_event("STATUS_CLIENT", "NOTICE CIRCUIT_ESTABLISHED");
+		} else if (strcmp(args[0], "event") == 0 && args[1] != NULL) {
+			const char *rest = line + strlen("event ") + strlen(args[1]);
+
+			while (*rest == ' ')
+				rest++;
+			fake_event(args[1], *rest ? rest : NULL);
+		} else if (strcmp(args[0], "drop") == 0) {
+			script_drop();
+		} else if (strcmp(args[0], "hang") == 0) {
+			script_hang();
+		} else if (strcmp(args[0], "crash") == 0) {
+			abort();
+		} else if (strcmp(args[0], "exit") == 0) {
+			exit(args[1] ? atoi(args[1]) : 0);
+		} else {
+			g_printerr("fake-tor: bad script line: %s\n", line);
+			exit(2);
+		}
+
+		g_strfreev(args);
+		tor.pc++;
+	}
+}
+
+/* Startup */
+
+static void write_cookie(void)
+{
+	int fd, i;
+
+	for (i = 0; i < FAKE_TOR_COOKIE_LEN; i++)
+		tor.cookie[i] = g_random_int_range(0, 256);
+
+	/* Like Tor, the file is replaced on every start */
+	unlink(tor.cookie_file);
+	fd = open(tor.cookie_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 || write(fd, tor.cookie, FAKE_TOR_COOKIE_LEN) != FAKE_TOR_COOKIE_LEN) {
+		g_printerr("fake-tor: could not write %s: %s\n", tor.cookie_file, strerror(errno));
+		exit(1);
+	}
+	close(fd);
+}
+
+static void control_listen(void)
+{
+	struct sockaddr_in addr;
+	int on = 1;
+
+	tor.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	setsockopt(tor.listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(tor.control_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(tor.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(tor.listen_fd, 8) != 0) {
+		g_printerr("fake-tor: could not listen on %d: %s\n", tor.control_port, strerror(errno));
+		exit(1);
+	}
+
+	tor.listen_channel = g_io_channel_unix_new(tor.listen_fd);
+	tor.listen_id = g_io_add_watch(tor.listen_channel, G_IO_IN, control_accept, NULL);
+}
+
+static void load_script(void)
+{
+	gchar *path = g_build_filename(tor.datadir, "fake_tor_script", NULL);
+	gchar *script = NULL;
+
+	if (!g_file_get_contents(path, &script, NULL, NULL))
+		script = g_strdup(FAKE_TOR_SCRIPT);
+	tor.script = g_strsplit(script, "\n", -1);
+
+	g_free(script);
+	g_free(path);
+}
+
+int main(int argc, char *argv[])
+{
+	struct rlimit no_core = { 0, 0 };
+	gchar *torrc = NULL, *path;
+	int i;
+
+	tor.cookie_auth = FALSE;
+	tor.tag = g_strdup("starting");
+	tor.summary = g_strdup("Starting");
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			if (!g_file_get_contents(argv[++i], &torrc, NULL, NULL)) {
+				g_printerr("fake-tor: cannot read %s\n", argv[i]);
+				return 1;
+			}
+			config_parse(torrc);
+			g_free(torrc);
+		} else if (g_str_has_prefix(argv[i], "--") && i + 1 < argc) {
+			config_set(argv[i] + 2, argv[i + 1]);
+			i++;
+		}
+	}
+
+	if (tor.control_port == 0 || tor.datadir == NULL) {
+		g_printerr("fake-tor: needs a ControlPort and a DataDirectory\n");
+		return 1;
+	}
+	if (tor.cookie_file == NULL)
+		tor.cookie_file = g_build_filename(tor.datadir, "control_auth_cookie", NULL);
+
+	/* crash is expected, its core is not */
+	setrlimit(RLIMIT_CORE, &no_core);
+
+	g_mkdir_with_parents(tor.datadir, 0700);
+
+	path = g_build_filename(tor.datadir, "fake_tor.pid", NULL);
+	torrc = g_strdup_printf("%d\n", getpid());
+	g_file_set_contents(path, torrc, -1, NULL);
+	g_free(torrc);
+	g_free(path);
+
+	path = g_build_filename(tor.datadir, "fake_tor.log", NULL);
+	tor.log = fopen(path, "a");
+	g_free(path);
+
+	tor.onions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	tor.commands = g_ptr_array_new_with_free_func(g_free);
+	load_script();
+
+	if (tor.cookie_auth)
+		write_cookie();
+	control_listen();
+
+	tor.loop = g_main_loop_new(NULL, FALSE);
+	script_run();
+	g_main_loop_run(tor.loop);
+
+	return 0;
+}
@@ -0,0 +1,776 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <errno.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib-lowlevel.h>
+
+#include <support/icd_dbus.h>
+#include <support/icd_log.h>
+
+#include "libicd_tor.h"
+#include "libicd_network_tor.h"
+#include "harness.h"
+
+#define HARNESS_NETWORK_ATTRS 0
+/* Longest wait for a reply to a method call */
+#define HARNESS_CALL_TIMEOUT_MS 120000
+
+harness_setup harness;
+
+typedef struct {
+	gchar *interface;
+	DBusHandleMessageFunction handler;
+	void *user_data;
+} harness_bcast;
+
+static struct {
+	struct icd_nw_api api;
+	gboolean module_loaded;
+
+	/* Set when the session bus is used */
+	DBusConnection *bus;
+	gchar *service_path;
+	DBusObjectPathMessageFunction service_handler;
+	void *service_user_data;
+	GSList *bcasts;
+
+	/* Replies to in-process calls, by their serial */
+	GHashTable *replies;
+	dbus_uint32_t serial;
+	GPtrArray *signals;
+
+	/* Handed to watch_fn and still running */
+	GHashTable *running;
+	/* pid -> exit status */
+	GHashTable *exited;
+	pid_t last_pid;
+	guint spawn_count;
+	GPtrArray *closed;
+
+	gchar *tor_binary;
+	enum icd_loglevel log_level;
+} h;
+
+/* Read by the module instead of the configure time paths, see libicd_tor.h */
+char *tor_tests_env(const char *name, const char *fallback)
+{
+	const char *value = g_getenv(name);
+
+	return (char *)(value != NULL && value[0] != '\0' ? value : fallback);
+}
+
+/* ICd's logging, the module's TN_* end up here through ILOG_* */
+enum icd_loglevel icd_log_get_level(void)
+{
+	return h.log_level;
+}
+
+enum icd_loglevel icd_log_set_level(enum icd_loglevel new_level)
+{
+	enum icd_loglevel old = h.log_level;
+
+	h.log_level = new_level;
+
+	return old;
+}
+
+static void harness_record_signal(DBusMessage * message)
+{
+	g_ptr_array_add(h.signals, dbus_message_ref(message));
+}
+
+static DBusHandlerResult harness_bus_filter(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	GSList *l;
+
+	if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	for (l = h.bcasts; l; l = l->next) {
+		harness_bcast *bcast = l->data;
+
+		if (dbus_message_has_interface(message, bcast->interface))
+			bcast->handler(connection, message, bcast->user_data);
+	}
+
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* ICd's D-Bus helpers, on the session bus instead of the system bus */
+
+gboolean icd_dbus_register_system_service(const gchar * path, const gchar * service, guint service_flags,
+					  DBusObjectPathMessageFunction cb, void *user_data)
+{
+	g_free(h.service_path);
+	h.service_path = g_strdup(path);
+	h.service_handler = cb;
+	h.service_user_data = user_data;
+
+	if (h.bus != NULL) {
+		DBusObjectPathVTable vtable = { NULL, };
+		DBusError error;
+
+		vtable.message_function = cb;
+		if (!dbus_connection_register_object_path(h.bus, path, &vtable, user_data))
+			return FALSE;
+
+		dbus_error_init(&error);
+		if (dbus_bus_request_name(h.bus, service, service_flags, &error) !=
+		    DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+			g_warning("Could not own %s: %s", service, error.message ? error.message : "in use");
+			dbus_error_free(&error);
+			dbus_connection_unregister_object_path(h.bus, path);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+void icd_dbus_unregister_system_service(const gchar * path, const gchar * service)
+{
+	if (h.bus != NULL) {
+		dbus_connection_unregister_object_path(h.bus, path);
+		dbus_bus_release_name(h.bus, service, NULL);
+	}
+
+	g_free(h.service_path);
+	h.service_path = NULL;
+	h.service_handler = NULL;
+	h.service_user_data = NULL;
+}
+
+gboolean icd_dbus_send_system_msg(DBusMessage * message)
+{
+	int type = dbus_message_get_type(message);
+
+	if (type == DBUS_MESSAGE_TYPE_SIGNAL)
+		harness_record_signal(message);
+
+	if (h.bus != NULL)
+		return dbus_connection_send(h.bus, message, NULL);
+
+	if (type == DBUS_MESSAGE_TYPE_METHOD_RETURN || type == DBUS_MESSAGE_TYPE_ERROR)
+		g_hash_table_replace(h.replies, GUINT_TO_POINTER(dbus_message_get_reply_serial(message)),
+				     dbus_message_ref(message));
+
+	return TRUE;
+}
+
+gboolean icd_dbus_connect_system_bcast_signal(const char *interface, DBusHandleMessageFunction signal_cb,
+					      void *user_data, const char *extra_filters)
+{
+	harness_bcast *bcast = g_new0(harness_bcast, 1);
+
+	bcast->interface = g_strdup(interface);
+	bcast->handler = signal_cb;
+	bcast->user_data = user_data;
+	h.bcasts = g_slist_append(h.bcasts, bcast);
+
+	if (h.bus != NULL) {
+		gchar *rule = g_strdup_printf("type='signal',interface='%s'%s%s", interface,
+					      extra_filters ? "," : "", extra_filters ? extra_filters : "");
+
+		dbus_bus_add_match(h.bus, rule, NULL);
+		g_free(rule);
+	}
+
+	return TRUE;
+}
+
+gboolean icd_dbus_disconnect_system_bcast_signal(const char *interface, DBusHandleMessageFunction signal_cb,
+						 void *user_data, const char *extra_filters)
+{
+	GSList *l;
+
+	for (l = h.bcasts; l; l = l->next) {
+		harness_bcast *bcast = l->data;
+
+		if (bcast->handler != signal_cb || bcast->user_data != user_data
+		    || strcmp(bcast->interface, interface) != 0)
+			continue;
+
+		h.bcasts = g_slist_delete_link(h.bcasts, l);
+		g_free(bcast->interface);
+		g_free(bcast);
+		break;
+	}
+
+	if (h.bus != NULL) {
+		gchar *rule = g_strdup_printf("type='signal',interface='%s'%s%s", interface,
+					      extra_filters ? "," : "", extra_filters ? extra_filters : "");
+
+		dbus_bus_remove_match(h.bus, rule, NULL);
+		g_free(rule);
+	}
+
+	return TRUE;
+}
+
+/* What ICd hands the module */
+
+static void harness_child_watch(GPid pid, gint status, gpointer user_data)
+{
+	g_hash_table_remove(h.running, GINT_TO_POINTER(pid));
+	g_hash_table_replace(h.exited, GINT_TO_POINTER(pid), GINT_TO_POINTER(status));
+	g_spawn_close_pid(pid);
+
+	if (h.module_loaded)
+		h.api.child_exit(pid, status, &h.api.private);
+}
+
+static void harness_watch_pid(const pid_t pid, const gpointer watch_cb_token)
+{
+	h.last_pid = pid;
+	h.spawn_count++;
+	/* The pid of something that exited before may be reused */
+	g_hash_table_remove(h.exited, GINT_TO_POINTER(pid));
+	g_hash_table_add(h.running, GINT_TO_POINTER(pid));
+	g_child_watch_add(pid, harness_child_watch, NULL);
+}
+
+static void harness_close(enum icd_nw_status status, const gchar * err_str, const gchar * network_type,
+			  const guint network_attrs, const gchar * network_id)
+{
+	g_ptr_array_add(h.closed, g_strdup(network_id));
+}
+
+static void harness_ip_up_cb(const enum icd_nw_status status, const gchar * err_str, const gpointer ip_up_cb_token,
+			     ...)
+{
+	harness_result *result = ip_up_cb_token;
+
+	result->status = status;
+	result->err_str = g_strdup(err_str);
+	result->elapsed_us = g_get_monotonic_time() - result->started_us;
+	result->done = TRUE;
+}
+
+static void harness_ip_down_cb(const enum icd_nw_status status, const gpointer ip_down_cb_token)
+{
+	harness_result *result = ip_down_cb_token;
+
+	result->status = status;
+	result->elapsed_us = g_get_monotonic_time() - result->started_us;
+	result->done = TRUE;
+}
+
+static gint harness_free_port(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	gint port = 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0
+	    && getsockname(fd, (struct sockaddr *)&addr, &len) == 0)
+		port = ntohs(addr.sin_port);
+
+	if (fd >= 0)
+		close(fd);
+	g_assert(port != 0);
+
+	return port;
+}
+
+/* Tor must not run as root, so the tests run it as nobody then. It may not
+ * get at the build tree in /root, a copy of the binary goes with the data. */
+static void harness_init_user(void)
+{
+	/* Before it is pointed at the copy of an earlier run */
+	static gchar *binary = NULL;
+	struct passwd *pw;
+	gchar *contents = NULL;
+	gsize len = 0;
+	int ret;
+
+	if (getuid() != 0) {
+		g_setenv("ICD_TOR_TEST_USER", g_get_user_name(), FALSE);
+		return;
+	}
+
+	g_setenv("ICD_TOR_TEST_USER", "nobody", FALSE);
+	pw = getpwnam(g_getenv("ICD_TOR_TEST_USER"));
+	g_assert(pw != NULL);
+	ret = chown(harness.datadir, pw->pw_uid, pw->pw_gid);
+	g_assert_cmpint(ret, ==, 0);
+
+	if (binary == NULL)
+		binary = g_strdup(TOR_BINARY);
+
+	if (g_file_get_contents(binary, &contents, &len, NULL)) {
+		gchar *name = g_path_get_basename(binary);
+
+		h.tor_binary = g_build_filename(harness.dir, name, NULL);
+		g_free(name);
+		if (!g_file_set_contents(h.tor_binary, contents, len, NULL) || chmod(h.tor_binary, 0755) != 0)
+			g_error("Could not copy %s to %s", binary, h.tor_binary);
+		g_setenv("ICD_TOR_TEST_BINARY", h.tor_binary, TRUE);
+		g_free(contents);
+	}
+}
+
+static void harness_init_gconf(void)
+{
+	mock_gconf_clear();
+
+	mock_gconf_set_bool(GC_TOR_SYSTEM, TRUE);
+	mock_gconf_set_string(GC_TOR_ACTIVE, HARNESS_CONFIG);
+
+	mock_gconf_set_int(HARNESS_CONFIG_KEY(GC_SOCKSPORT), harness.socks_port);
+	mock_gconf_set_int(HARNESS_CONFIG_KEY(GC_CONTROLPORT), harness.control_port);
+	mock_gconf_set_int(HARNESS_CONFIG_KEY(GC_TRANSPORT), harness.trans_port);
+	mock_gconf_set_int(HARNESS_CONFIG_KEY(GC_DNSPORT), harness.dns_port);
+	mock_gconf_set_string(HARNESS_CONFIG_KEY(GC_DATADIR), harness.datadir);
+	/* nftables needs root and would take over the machine's traffic */
+	mock_gconf_set_bool(HARNESS_CONFIG_KEY(GC_TPENABLED), FALSE);
+}
+
+void harness_init(void)
+{
+	GError *error = NULL;
+	gchar *torrc;
+	int ret;
+
+	memset(&h, 0, sizeof(h));
+	h.log_level = g_getenv("ICD_TOR_TEST_DEBUG") ? ICD_DEBUG : ICD_CRIT;
+
+	harness.dir = g_dir_make_tmp("icd-tor-XXXXXX", &error);
+	g_assert_no_error(error);
+	/* Tor may run as someone else */
+	ret = chmod(harness.dir, 0755);
+	g_assert_cmpint(ret, ==, 0);
+	harness.datadir = g_build_filename(harness.dir, "data", NULL);
+	ret = g_mkdir(harness.datadir, 0700);
+	g_assert_cmpint(ret, ==, 0);
+
+	harness.socks_port = harness_free_port();
+	do {
+		harness.control_port = harness_free_port();
+	} while (harness.control_port == harness.socks_port);
+	do {
+		harness.trans_port = harness_free_port();
+	} while (harness.trans_port == harness.socks_port || harness.trans_port == harness.control_port);
+	do {
+		harness.dns_port = harness_free_port();
+	} while (harness.dns_port == harness.socks_port || harness.dns_port == harness.control_port
+		 || harness.dns_port == harness.trans_port);
+
+	torrc = g_build_filename(harness.dir, "torrc-network-%s", NULL);
+	g_setenv("ICD_TOR_TEST_TORRC", torrc, TRUE);
+	g_free(torrc);
+#ifdef TESTS_FAKE_TOR
+	g_setenv("ICD_TOR_TEST_BINARY", TESTS_FAKE_TOR, FALSE);
+#endif
+	harness_init_user();
+
+	h.replies = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) dbus_message_unref);
+	h.signals = g_ptr_array_new_with_free_func((GDestroyNotify) dbus_message_unref);
+	h.running = g_hash_table_new(g_direct_hash, g_direct_equal);
+	h.exited = g_hash_table_new(g_direct_hash, g_direct_equal);
+	h.closed = g_ptr_array_new_with_free_func(g_free);
+
+	if (g_getenv("DBUS_SESSION_BUS_ADDRESS") != NULL) {
+		DBusError dbus_error;
+
+		dbus_error_init(&dbus_error);
+		h.bus = dbus_bus_get_private(DBUS_BUS_SESSION, &dbus_error);
+		if (h.bus == NULL) {
+			g_message("No session bus, calls stay in-process: %s", dbus_error.message);
+			dbus_error_free(&dbus_error);
+		} else {
+			dbus_connection_set_exit_on_disconnect(h.bus, FALSE);
+			dbus_connection_setup_with_g_main(h.bus, NULL);
+			dbus_connection_add_filter(h.bus, harness_bus_filter, NULL, NULL);
+		}
+	}
+
+	harness_init_gconf();
+}
+
+static gboolean harness_rm_rf(const char *path)
+{
+	GDir *dir = g_dir_open(path, 0, NULL);
+	const gchar *name;
+
+	if (dir == NULL)
+		return unlink(path) == 0;
+
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		gchar *child = g_build_filename(path, name, NULL);
+
+		harness_rm_rf(child);
+		g_free(child);
+	}
+	g_dir_close(dir);
+
+	return rmdir(path) == 0;
+}
+
+void harness_cleanup(void)
+{
+	if (h.module_loaded)
+		harness_stop_module();
+
+	if (h.bus != NULL) {
+		dbus_connection_remove_filter(h.bus, harness_bus_filter, NULL);
+		dbus_connection_close(h.bus);
+		dbus_connection_unref(h.bus);
+	}
+
+	g_hash_table_destroy(h.replies);
+	g_ptr_array_free(h.signals, TRUE);
+	g_hash_table_destroy(h.running);
+	g_hash_table_destroy(h.exited);
+	g_ptr_array_free(h.closed, TRUE);
+	g_free(h.tor_binary);
+	g_free(h.service_path);
+
+	if (g_getenv("ICD_TOR_TEST_KEEP") == NULL)
+		harness_rm_rf(harness.dir);
+	g_free(harness.dir);
+	g_free(harness.datadir);
+	memset(&harness, 0, sizeof(harness));
+}
+
+void harness_start_module(void)
+{
+	g_assert(!h.module_loaded);
+
+	memset(&h.api, 0, sizeof(h.api));
+	h.module_loaded = icd_nw_init(&h.api, harness_watch_pid, NULL, harness_close, NULL, NULL);
+	g_assert(h.module_loaded);
+}
+
+void harness_stop_module(void)
+{
+	GHashTableIter iter;
+	gpointer pid;
+
+	g_assert(h.module_loaded);
+
+	h.api.network_destruct(&h.api.private);
+	h.module_loaded = FALSE;
+
+	/* Whatever the module left running */
+	g_hash_table_iter_init(&iter, h.running);
+	while (g_hash_table_iter_next(&iter, &pid, NULL))
+		kill(GPOINTER_TO_INT(pid), SIGKILL);
+	while (g_hash_table_size(h.running) > 0)
+		g_main_context_iteration(NULL, TRUE);
+}
+
+void harness_set_script(const char *script)
+{
+	gchar *path = g_build_filename(harness.datadir, "fake_tor_script", NULL);
+
+	if (script != NULL) {
+		if (!g_file_set_contents(path, script, -1, NULL))
+			g_error("Could not write %s", path);
+	} else {
+		unlink(path);
+	}
+
+	g_free(path);
+}
+
+void harness_ip_up(const char *network_id, harness_result * result)
+{
+	memset(result, 0, sizeof(*result));
+	result->started_us = g_get_monotonic_time();
+
+	h.api.ip_up(TOR_NETWORK_TYPE, HARNESS_NETWORK_ATTRS, network_id, NULL, harness_ip_up_cb, result,
+		    &h.api.private);
+}
+
+void harness_ip_down(const char *network_id, harness_result * result)
+{
+	memset(result, 0, sizeof(*result));
+	result->started_us = g_get_monotonic_time();
+
+	h.api.ip_down(TOR_NETWORK_TYPE, HARNESS_NETWORK_ATTRS, network_id, NULL, harness_ip_down_cb, result,
+		      &h.api.private);
+}
+
+void harness_result_clear(harness_result * result)
+{
+	g_free(result->err_str);
+	memset(result, 0, sizeof(*result));
+}
+
+static gboolean harness_timeout_cb(gpointer user_data)
+{
+	*(gboolean *) user_data = TRUE;
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Iterates the main loop until check(data) or timeout_ms */
+static gboolean harness_run_until(gboolean(*check) (gconstpointer data), gconstpointer data, guint timeout_ms)
+{
+	gboolean timed_out = FALSE;
+	guint timeout_id;
+
+	if (check(data))
+		return TRUE;
+
+	timeout_id = g_timeout_add(timeout_ms, harness_timeout_cb, &timed_out);
+	while (!check(data) && !timed_out)
+		g_main_context_iteration(NULL, TRUE);
+
+	if (!timed_out)
+		g_source_remove(timeout_id);
+
+	return check(data);
+}
+
+static gboolean harness_check_done(gconstpointer data)
+{
+	return *(const gboolean *)data;
+}
+
+gboolean harness_wait(const gboolean * done, guint timeout_ms)
+{
+	return harness_run_until(harness_check_done, done, timeout_ms);
+}
+
+static gboolean harness_check_closed(gconstpointer data)
+{
+	guint i;
+
+	for (i = 0; i < h.closed->len; i++) {
+		if (strcmp(g_ptr_array_index(h.closed, i), data) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+gboolean harness_wait_closed(const char *network_id, guint timeout_ms)
+{
+	return harness_run_until(harness_check_closed, network_id, timeout_ms);
+}
+
+static gboolean harness_check_pid_exit(gconstpointer data)
+{
+	return g_hash_table_contains(h.exited, data);
+}
+
+gboolean harness_wait_pid_exit(pid_t pid, guint timeout_ms)
+{
+	return harness_run_until(harness_check_pid_exit, GINT_TO_POINTER(pid), timeout_ms);
+}
+
+static gboolean harness_check_tor_log(gconstpointer data)
+{
+	return harness_tor_log_contains(data);
+}
+
+gboolean harness_wait_tor_log(const char *prefix, guint timeout_ms)
+{
+	return harness_run_until(harness_check_tor_log, prefix, timeout_ms);
+}
+
+pid_t harness_tor_pid(void)
+{
+	return g_hash_table_contains(h.running, GINT_TO_POINTER(h.last_pid)) ? h.last_pid : 0;
+}
+
+guint harness_spawn_count(void)
+{
+	return h.spawn_count;
+}
+
+static gboolean harness_check_reply(gconstpointer data)
+{
+	return g_hash_table_contains(h.replies, data);
+}
+
+struct _harness_pending {
+	DBusPendingCall *pending;
+	guint serial;
+};
+
+static harness_pending *harness_call_startv(const char *method, int first_arg_type, va_list ap)
+{
+	harness_pending *pending = g_new0(harness_pending, 1);
+	DBusMessage *call;
+	dbus_bool_t appended;
+
+	call = dbus_message_new_method_call(ICD_TOR_DBUS_INTERFACE, ICD_TOR_DBUS_PATH, ICD_TOR_DBUS_INTERFACE,
+					    method);
+	g_assert(call != NULL);
+
+	appended = dbus_message_append_args_valist(call, first_arg_type, ap);
+	g_assert(appended);
+
+	if (h.bus != NULL) {
+		if (!dbus_connection_send_with_reply(h.bus, call, &pending->pending, HARNESS_CALL_TIMEOUT_MS)
+		    || pending->pending == NULL)
+			g_error("Could not call %s", method);
+	} else {
+		g_assert(h.service_handler != NULL);
+		pending->serial = ++h.serial;
+		dbus_message_set_serial(call, pending->serial);
+
+		h.service_handler(NULL, call, h.service_user_data);
+	}
+	dbus_message_unref(call);
+
+	return pending;
+}
+
+harness_pending *harness_call_start(const char *method, int first_arg_type, ...)
+{
+	harness_pending *pending;
+	va_list ap;
+
+	va_start(ap, first_arg_type);
+	pending = harness_call_startv(method, first_arg_type, ap);
+	va_end(ap);
+
+	return pending;
+}
+
+DBusMessage *harness_call_finish(harness_pending * pending)
+{
+	DBusMessage *reply = NULL;
+
+	if (pending->pending != NULL) {
+		while (!dbus_pending_call_get_completed(pending->pending))
+			g_main_context_iteration(NULL, TRUE);
+		reply = dbus_pending_call_steal_reply(pending->pending);
+		dbus_pending_call_unref(pending->pending);
+	} else {
+		gpointer serial = GUINT_TO_POINTER(pending->serial);
+
+		if (harness_run_until(harness_check_reply, serial, HARNESS_CALL_TIMEOUT_MS)) {
+			reply = dbus_message_ref(g_hash_table_lookup(h.replies, serial));
+			g_hash_table_remove(h.replies, serial);
+		}
+	}
+	g_free(pending);
+
+	return reply;
+}
+
+DBusMessage *harness_call(const char *method, int first_arg_type, ...)
+{
+	harness_pending *pending;
+	va_list ap;
+
+	va_start(ap, first_arg_type);
+	pending = harness_call_startv(method, first_arg_type, ap);
+	va_end(ap);
+
+	return harness_call_finish(pending);
+}
+
+void harness_send_signal(DBusMessage * signal)
+{
+	if (h.bus != NULL) {
+		dbus_connection_send(h.bus, signal, NULL);
+		dbus_connection_flush(h.bus);
+		return;
+	}
+
+	harness_bus_filter(NULL, signal, NULL);
+}
+
+guint harness_signal_count(const char *member)
+{
+	guint i, count = 0;
+
+	for (i = 0; i < h.signals->len; i++) {
+		if (dbus_message_has_member(g_ptr_array_index(h.signals, i), member))
+			count++;
+	}
+
+	return count;
+}
+
+DBusMessage *harness_last_signal(const char *member)
+{
+	guint i;
+
+	for (i = h.signals->len; i > 0; i--) {
+		DBusMessage *signal = g_ptr_array_index(h.signals, i - 1);
+
+		if (dbus_message_has_member(signal, member))
+			return signal;
+	}
+
+	return NULL;
+}
+
+void harness_clear_signals(void)
+{
+	g_ptr_array_set_size(h.signals, 0);
+}
+
+gboolean harness_tor_log_contains(const char *prefix)
+{
+	gchar *path = g_build_filename(harness.datadir, "fake_tor.log", NULL);
+	gchar *log = NULL;
+	gchar **lines;
+	gboolean found = FALSE;
+	guint i;
+
+	if (g_file_get_contents(path, &log, NULL, NULL)) {
+		lines = g_strsplit(log, "\n", -1);
+		for (i = 0; lines[i] != NULL && !found; i++)
+			found = g_str_has_prefix(lines[i], prefix);
+		g_strfreev(lines);
+	}
+	g_free(log);
+	g_free(path);
+
+	return found;
+}
+
+void harness_clear_tor_log(void)
+{
+	gchar *path = g_build_filename(harness.datadir, "fake_tor.log", NULL);
+
+	/* fake-tor appends, a running one goes on at the start */
+	if (truncate(path, 0) != 0 && errno != ENOENT)
+		g_error("Could not truncate %s", path);
+	g_free(path);
+}
@@ -0,0 +1,114 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HARNESS_H
+#define __HARNESS_H
+#include <sys/types.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+#include <network_api.h>
+
+#include "libicd_tor_shared.h"
+#include "mock_gconf.h"
+
+/* A mock ICd that loads the network module in-process.
+ *
+ * It hands the module a watch_fn and close_fn, keeps gconf in memory (see
+ * mock_gconf.h) and stands in for ICd's D-Bus helpers. The module's method
+ * calls and signals go over the session bus when DBUS_SESSION_BUS_ADDRESS
+ * is set, so they can be watched with dbus-monitor, otherwise they are
+ * dispatched in-process.
+ *
+ * Tor is fake-tor (tests/fake_tor.c) unless ICD_TOR_TEST_BINARY names
+ * another binary, every run gets its own scratch directory, ports and gconf
+ * configuration named HARNESS_CONFIG. */
+
+#define HARNESS_CONFIG "test"
+#define HARNESS_CONFIG_KEY(key) GC_TOR "/" HARNESS_CONFIG "/" key
+
+typedef struct {
+	gchar *dir;
+	gchar *datadir;
+	gint socks_port;
+	gint control_port;
+	gint trans_port;
+	gint dns_port;
+} harness_setup;
+
+extern harness_setup harness;
+
+/* What ip_up or ip_down reported back */
+typedef struct {
+	gboolean done;
+	enum icd_nw_status status;
+	gchar *err_str;
+	/* Microseconds from the call to the callback */
+	gint64 elapsed_us;
+	gint64 started_us;
+} harness_result;
+
+void harness_init(void);
+void harness_cleanup(void);
+
+void harness_start_module(void);
+void harness_stop_module(void);
+
+/* Script for fake-tor instances started from now on, NULL for the default */
+void harness_set_script(const char *script);
+
+void harness_ip_up(const char *network_id, harness_result * result);
+void harness_ip_down(const char *network_id, harness_result * result);
+void harness_result_clear(harness_result * result);
+
+/* Run the main loop until *done or the timeout, FALSE on timeout */
+gboolean harness_wait(const gboolean * done, guint timeout_ms);
+/* Until close_fn was called for network_id */
+gboolean harness_wait_closed(const char *network_id, guint timeout_ms);
+gboolean harness_wait_pid_exit(pid_t pid, guint timeout_ms);
+/* Until fake-tor logged a command starting with prefix */
+gboolean harness_wait_tor_log(const char *prefix, guint timeout_ms);
+
+/* Last pid handed to watch_fn that did not exit yet, or 0 */
+pid_t harness_tor_pid(void);
+guint harness_spawn_count(void);
+
+/* Calls method on the module's D-Bus interface, arguments as with
+ * dbus_message_append_args(). Returns the reply, or NULL on timeout. */
+DBusMessage *harness_call(const char *method, int first_arg_type, ...);
+/* The same in two steps, for calls that are answered later */
+typedef struct _harness_pending harness_pending;
+harness_pending *harness_call_start(const char *method, int first_arg_type, ...);
+/* Returns the reply, or NULL on timeout, and frees pending */
+DBusMessage *harness_call_finish(harness_pending * pending);
+/* Hands a broadcast signal to the handlers the module connected */
+void harness_send_signal(DBusMessage * signal);
+
+guint harness_signal_count(const char *member);
+/* Owned by the harness, valid until harness_clear_signals() */
+DBusMessage *harness_last_signal(const char *member);
+void harness_clear_signals(void);
+
+/* Whether fake-tor logged a command starting with prefix */
+gboolean harness_tor_log_contains(const char *prefix);
+void harness_clear_tor_log(void);
+
+#endif
@@ -0,0 +1,404 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <string.h>
+
+#include <glib.h>
+#include <glib-object.h>
+#include <gconf/gconf-client.h>
+
+#include "mock_gconf.h"
+
+/* GConfValue is all callers get to see, the rest is ours */
+typedef struct {
+	GConfValue value;
+	gboolean b;
+	gint i;
+	gchar *s;
+	GConfValueType list_type;
+	GSList *list;
+} mock_value;
+
+typedef struct {
+	guint id;
+	gchar *namespace_section;
+	GConfClientNotifyFunc func;
+	gpointer user_data;
+	GFreeFunc destroy_notify;
+} mock_notify;
+
+static struct {
+	GObject *client;
+	/* key -> mock_value */
+	GHashTable *values;
+	GSList *notifies;
+	guint last_notify_id;
+	/* Changed keys not notified yet */
+	GSList *changed;
+	guint changed_id;
+} gconf;
+
+static void mock_value_free(mock_value * value)
+{
+	if (value == NULL)
+		return;
+
+	g_free(value->s);
+	g_slist_free_full(value->list, (GDestroyNotify) mock_value_free);
+	g_free(value);
+}
+
+static mock_value *mock_value_new(GConfValueType type)
+{
+	mock_value *value = g_new0(mock_value, 1);
+
+	value->value.type = type;
+
+	return value;
+}
+
+static mock_value *mock_value_copy(const mock_value * value)
+{
+	mock_value *copy;
+	GSList *l;
+
+	if (value == NULL)
+		return NULL;
+
+	copy = mock_value_new(value->value.type);
+	copy->b = value->b;
+	copy->i = value->i;
+	copy->s = g_strdup(value->s);
+	copy->list_type = value->list_type;
+	for (l = value->list; l; l = l->next)
+		copy->list = g_slist_append(copy->list, mock_value_copy(l->data));
+
+	return copy;
+}
+
+static GConfEntry *mock_entry_new(const char *key, const mock_value * value)
+{
+	GConfEntry *entry = g_new0(GConfEntry, 1);
+
+	entry->key = g_strdup(key);
+	entry->value = (GConfValue *) mock_value_copy(value);
+
+	return entry;
+}
+
+static void mock_init(void)
+{
+	if (gconf.values != NULL)
+		return;
+
+#if !GLIB_CHECK_VERSION(2, 36, 0)
+	g_type_init();
+#endif
+	gconf.values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) mock_value_free);
+	gconf.client = g_object_new(G_TYPE_OBJECT, NULL);
+}
+
+static gboolean mock_key_in(const char *key, const char *dir)
+{
+	size_t len = strlen(dir);
+
+	return strncmp(key, dir, len) == 0 && (key[len] == '\0' || key[len] == '/');
+}
+
+static gboolean mock_notify_cb(gpointer user_data)
+{
+	GSList *changed = g_slist_reverse(gconf.changed);
+	GSList *l;
+
+	gconf.changed = NULL;
+	gconf.changed_id = 0;
+
+	for (l = changed; l; l = l->next) {
+		const char *key = l->data;
+		guint last = gconf.last_notify_id;
+		guint id;
+
+		/* By id, callbacks may remove (and add) notifications */
+		for (id = 1; id <= last; id++) {
+			GSList *n;
+
+			for (n = gconf.notifies; n; n = n->next) {
+				mock_notify *notify = n->data;
+
+				if (notify->id != id)
+					continue;
+
+				if (mock_key_in(key, notify->namespace_section)) {
+					GConfEntry *entry = mock_entry_new(key, g_hash_table_lookup(gconf.values, key));
+
+					notify->func((GConfClient *) gconf.client, notify->id, entry, notify->user_data);
+					gconf_entry_free(entry);
+				}
+				break;
+			}
+		}
+	}
+	g_slist_free_full(changed, g_free);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void mock_set(const char *key, mock_value * value)
+{
+	mock_init();
+
+	if (value != NULL)
+		g_hash_table_replace(gconf.values, g_strdup(key), value);
+	else
+		g_hash_table_remove(gconf.values, key);
+
+	gconf.changed = g_slist_prepend(gconf.changed, g_strdup(key));
+	if (gconf.changed_id == 0)
+		gconf.changed_id = g_idle_add(mock_notify_cb, NULL);
+}
+
+void mock_gconf_set_bool(const char *key, gboolean value)
+{
+	mock_value *v = mock_value_new(GCONF_VALUE_BOOL);
+
+	v->b = value;
+	mock_set(key, v);
+}
+
+void mock_gconf_set_int(const char *key, gint value)
+{
+	mock_value *v = mock_value_new(GCONF_VALUE_INT);
+
+	v->i = value;
+	mock_set(key, v);
+}
+
+void mock_gconf_set_string(const char *key, const char *value)
+{
+	mock_value *v = mock_value_new(GCONF_VALUE_STRING);
+
+	v->s = g_strdup(value);
+	mock_set(key, v);
+}
+
+void mock_gconf_set_string_list(const char *key, const char *const *values)
+{
+	mock_value *v = mock_value_new(GCONF_VALUE_LIST);
+
+	v->list_type = GCONF_VALUE_STRING;
+	for (; values && *values; values++) {
+		mock_value *item = mock_value_new(GCONF_VALUE_STRING);
+
+		item->s = g_strdup(*values);
+		v->list = g_slist_append(v->list, item);
+	}
+	mock_set(key, v);
+}
+
+void mock_gconf_unset(const char *key)
+{
+	mock_set(key, NULL);
+}
+
+void mock_gconf_clear(void)
+{
+	mock_init();
+	g_hash_table_remove_all(gconf.values);
+
+	g_slist_free_full(gconf.changed, g_free);
+	gconf.changed = NULL;
+	if (gconf.changed_id) {
+		g_source_remove(gconf.changed_id);
+		gconf.changed_id = 0;
+	}
+}
+
+static const mock_value *mock_get(const char *key, GConfValueType type)
+{
+	const mock_value *value;
+
+	mock_init();
+	value = g_hash_table_lookup(gconf.values, key);
+
+	return value != NULL && value->value.type == type ? value : NULL;
+}
+
+/* What the network module uses of libgconf */
+
+GConfClient *gconf_client_get_default(void)
+{
+	mock_init();
+
+	return (GConfClient *) g_object_ref(gconf.client);
+}
+
+void gconf_client_add_dir(GConfClient * client, const gchar * dir, GConfClientPreloadType preload, GError ** err)
+{
+}
+
+void gconf_client_remove_dir(GConfClient * client, const gchar * dir, GError ** err)
+{
+}
+
+guint gconf_client_notify_add(GConfClient * client, const gchar * namespace_section, GConfClientNotifyFunc func,
+			      gpointer user_data, GFreeFunc destroy_notify, GError ** err)
+{
+	mock_notify *notify = g_new0(mock_notify, 1);
+
+	notify->id = ++gconf.last_notify_id;
+	notify->namespace_section = g_strdup(namespace_section);
+	notify->func = func;
+	notify->user_data = user_data;
+	notify->destroy_notify = destroy_notify;
+	gconf.notifies = g_slist_append(gconf.notifies, notify);
+
+	return notify->id;
+}
+
+void gconf_client_notify_remove(GConfClient * client, guint cnxn)
+{
+	GSList *l;
+
+	for (l = gconf.notifies; l; l = l->next) {
+		mock_notify *notify = l->data;
+
+		if (notify->id != cnxn)
+			continue;
+
+		gconf.notifies = g_slist_delete_link(gconf.notifies, l);
+		if (notify->destroy_notify)
+			notify->destroy_notify(notify->user_data);
+		g_free(notify->namespace_section);
+		g_free(notify);
+		return;
+	}
+}
+
+gboolean gconf_client_get_bool(GConfClient * client, const gchar * key, GError ** err)
+{
+	const mock_value *value = mock_get(key, GCONF_VALUE_BOOL);
+
+	return value ? value->b : FALSE;
+}
+
+gint gconf_client_get_int(GConfClient * client, const gchar * key, GError ** err)
+{
+	const mock_value *value = mock_get(key, GCONF_VALUE_INT);
+
+	return value ? value->i : 0;
+}
+
+gchar *gconf_client_get_string(GConfClient * client, const gchar * key, GError ** err)
+{
+	const mock_value *value = mock_get(key, GCONF_VALUE_STRING);
+
+	return value ? g_strdup(value->s) : NULL;
+}
+
+GSList *gconf_client_get_list(GConfClient * client, const gchar * key, GConfValueType list_type, GError ** err)
+{
+	const mock_value *value = mock_get(key, GCONF_VALUE_LIST);
+	GSList *ret = NULL, *l;
+
+	if (value == NULL || value->list_type != list_type)
+		return NULL;
+
+	for (l = value->list; l; l = l->next) {
+		const mock_value *item = l->data;
+
+		if (list_type == GCONF_VALUE_STRING)
+			ret = g_slist_append(ret, g_strdup(item->s));
+		else if (list_type == GCONF_VALUE_INT)
+			ret = g_slist_append(ret, GINT_TO_POINTER(item->i));
+		else if (list_type == GCONF_VALUE_BOOL)
+			ret = g_slist_append(ret, GINT_TO_POINTER(item->b));
+	}
+
+	return ret;
+}
+
+GSList *gconf_client_all_entries(GConfClient * client, const gchar * dir, GError ** err)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList *entries = NULL;
+	size_t len = strlen(dir);
+
+	mock_init();
+
+	g_hash_table_iter_init(&iter, gconf.values);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		const char *name = key;
+
+		/* Only the keys right in dir */
+		if (strncmp(name, dir, len) != 0 || name[len] != '/' || strchr(name + len + 1, '/') != NULL)
+			continue;
+
+		entries = g_slist_prepend(entries, mock_entry_new(name, value));
+	}
+
+	return entries;
+}
+
+gboolean gconf_value_get_bool(const GConfValue * value)
+{
+	return ((const mock_value *)value)->b;
+}
+
+int gconf_value_get_int(const GConfValue * value)
+{
+	return ((const mock_value *)value)->i;
+}
+
+const char *gconf_value_get_string(const GConfValue * value)
+{
+	return ((const mock_value *)value)->s;
+}
+
+GSList *gconf_value_get_list(const GConfValue * value)
+{
+	return ((const mock_value *)value)->list;
+}
+
+GConfValueType gconf_value_get_list_type(const GConfValue * value)
+{
+	return ((const mock_value *)value)->list_type;
+}
+
+const char *gconf_entry_get_key(const GConfEntry * entry)
+{
+	return entry->key;
+}
+
+GConfValue *gconf_entry_get_value(const GConfEntry * entry)
+{
+	return entry->value;
+}
+
+void gconf_entry_free(GConfEntry * entry)
+{
+	if (entry == NULL)
+		return;
+
+	g_free(entry->key);
+	mock_value_free((mock_value *) entry->value);
+	g_free(entry);
+}
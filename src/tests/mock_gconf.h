@@ -0,0 +1,40 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __MOCK_GCONF_H
+#define __MOCK_GCONF_H
+#include <glib.h>
+
+/* gconf kept in memory, for the tests and benchmarks.
+ *
+ * The gconf_client_* calls of the network module end up in mock_gconf.c
+ * instead of libgconf, so no gconfd is needed. Like with gconfd, clients
+ * get notified from the main loop, not from within the setters. */
+
+void mock_gconf_set_bool(const char *key, gboolean value);
+void mock_gconf_set_int(const char *key, gint value);
+void mock_gconf_set_string(const char *key, const char *value);
+void mock_gconf_set_string_list(const char *key, const char *const *values);
+void mock_gconf_unset(const char *key);
+/* Drop every key, without notifying */
+void mock_gconf_clear(void);
+
+#endif
@@ -0,0 +1,624 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Starting Tor, watching it bootstrap and losing it, through the mock ICd
+ * with fake-tor scripted to behave well or badly. */
+
+#include <signal.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "libicd_tor.h"
+#include "harness.h"
+
+#define TEST_NETWORK_ID "iap-test"
+#define TEST_PROVIDER_ID "iap-provider"
+#define TEST_TIMEOUT_MS 10000
+
+/* fake-tor's own script, to add to */
+#define TEST_BOOTSTRAP_SCRIPT \
+	"wait events\n" \
+	"wait network\n" \
+	"bootstrap 5 conn Connecting to a relay\n" \
+	"bootstrap 50 loading_descriptors Loading relay descriptors\n" \
+	"bootstrap 100 done Done\n" \
+	"circuit-established\n"
+
+typedef struct {
+	harness_result up;
+	harness_result down;
+} test_fixture;
+
+static void test_setup(test_fixture * f, gconstpointer data)
+{
+	harness_init();
+	harness_start_module();
+}
+
+static void test_teardown(test_fixture * f, gconstpointer data)
+{
+	harness_stop_module();
+	harness_cleanup();
+	harness_result_clear(&f->up);
+	harness_result_clear(&f->down);
+	g_unsetenv("ICD_TOR_TEST_BOOTSTRAP_TIMEOUT");
+}
+
+/* What ICd does after close_fn */
+static void test_ip_down(test_fixture * f)
+{
+	pid_t pid = harness_tor_pid();
+	gboolean done;
+
+	harness_ip_down(TEST_NETWORK_ID, &f->down);
+	done = harness_wait(&f->down.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(f->down.status, ==, ICD_NW_SUCCESS);
+
+	if (pid != 0) {
+		done = harness_wait_pid_exit(pid, TEST_TIMEOUT_MS);
+		g_assert(done);
+	}
+}
+
+static void test_bootstrap(test_fixture * f, gconstpointer data)
+{
+	DBusMessage *signal;
+	dbus_int32_t progress = -1;
+	const char *tag = NULL;
+	gboolean done;
+
+	harness_ip_up(TEST_NETWORK_ID, &f->up);
+	done = harness_wait(&f->up.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(f->up.status, ==, ICD_NW_SUCCESS);
+	g_assert_cmpuint(harness_spawn_count(), ==, 1);
+	g_assert_cmpint(harness_tor_pid(), !=, 0);
+
+	/* Cookie authentication, then events before asking, so no phase is
+	 * missed */
+	g_assert(harness_tor_log_contains("AUTHENTICATE"));
+	g_assert(harness_tor_log_contains("SETEVENTS STATUS_CLIENT STREAM"));
+	g_assert(harness_tor_log_contains("GETINFO status/bootstrap-phase"));
+
+	/* 5, 50 and 100, GETINFO only repeats one of them */
+	g_assert_cmpuint(harness_signal_count(ICD_TOR_SIGNAL_BOOTSTRAPPROGRESS), ==, 3);
+	signal = harness_last_signal(ICD_TOR_SIGNAL_BOOTSTRAPPROGRESS);
+	g_assert(signal != NULL);
+	done = dbus_message_get_args(signal, NULL, DBUS_TYPE_INT32, &progress, DBUS_TYPE_STRING, &tag,
+				     DBUS_TYPE_INVALID);
+	g_assert(done);
+	g_assert_cmpint(progress, ==, 100);
+	g_assert_cmpstr(tag, ==, "done");
+
+	test_ip_down(f);
+	g_assert_cmpuint(harness_spawn_count(), ==, 1);
+}
+
+/* ip_up waits for 100%, not for other client status events */
+static void test_bootstrap_done_only(test_fixture * f, gconstpointer data)
+{
+	gboolean done;
+
+	harness_set_script("wait events\n"
+			   "bootstrap 90 ap_handshake_done Handshake finished with a relay\n"
+			   "event STATUS_CLIENT NOTICE ENOUGH_DIR_INFO\n"
+			   "event STATUS_CLIENT NOTICE CIRCUIT_ESTABLISHED\n" "sleep 300\n" "bootstrap 100 done Done\n");
+
+	harness_ip_up(TEST_NETWORK_ID, &f->up);
+	done = harness_wait(&f->up.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(f->up.status, ==, ICD_NW_SUCCESS);
+	g_assert(f->up.elapsed_us >= 300 * 1000);
+
+	test_ip_down(f);
+}
+
+/* BootstrapProgress only when the percentage changes, however often Tor
+ * reports the phase */
+static void test_bootstrap_progress(test_fixture * f, gconstpointer data)
+{
+	DBusMessage *reply;
+	dbus_int32_t progress = -1;
+	const char *tag = NULL, *summary = NULL;
+	gboolean done;
+
+	harness_set_script("wait events\n"
+			   "bootstrap 50 loading_descriptors Loading relay descriptors\n"
+			   "bootstrap 50 loading_descriptors Loading relay descriptors\n"
+			   "event STATUS_CLIENT WARN BOOTSTRAP PROGRESS=50 TAG=loading_descriptors"
+			   " SUMMARY=\"Loading relay descriptors\" WARNING=\"Connection refused\" REASON=CONNECTREFUSED\n"
+			   "bootstrap 100 done Done\n");
+
+	harness_ip_up(TEST_NETWORK_ID, &f->up);
+	done = harness_wait(&f->up.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(f->up.status, ==, ICD_NW_SUCCESS);
+	g_assert_cmpuint(harness_signal_count(ICD_TOR_SIGNAL_BOOTSTRAPPROGRESS), ==, 2);
+
+	reply = harness_call(ICD_TOR_METHOD_GETBOOTSTRAPPROGRESS, DBUS_TYPE_INVALID);
+	g_assert(reply != NULL);
+	done = dbus_message_get_args(reply, NULL, DBUS_TYPE_INT32, &progress, DBUS_TYPE_STRING, &tag,
+				     DBUS_TYPE_STRING, &summary, DBUS_TYPE_INVALID);
+	g_assert(done);
+	g_assert_cmpint(progress, ==, 100);
+	g_assert_cmpstr(tag, ==, "done");
+	g_assert_cmpstr(summary, ==, "Done");
+	dbus_message_unref(reply);
+
+	test_ip_down(f);
+}
+
+/* Tor bootstrapped before anyone subscribed to its events, which only
+ * GETINFO status/bootstrap-phase tells */
+static void test_bootstrap_getinfo(test_fixture * f, gconstpointer data)
+{
+	gboolean done;
+
+	harness_set_script("bootstrap 100 done Done\n");
+
+	harness_ip_up(TEST_NETWORK_ID, &f->up);
+	done = harness_wait(&f->up.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(f->up.status, ==, ICD_NW_SUCCESS);
+
+	test_ip_down(f);
+}
+
+/* A lost control connection is made again, bootstrapping goes on */
+static void test_bootstrap_reconnect(test_fixture * f, gconstpointer data)
+{
+	gboolean done;
+
+	harness_set_script("wait command SETEVENTS\n"
+			   "bootstrap 50 loading_descriptors Loading relay descriptors\n"
+			   "drop\n" "wait command SETEVENTS\n" "bootstrap 100 done Done\n");
+
+	harness_ip_up(TEST_NETWORK_ID, &f->up);
+	done = harness_wait(&f->up.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(f->up.status, ==, ICD_NW_SUCCESS);
+	g_assert_cmpuint(harness_spawn_count(), ==, 1);
+
+	test_ip_down(f);
+}
+
+/* Tor that does not bootstrap in time is stopped, and ip_up fails */
+static void test_bootstrap_timeout(test_fixture * f, gconstpointer data)
+{
+	pid_t pid;
+	gboolean done;
+
+	g_setenv("ICD_TOR_TEST_BOOTSTRAP_TIMEOUT", "1", TRUE);
+	harness_set_script("wait events\n" "bootstrap 5 conn Connecting to a relay\n" "hang\n");
+
+	harness_ip_up(TEST_NETWORK_ID, &f->up);
+	pid = harness_tor_pid();
+	g_assert_cmpint(pid, !=, 0);
+
+	done = harness_wait(&f->up.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(f->up.status, ==, ICD_NW_ERROR);
+	g_assert(f->up.elapsed_us >= G_USEC_PER_SEC);
+
+	done = harness_wait_pid_exit(pid, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert(!harness_wait_closed(TEST_NETWORK_ID, 0));
+}
+
+/* Tor dies while bootstrapping: ICd is told to close the IAP */
+static void test_crash_bootstrapping(test_fixture * f, gconstpointer data)
+{
+	gboolean done;
+
+	harness_set_script("wait events\n" "bootstrap 5 conn Connecting to a relay\n" "crash\n");
+
+	harness_ip_up(TEST_NETWORK_ID, &f->up);
+	done = harness_wait_closed(TEST_NETWORK_ID, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert(!f->up.done);
+	g_assert_cmpint(harness_tor_pid(), ==, 0);
+
+	test_ip_down(f);
+	g_assert_cmpuint(harness_spawn_count(), ==, 1);
+}
+
+/* Tor dies before it opened its control port */
+static void test_exit_early(test_fixture * f, gconstpointer data)
+{
+	gboolean done;
+
+	harness_set_script("exit 1\n");
+
+	harness_ip_up(TEST_NETWORK_ID, &f->up);
+	done = harness_wait_closed(TEST_NETWORK_ID, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert(!f->up.done);
+
+	test_ip_down(f);
+}
+
+/* Tor dies once connected */
+static void test_crash_connected(test_fixture * f, gconstpointer data)
+{
+	gboolean done;
+
+	harness_ip_up(TEST_NETWORK_ID, &f->up);
+	done = harness_wait(&f->up.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(f->up.status, ==, ICD_NW_SUCCESS);
+	g_assert(!harness_wait_closed(TEST_NETWORK_ID, 0));
+
+	kill(harness_tor_pid(), SIGSEGV);
+	done = harness_wait_closed(TEST_NETWORK_ID, TEST_TIMEOUT_MS);
+	g_assert(done);
+
+	test_ip_down(f);
+}
+
+/* ip_down parks Tor with its network off, the next ip_up turns it back on */
+static void test_warm_standby(test_fixture * f, gconstpointer data)
+{
+	pid_t pid;
+	gboolean done;
+
+	mock_gconf_set_bool(GC_TOR_WARM_STANDBY, TRUE);
+
+	harness_ip_up(TEST_NETWORK_ID, &f->up);
+	done = harness_wait(&f->up.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(f->up.status, ==, ICD_NW_SUCCESS);
+	pid = harness_tor_pid();
+	harness_result_clear(&f->up);
+
+	harness_clear_tor_log();
+	harness_ip_down(TEST_NETWORK_ID, &f->down);
+	done = harness_wait(&f->down.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(f->down.status, ==, ICD_NW_SUCCESS);
+	harness_result_clear(&f->down);
+	done = harness_wait_tor_log("SETCONF DisableNetwork=1", TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(harness_tor_pid(), ==, pid);
+
+	harness_clear_tor_log();
+	harness_ip_up(TEST_NETWORK_ID, &f->up);
+	done = harness_wait(&f->up.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(f->up.status, ==, ICD_NW_SUCCESS);
+	g_assert_cmpuint(harness_spawn_count(), ==, 1);
+	g_assert_cmpint(harness_tor_pid(), ==, pid);
+	g_assert(harness_tor_log_contains("SETCONF DisableNetwork=0"));
+	g_assert(harness_tor_log_contains("SIGNAL ACTIVE"));
+	g_assert(harness_tor_log_contains("GETINFO status/circuit-established"));
+
+	/* Without standby, ip_down stops it */
+	mock_gconf_set_bool(GC_TOR_WARM_STANDBY, FALSE);
+	test_ip_down(f);
+}
+
+/* Tor that quit in standby is started anew, no IAP is closed over it */
+static void test_warm_standby_exit(test_fixture * f, gconstpointer data)
+{
+	pid_t pid;
+	gboolean done;
+
+	mock_gconf_set_bool(GC_TOR_WARM_STANDBY, TRUE);
+
+	harness_ip_up(TEST_NETWORK_ID, &f->up);
+	done = harness_wait(&f->up.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(f->up.status, ==, ICD_NW_SUCCESS);
+	pid = harness_tor_pid();
+	harness_result_clear(&f->up);
+
+	harness_ip_down(TEST_NETWORK_ID, &f->down);
+	done = harness_wait(&f->down.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	harness_result_clear(&f->down);
+
+	kill(pid, SIGKILL);
+	done = harness_wait_pid_exit(pid, TEST_TIMEOUT_MS);
+	g_assert(done);
+
+	harness_ip_up(TEST_NETWORK_ID, &f->up);
+	done = harness_wait(&f->up.done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(f->up.status, ==, ICD_NW_SUCCESS);
+	g_assert_cmpuint(harness_spawn_count(), ==, 2);
+	g_assert(!harness_wait_closed(TEST_NETWORK_ID, 0));
+
+	mock_gconf_set_bool(GC_TOR_WARM_STANDBY, FALSE);
+	test_ip_down(f);
+}
+
+static void test_ip_up_id(const char *network_id, harness_result * result)
+{
+	gboolean done;
+
+	harness_ip_up(network_id, result);
+	done = harness_wait(&result->done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(result->status, ==, ICD_NW_SUCCESS);
+	harness_result_clear(result);
+}
+
+static void test_ip_down_id(const char *network_id, harness_result * result)
+{
+	gboolean done;
+
+	harness_ip_down(network_id, result);
+	done = harness_wait(&result->done, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpint(result->status, ==, ICD_NW_SUCCESS);
+	harness_result_clear(result);
+}
+
+/* A second IAP uses the Tor of the first, which leaves it running for the
+ * second when it goes */
+static void test_two_iaps(test_fixture * f, gconstpointer data)
+{
+	pid_t pid;
+	gboolean done;
+
+	test_ip_up_id("iap-a", &f->up);
+	pid = harness_tor_pid();
+	test_ip_up_id("iap-b", &f->up);
+	g_assert_cmpuint(harness_spawn_count(), ==, 1);
+
+	test_ip_down_id("iap-a", &f->down);
+	g_assert(!harness_wait_pid_exit(pid, 500));
+	g_assert(!harness_wait_closed("iap-b", 0));
+
+	test_ip_down_id("iap-b", &f->down);
+	done = harness_wait_pid_exit(pid, TEST_TIMEOUT_MS);
+	g_assert(done);
+	g_assert_cmpuint(harness_spawn_count(), ==, 1);
+}
+
+/* Losing their Tor closes both */
+static void test_two_iaps_exit(test_fixture * f, gconstpointer data)
+{
+	gboolean done;
+
+	test_ip_up_id("iap-a", &f->up);
+	test_ip_up_id("iap-b", &f->up);
+
+	kill(harness_tor_pid(), SIGKILL);
+	done = harness_wait_closed("iap-a", TEST_TIMEOUT_MS) && harness_wait_closed("iap-b", TEST_TIMEOUT_MS);
+	g_assert(done);
+
+	test_ip_down_id("iap-a", &f->down);
+	test_ip_down_id("iap-b", &f->down);
+	g_assert_cmpuint(harness_spawn_count(), ==, 1);
+}
+
+/* Connects an IAP of the Tor provider, which waits for Start */
+static void test_provider_up(test_fixture * f)
+{
+	mock_gconf_set_string(GC_IAP "/" TEST_PROVIDER_ID "/service_type", TOR_PROVIDER_TYPE);
+
+	test_ip_up_id(TEST_PROVIDER_ID, &f->up);
+	g_assert_cmpuint(harness_spawn_count(), ==, 0);
+}
+
+static harness_pending *test_call_start_and_wait(dbus_uint32_t timeout_ms)
+{
+	const char *config = HARNESS_CONFIG;
+
+	return harness_call_start(ICD_TOR_METHOD_STARTANDWAIT, DBUS_TYPE_STRING, &config, DBUS_TYPE_UINT32,
+				  &timeout_ms, DBUS_TYPE_INVALID);
+}
+
+/* Returns the result code, with the session in *session_id */
+static dbus_int32_t test_start_and_wait_result(harness_pending * pending, dbus_uint32_t * session_id)
+{
+	DBusMessage *reply = harness_call_finish(pending);
+	dbus_int32_t result = -1;
+	dbus_uint32_t elapsed_ms = 0;
+	gboolean done;
+
+	g_assert(reply != NULL);
+	done = dbus_message_get_args(reply, NULL, DBUS_TYPE_INT32, &result, DBUS_TYPE_UINT32, &elapsed_ms,
+				     DBUS_TYPE_UINT32, session_id, DBUS_TYPE_INVALID);
+	g_assert(done);
+	dbus_message_unref(reply);
+
+	return result;
+}
+
+/* Callers while Tor starts are all answered from that one start */
+static void test_start_and_wait(test_fixture * f, gconstpointer data)
+{
+	harness_pending *first, *second;
+	dbus_int32_t result;
+	dbus_uint32_t first_session = 0, second_session = 0, session = 0;
+	pid_t pid;
+	gboolean done;
+
+	test_provider_up(f);
+
+	first = test_call_start_and_wait(0);
+	second = test_call_start_and_wait(0);
+	result = test_start_and_wait_result(first, &first_session);
+	g_assert_cmpint(result, ==, TOR_DBUS_METHOD_START_RESULT_OK);
+	result = test_start_and_wait_result(second, &second_session);
+	g_assert_cmpint(result, ==, TOR_DBUS_METHOD_START_RESULT_OK);
+	g_assert_cmpuint(first_session, ==, second_session);
+	g_assert_cmpuint(harness_spawn_count(), ==, 1);
+	g_assert(harness_tor_log_contains("GETINFO status/bootstrap-phase"));
+
+	/* Connected already */
+	result = test_start_and_wait_result(test_call_start_and_wait(0), &session);
+	g_assert_cmpint(result, ==, TOR_DBUS_METHOD_START_RESULT_OK);
+	g_assert_cmpuint(session, ==, first_session);
+	g_assert_cmpuint(harness_spawn_count(), ==, 1);
+
+	pid = harness_tor_pid();
+	test_ip_down_id(TEST_PROVIDER_ID, &f->down);
+	done = harness_wait_pid_exit(pid, TEST_TIMEOUT_MS);
+	g_assert(done);
+}
+
+static void test_start_and_wait_timeout(test_fixture * f, gconstpointer data)
+{
+	dbus_int32_t result;
+	dbus_uint32_t session = 0;
+	pid_t pid;
+	gboolean done;
+
+	harness_set_script("wait events\n" "bootstrap 5 conn Connecting to a relay\n" "hang\n");
+	test_provider_up(f);
+
+	result = test_start_and_wait_result(test_call_start_and_wait(300), &session);
+	g_assert_cmpint(result, ==, TOR_DBUS_METHOD_START_RESULT_TIMEOUT);
+
+	/* Only the caller gave up, Tor goes on */
+	pid = harness_tor_pid();
+	g_assert_cmpint(pid, !=, 0);
+	test_ip_down_id(TEST_PROVIDER_ID, &f->down);
+	done = harness_wait_pid_exit(pid, TEST_TIMEOUT_MS);
+	g_assert(done);
+}
+
+static void test_start_and_wait_failed(test_fixture * f, gconstpointer data)
+{
+	dbus_int32_t result;
+	dbus_uint32_t session = 0;
+
+	g_setenv("ICD_TOR_TEST_BOOTSTRAP_TIMEOUT", "1", TRUE);
+	harness_set_script("wait events\n" "bootstrap 5 conn Connecting to a relay\n" "hang\n");
+	test_provider_up(f);
+
+	result = test_start_and_wait_result(test_call_start_and_wait(5000), &session);
+	g_assert_cmpint(result, ==, TOR_DBUS_METHOD_START_RESULT_FAILED);
+
+	test_ip_down_id(TEST_PROVIDER_ID, &f->down);
+}
+
+/* Returns whether Tor is dormant, and how often and long it was */
+static gboolean test_dormant_stats(dbus_uint32_t * count, dbus_uint64_t * dormant_ms)
+{
+	DBusMessage *reply = harness_call(ICD_TOR_METHOD_GETDORMANTSTATS, DBUS_TYPE_INVALID);
+	dbus_bool_t dormant = FALSE;
+	dbus_uint64_t wakeups_avoided = 0;
+	gboolean done;
+
+	g_assert(reply != NULL);
+	done = dbus_message_get_args(reply, NULL, DBUS_TYPE_BOOLEAN, &dormant, DBUS_TYPE_UINT64, dormant_ms,
+				     DBUS_TYPE_UINT32, count, DBUS_TYPE_UINT64, &wakeups_avoided, DBUS_TYPE_INVALID);
+	g_assert(done);
+	dbus_message_unref(reply);
+
+	return dormant;
+}
+
+/* Idle Tor goes dormant, Tor's own streams do not wake it, a user's do */
+static void test_dormant_idle(test_fixture * f, gconstpointer data)
+{
+	dbus_uint32_t count = 0;
+	dbus_uint64_t dormant_ms = 0;
+	gboolean done;
+
+	mock_gconf_set_int(GC_TOR_DORMANT_TIMEOUT, 1);
+	harness_set_script(TEST_BOOTSTRAP_SCRIPT
+			   "wait command SIGNAL DORMANT\n"
+			   "event STREAM 6 NEW 0 203.0.113.1:443 PURPOSE=DIR_FETCH\n"
+			   "sleep 300\n" "event STREAM 7 NEW 0 example.com:80 SOURCE_ADDR=127.0.0.1:40000 PURPOSE=USER\n");
+
+	test_ip_up_id(TEST_NETWORK_ID, &f->up);
+	done = harness_wait_tor_log("SIGNAL ACTIVE", TEST_TIMEOUT_MS);
+	g_assert(done);
+
+	done = test_dormant_stats(&count, &dormant_ms);
+	g_assert(!done);
+	g_assert_cmpuint(count, ==, 1);
+	g_assert_cmpuint(dormant_ms, >=, 300);
+
+	test_ip_down(f);
+}
+
+static void test_display_signal(const char *status)
+{
+	DBusMessage *signal = dbus_message_new_signal("/com/nokia/mce/signal", "com.nokia.mce.signal",
+						      "display_status_ind");
+
+	g_assert(signal != NULL);
+	dbus_message_append_args(signal, DBUS_TYPE_STRING, &status, DBUS_TYPE_INVALID);
+	harness_send_signal(signal);
+	dbus_message_unref(signal);
+}
+
+/* The display going off sends Tor dormant right away, on wakes it */
+static void test_dormant_display(test_fixture * f, gconstpointer data)
+{
+	dbus_uint32_t count = 0;
+	dbus_uint64_t dormant_ms = 0;
+	gboolean done;
+
+	mock_gconf_set_int(GC_TOR_DORMANT_TIMEOUT, 600);
+	test_ip_up_id(TEST_NETWORK_ID, &f->up);
+
+	test_display_signal("off");
+	done = harness_wait_tor_log("SIGNAL DORMANT", TEST_TIMEOUT_MS);
+	g_assert(done);
+	done = test_dormant_stats(&count, &dormant_ms);
+	g_assert(done);
+
+	test_display_signal("on");
+	done = harness_wait_tor_log("SIGNAL ACTIVE", TEST_TIMEOUT_MS);
+	g_assert(done);
+	done = test_dormant_stats(&count, &dormant_ms);
+	g_assert(!done);
+	g_assert_cmpuint(count, ==, 1);
+
+	test_ip_down(f);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+#define TEST_ADD(path, fn) \
+	g_test_add(path, test_fixture, NULL, test_setup, fn, test_teardown)
+
+	TEST_ADD("/network-tor/bootstrap", test_bootstrap);
+	TEST_ADD("/network-tor/bootstrap-done-only", test_bootstrap_done_only);
+	TEST_ADD("/network-tor/bootstrap-progress", test_bootstrap_progress);
+	TEST_ADD("/network-tor/bootstrap-getinfo", test_bootstrap_getinfo);
+	TEST_ADD("/network-tor/bootstrap-reconnect", test_bootstrap_reconnect);
+	TEST_ADD("/network-tor/bootstrap-timeout", test_bootstrap_timeout);
+	TEST_ADD("/network-tor/crash-bootstrapping", test_crash_bootstrapping);
+	TEST_ADD("/network-tor/exit-early", test_exit_early);
+	TEST_ADD("/network-tor/crash-connected", test_crash_connected);
+	TEST_ADD("/network-tor/warm-standby", test_warm_standby);
+	TEST_ADD("/network-tor/warm-standby-exit", test_warm_standby_exit);
+	TEST_ADD("/network-tor/two-iaps", test_two_iaps);
+	TEST_ADD("/network-tor/two-iaps-exit", test_two_iaps_exit);
+	TEST_ADD("/network-tor/start-and-wait", test_start_and_wait);
+	TEST_ADD("/network-tor/start-and-wait-timeout", test_start_and_wait_timeout);
+	TEST_ADD("/network-tor/start-and-wait-failed", test_start_and_wait_failed);
+	TEST_ADD("/network-tor/dormant-idle", test_dormant_idle);
+	TEST_ADD("/network-tor/dormant-display", test_dormant_display);
+
+	return g_test_run();
+}
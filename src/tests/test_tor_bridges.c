@@ -0,0 +1,253 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Probing bridges on loopback that answer the ClientHello late, never, or
+ * are not there at all, and ranking them. */
+
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "tor_bridges.h"
+
+#define TEST_FINGERPRINT "0123456789ABCDEF0123456789ABCDEF01234567"
+#define TEST_PROBE_TIMEOUT_MS 1000
+#define TEST_TIMEOUT_MS 10000
+
+/* A bridge that sends a TLS handshake record delay_ms after it accepted,
+ * or nothing at all for a negative delay */
+typedef struct {
+	int fd;
+	gint port;
+	gint delay_ms;
+	guint accept_id;
+	GSList *clients;
+} test_bridge;
+
+typedef struct {
+	int fd;
+	guint answer_id;
+} test_client;
+
+static gboolean test_bridge_answer(gpointer user_data)
+{
+	test_client *client = user_data;
+	guint8 record = 0x16;
+
+	client->answer_id = 0;
+	if (send(client->fd, &record, 1, MSG_NOSIGNAL) != 1)
+		g_error("Could not answer the bridge probe");
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean test_bridge_accept(GIOChannel * source, GIOCondition condition, gpointer user_data)
+{
+	test_bridge *bridge = user_data;
+	test_client *client;
+	int fd = accept(bridge->fd, NULL, NULL);
+
+	if (fd < 0)
+		return G_SOURCE_CONTINUE;
+
+	client = g_new0(test_client, 1);
+	client->fd = fd;
+	bridge->clients = g_slist_prepend(bridge->clients, client);
+
+	if (bridge->delay_ms >= 0)
+		client->answer_id = g_timeout_add(bridge->delay_ms, test_bridge_answer, client);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static int test_listen(gint * port)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	g_assert_cmpint(fd, >=, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	    || getsockname(fd, (struct sockaddr *)&addr, &len) != 0)
+		g_error("Could not bind a loopback port");
+	*port = ntohs(addr.sin_port);
+
+	return fd;
+}
+
+static test_bridge *test_bridge_new(gint delay_ms)
+{
+	test_bridge *bridge = g_new0(test_bridge, 1);
+	GIOChannel *channel;
+
+	bridge->delay_ms = delay_ms;
+	bridge->fd = test_listen(&bridge->port);
+	if (listen(bridge->fd, 8) != 0)
+		g_error("Could not listen on %d", bridge->port);
+
+	channel = g_io_channel_unix_new(bridge->fd);
+	bridge->accept_id = g_io_add_watch(channel, G_IO_IN, test_bridge_accept, bridge);
+	g_io_channel_unref(channel);
+
+	return bridge;
+}
+
+static void test_client_free(gpointer data)
+{
+	test_client *client = data;
+
+	if (client->answer_id)
+		g_source_remove(client->answer_id);
+	close(client->fd);
+	g_free(client);
+}
+
+static void test_bridge_free(test_bridge * bridge)
+{
+	g_slist_free_full(bridge->clients, test_client_free);
+	g_source_remove(bridge->accept_id);
+	close(bridge->fd);
+	g_free(bridge);
+}
+
+/* A port nothing listens on, connecting is refused */
+static gint test_dead_port(void)
+{
+	gint port;
+
+	close(test_listen(&port));
+
+	return port;
+}
+
+static gchar *test_bridge_line(gint port)
+{
+	return g_strdup_printf("Bridge 127.0.0.1:%d " TEST_FINGERPRINT, port);
+}
+
+static void test_probed(gpointer user_data)
+{
+	*(gboolean *) user_data = TRUE;
+}
+
+static gboolean test_timeout(gpointer user_data)
+{
+	*(gboolean *) user_data = TRUE;
+
+	return G_SOURCE_REMOVE;
+}
+
+static void test_rank(void)
+{
+	test_bridge *fast = test_bridge_new(50);
+	test_bridge *slow = test_bridge_new(200);
+	test_bridge *silent = test_bridge_new(-1);
+	gchar *fast_line = test_bridge_line(fast->port);
+	gchar *slow_line = test_bridge_line(slow->port);
+	gchar *silent_line = test_bridge_line(silent->port);
+	gchar *dead_line = test_bridge_line(test_dead_port());
+	gchar *bridges, *selected, *expected;
+	tor_bridges_probe *probe;
+	gboolean probed = FALSE, timed_out = FALSE;
+	guint timeout_id;
+
+	/* Slowest first, so the order is the probe's doing */
+	bridges = g_strjoin("\n", slow_line, dead_line, silent_line, fast_line, "", NULL);
+
+	probe = tor_bridges_probe_new(bridges, TEST_PROBE_TIMEOUT_MS, test_probed, &probed);
+	g_assert(probe != NULL);
+
+	timeout_id = g_timeout_add(TEST_TIMEOUT_MS, test_timeout, &timed_out);
+	while (!probed && !timed_out)
+		g_main_context_iteration(NULL, TRUE);
+	g_assert(probed);
+	g_source_remove(timeout_id);
+
+	/* The dead and the silent one are left out */
+	selected = tor_bridges_select(bridges, 0);
+	expected = g_strconcat(fast_line, "\n", slow_line, "\n", NULL);
+	g_assert_cmpstr(selected, ==, expected);
+	g_free(selected);
+	g_free(expected);
+
+	selected = tor_bridges_select(bridges, 1);
+	expected = g_strconcat(fast_line, "\n", NULL);
+	g_assert_cmpstr(selected, ==, expected);
+	g_free(selected);
+	g_free(expected);
+
+	/* Every result is fresh, there is nothing to probe again */
+	probe = tor_bridges_probe_new(bridges, TEST_PROBE_TIMEOUT_MS, test_probed, &probed);
+	g_assert(probe == NULL);
+
+	tor_bridges_cache_free();
+	g_free(bridges);
+	g_free(fast_line);
+	g_free(slow_line);
+	g_free(silent_line);
+	g_free(dead_line);
+	test_bridge_free(fast);
+	test_bridge_free(slow);
+	test_bridge_free(silent);
+}
+
+/* Nothing answered: Tor gets all bridges to try itself */
+static void test_none_reachable(void)
+{
+	gchar *dead_line = test_bridge_line(test_dead_port());
+	gchar *bridges, *selected;
+	tor_bridges_probe *probe;
+	gboolean probed = FALSE;
+
+	bridges = g_strconcat("UseBridges 1\n", dead_line, "\n", NULL);
+
+	/* Refused right away or on the first poll */
+	probe = tor_bridges_probe_new(bridges, TEST_PROBE_TIMEOUT_MS, test_probed, &probed);
+	while (probe != NULL && !probed)
+		g_main_context_iteration(NULL, TRUE);
+
+	selected = tor_bridges_select(bridges, 0);
+	g_assert_cmpstr(selected, ==, bridges);
+	g_free(selected);
+
+	tor_bridges_cache_free();
+	g_free(bridges);
+	g_free(dead_line);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/tor-bridges/rank", test_rank);
+	g_test_add_func("/tor-bridges/none-reachable", test_none_reachable);
+
+	return g_test_run();
+}
@@ -0,0 +1,535 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#include <errno.h>
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "icd/support/icd_log.h"
+
+#include "libicd_tor.h"
+#include "tor_bridges.h"
+#include "transproxy.h"
+
+/* Last result by bridge address, shared by all configurations */
+typedef struct {
+	gint64 probed_at;
+	/* Time to the answer, -1 if there was none */
+	gint latency_ms;
+} bridge_result;
+
+static GHashTable *bridge_cache;
+
+typedef struct {
+	tor_bridges_probe *probe;
+	gchar *address;
+	gboolean tls;
+
+	int fd;
+	GIOChannel *channel;
+	guint io_id;
+	gboolean connected;
+
+	gint64 start_time;
+} bridge_conn;
+
+struct _tor_bridges_probe {
+	GSList *conns;
+	guint timeout_id;
+
+	tor_bridges_probe_fn done_cb;
+	gpointer user_data;
+};
+
+static gboolean bridge_conn_io(GIOChannel * source, GIOCondition condition, gpointer user_data);
+
+/* "Bridge [transport] address:port [fingerprint] [args]", returns the address
+ * and whether it is a plain bridge */
+static gboolean bridge_line_parse(const char *line, gchar ** address, gboolean * tls)
+{
+	gchar **tokens = g_strsplit_set(line, " \t", -1);
+	gchar *words[2] = { NULL, NULL };
+	int i, n = 0;
+
+	for (i = 0; tokens[i] != NULL && n < 3; i++) {
+		if (tokens[i][0] == '\0')
+			continue;
+		if (n == 0 && g_ascii_strcasecmp(tokens[i], "Bridge") != 0)
+			break;
+		if (n > 0)
+			words[n - 1] = tokens[i];
+		n++;
+	}
+
+	if (n < 2) {
+		g_strfreev(tokens);
+		return FALSE;
+	}
+
+	/* A transport name has no colon, an address always has */
+	*tls = strchr(words[0], ':') != NULL;
+	*address = g_strdup(*tls ? words[0] : words[1]);
+	g_strfreev(tokens);
+
+	return *address != NULL;
+}
+
+static gboolean bridge_result_fresh(const bridge_result * result)
+{
+	gint64 ttl = (gint64) TOR_BRIDGES_CACHE_TTL * G_USEC_PER_SEC;
+
+	return result != NULL && g_get_monotonic_time() - result->probed_at < ttl;
+}
+
+static void bridge_cache_set(const char *address, gint latency_ms)
+{
+	bridge_result *result;
+
+	if (bridge_cache == NULL)
+		bridge_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	result = g_new0(bridge_result, 1);
+	result->probed_at = g_get_monotonic_time();
+	result->latency_ms = latency_ms;
+	g_hash_table_replace(bridge_cache, g_strdup(address), result);
+}
+
+static const bridge_result *bridge_cache_get(const char *address)
+{
+	const bridge_result *result = bridge_cache ? g_hash_table_lookup(bridge_cache, address) : NULL;
+
+	return bridge_result_fresh(result) ? result : NULL;
+}
+
+void tor_bridges_cache_free(void)
+{
+	if (bridge_cache != NULL) {
+		g_hash_table_destroy(bridge_cache);
+		bridge_cache = NULL;
+	}
+}
+
+static void bridge_conn_free(bridge_conn * conn)
+{
+	if (conn->io_id)
+		g_source_remove(conn->io_id);
+	if (conn->channel)
+		g_io_channel_unref(conn->channel);
+	if (conn->fd >= 0)
+		close(conn->fd);
+
+	g_free(conn->address);
+	g_free(conn);
+}
+
+static void bridge_conn_done(bridge_conn * conn, gboolean reachable)
+{
+	tor_bridges_probe *probe = conn->probe;
+	gint latency_ms = (g_get_monotonic_time() - conn->start_time) / 1000;
+
+	if (reachable)
+		TN_INFO("Bridge %s answered in %d ms", conn->address, latency_ms);
+	else
+		TN_INFO("Bridge %s is unreachable", conn->address);
+	bridge_cache_set(conn->address, reachable ? latency_ms : -1);
+
+	probe->conns = g_slist_remove(probe->conns, conn);
+	bridge_conn_free(conn);
+
+	if (probe->conns == NULL) {
+		tor_bridges_probe_fn done_cb = probe->done_cb;
+		gpointer user_data = probe->user_data;
+
+		tor_bridges_probe_free(probe);
+		done_cb(user_data);
+	}
+}
+
+static void put16(GByteArray * buf, guint value)
+{
+	guint8 bytes[2] = { value >> 8, value & 0xff };
+
+	g_byte_array_append(buf, bytes, 2);
+}
+
+/* Fill in the big endian length of what follows offset, in size bytes */
+static void put_length(GByteArray * buf, guint offset, guint size)
+{
+	guint len = buf->len - offset - size;
+	guint i;
+
+	for (i = 0; i < size; i++)
+		buf->data[offset + i] = len >> (8 * (size - 1 - i));
+}
+
+/* TLS 1.2 ClientHello with the ciphers and curves Tor offers */
+static GByteArray *bridge_client_hello(void)
+{
+	static const guint16 ciphers[] = {
+		0xc02b, 0xc02f, 0xc02c, 0xc030, 0xcca9, 0xcca8, 0x009e, 0x1301, 0x1302, 0x1303
+	};
+	static const guint16 groups[] = { 0x001d, 0x0017, 0x0018 };
+	static const guint16 sigalgs[] = { 0x0403, 0x0503, 0x0804, 0x0805, 0x0401, 0x0501, 0x0201 };
+	static const guint8 header[] = { 0x16, 0x03, 0x01, 0, 0, 0x01, 0, 0, 0, 0x03, 0x03 };
+	static const guint8 zero[3] = { 0 };
+	GByteArray *buf = g_byte_array_new();
+	guint ext, list;
+	guint i;
+
+	g_byte_array_append(buf, header, sizeof(header));
+	for (i = 0; i < 8; i++) {
+		guint32 r = g_random_int();
+		g_byte_array_append(buf, (guint8 *)&r, 4);
+	}
+	/* No session id */
+	g_byte_array_append(buf, zero, 1);
+
+	put16(buf, sizeof(ciphers));
+	for (i = 0; i < G_N_ELEMENTS(ciphers); i++)
+		put16(buf, ciphers[i]);
+	/* Only the null compression method */
+	put16(buf, 0x0100);
+
+	ext = buf->len;
+	put16(buf, 0);
+
+	put16(buf, 0x000a);
+	put16(buf, 2 + sizeof(groups));
+	put16(buf, sizeof(groups));
+	for (i = 0; i < G_N_ELEMENTS(groups); i++)
+		put16(buf, groups[i]);
+
+	put16(buf, 0x000b);
+	put16(buf, 2);
+	put16(buf, 0x0100);
+
+	put16(buf, 0x000d);
+	list = buf->len;
+	put16(buf, 0);
+	put16(buf, sizeof(sigalgs));
+	for (i = 0; i < G_N_ELEMENTS(sigalgs); i++)
+		put16(buf, sigalgs[i]);
+	put_length(buf, list, 2);
+
+	put_length(buf, ext, 2);
+	put_length(buf, 6, 3);
+	put_length(buf, 3, 2);
+
+	return buf;
+}
+
+static void bridge_conn_connected(bridge_conn * conn)
+{
+	GByteArray *hello;
+	ssize_t sent;
+
+	if (!conn->tls) {
+		bridge_conn_done(conn, TRUE);
+		return;
+	}
+
+	hello = bridge_client_hello();
+	do {
+		sent = send(conn->fd, hello->data, hello->len, MSG_NOSIGNAL);
+	} while (sent < 0 && errno == EINTR);
+
+	if (sent != (ssize_t) hello->len) {
+		g_byte_array_free(hello, TRUE);
+		bridge_conn_done(conn, FALSE);
+		return;
+	}
+	g_byte_array_free(hello, TRUE);
+
+	conn->connected = TRUE;
+	conn->io_id = g_io_add_watch(conn->channel, G_IO_IN | G_IO_HUP | G_IO_ERR, bridge_conn_io, conn);
+}
+
+static gboolean bridge_conn_io(GIOChannel * source, GIOCondition condition, gpointer user_data)
+{
+	bridge_conn *conn = user_data;
+	guint8 type;
+	ssize_t len;
+
+	if (!conn->connected) {
+		int error = 0;
+		socklen_t error_len = sizeof(error);
+
+		conn->io_id = 0;
+
+		if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0)
+			bridge_conn_done(conn, FALSE);
+		else
+			bridge_conn_connected(conn);
+
+		return G_SOURCE_REMOVE;
+	}
+
+	len = recv(conn->fd, &type, 1, 0);
+	if (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return G_SOURCE_CONTINUE;
+
+	/* A handshake record, or an alert about our hello, both speak TLS */
+	conn->io_id = 0;
+	bridge_conn_done(conn, len == 1 && (type == 0x16 || type == 0x15));
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean bridge_probe_timeout(gpointer user_data)
+{
+	tor_bridges_probe *probe = user_data;
+
+	probe->timeout_id = 0;
+	while (probe->conns != NULL && probe->conns->next != NULL)
+		bridge_conn_done(probe->conns->data, FALSE);
+	/* The last one finishes (and frees) the probe */
+	bridge_conn_done(probe->conns->data, FALSE);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Connect to address without blocking, returns FALSE if that failed
+ * right away */
+static gboolean bridge_conn_start(bridge_conn * conn)
+{
+	struct addrinfo hints, *ai;
+	const char *colon = strrchr(conn->address, ':');
+	gchar *host, *port;
+	int ret, mark;
+
+	if (colon == NULL)
+		return FALSE;
+
+	/* Bridge addresses are IPs, IPv6 ones in brackets */
+	host = g_strndup(conn->address, colon - conn->address);
+	port = g_strdup(colon + 1);
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		memmove(host, host + 1, strlen(host) - 2);
+		host[strlen(host) - 2] = '\0';
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	ret = getaddrinfo(host, port, &hints, &ai);
+	g_free(host);
+	g_free(port);
+
+	if (ret != 0) {
+		TN_WARN("Invalid bridge address %s", conn->address);
+		return FALSE;
+	}
+
+	conn->fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (conn->fd < 0) {
+		TN_WARN("Could not create bridge probe socket: %s", strerror(errno));
+		freeaddrinfo(ai);
+		return FALSE;
+	}
+	conn->channel = g_io_channel_unix_new(conn->fd);
+
+	/* Past the transproxy redirect, or we would time Tor's TransPort */
+	mark = TRANSPROXY_BYPASS_MARK;
+	if (setsockopt(conn->fd, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) < 0)
+		TN_WARN("Could not mark bridge probe socket: %s", strerror(errno));
+
+	conn->start_time = g_get_monotonic_time();
+
+	ret = connect(conn->fd, ai->ai_addr, ai->ai_addrlen);
+	freeaddrinfo(ai);
+
+	if (ret != 0 && errno != EINPROGRESS)
+		return FALSE;
+
+	conn->io_id = g_io_add_watch(conn->channel, G_IO_OUT | G_IO_HUP | G_IO_ERR, bridge_conn_io, conn);
+
+	return TRUE;
+}
+
+/**
+ * Probe the bridges of a configuration that have no fresh result.
+ *
+ * @param bridges     bridge lines, as in the torrc
+ * @param timeout_ms  time every bridge gets to answer
+ * @param done_cb     called when all are done, not when NULL is returned
+ * @param user_data   passed to done_cb
+ * @return the probe, or NULL if there was nothing to wait for
+ */
+tor_bridges_probe *tor_bridges_probe_new(const char *bridges, guint timeout_ms,
+					 tor_bridges_probe_fn done_cb, gpointer user_data)
+{
+	tor_bridges_probe *probe;
+	gchar **lines;
+	int i;
+
+	if (bridges == NULL)
+		return NULL;
+
+	probe = g_new0(tor_bridges_probe, 1);
+	probe->done_cb = done_cb;
+	probe->user_data = user_data;
+
+	lines = g_strsplit(bridges, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		bridge_conn *conn;
+		gchar *address;
+		gboolean tls;
+		GSList *l;
+
+		if (!bridge_line_parse(lines[i], &address, &tls))
+			continue;
+
+		for (l = probe->conns; l; l = l->next) {
+			if (strcmp(((bridge_conn *) l->data)->address, address) == 0)
+				break;
+		}
+		if (l != NULL || bridge_cache_get(address) != NULL) {
+			g_free(address);
+			continue;
+		}
+
+		conn = g_new0(bridge_conn, 1);
+		conn->probe = probe;
+		conn->address = address;
+		conn->tls = tls;
+		conn->fd = -1;
+
+		if (!bridge_conn_start(conn)) {
+			bridge_cache_set(address, -1);
+			bridge_conn_free(conn);
+			continue;
+		}
+
+		probe->conns = g_slist_prepend(probe->conns, conn);
+	}
+	g_strfreev(lines);
+
+	if (probe->conns == NULL) {
+		tor_bridges_probe_free(probe);
+		return NULL;
+	}
+
+	TN_INFO("Probing %u bridges", g_slist_length(probe->conns));
+	probe->timeout_id = g_timeout_add(timeout_ms, bridge_probe_timeout, probe);
+
+	return probe;
+}
+
+/* Hand a running probe over to someone else */
+void tor_bridges_probe_set_callback(tor_bridges_probe * probe, tor_bridges_probe_fn done_cb, gpointer user_data)
+{
+	probe->done_cb = done_cb;
+	probe->user_data = user_data;
+}
+
+void tor_bridges_probe_free(tor_bridges_probe * probe)
+{
+	if (probe == NULL)
+		return;
+
+	if (probe->timeout_id)
+		g_source_remove(probe->timeout_id);
+
+	g_slist_free_full(probe->conns, (GDestroyNotify) bridge_conn_free);
+	g_free(probe);
+}
+
+typedef struct {
+	gchar *line;
+	gint latency_ms;
+} ranked_bridge;
+
+static gint ranked_bridge_compare(gconstpointer a, gconstpointer b)
+{
+	return ((const ranked_bridge *)a)->latency_ms - ((const ranked_bridge *)b)->latency_ms;
+}
+
+/**
+ * The bridge lines to set: the max fastest reachable bridges, or all
+ * of them when none is known to be reachable. Other lines are kept.
+ *
+ * @param bridges  bridge lines from the configuration
+ * @param max      bridges to keep, 0 for all reachable ones
+ * @return newly allocated bridge lines
+ */
+gchar *tor_bridges_select(const char *bridges, guint max)
+{
+	GString *ret;
+	GSList *ranked = NULL, *l;
+	gchar **lines;
+	guint count = 0;
+	int i;
+
+	if (bridges == NULL)
+		return g_strdup("");
+
+	ret = g_string_new(NULL);
+	lines = g_strsplit(bridges, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		const bridge_result *result;
+		gchar *address;
+		gboolean tls;
+
+		if (!bridge_line_parse(lines[i], &address, &tls)) {
+			g_string_append(ret, lines[i]);
+			g_string_append_c(ret, '\n');
+			continue;
+		}
+
+		result = bridge_cache_get(address);
+		g_free(address);
+
+		if (result != NULL && result->latency_ms >= 0) {
+			ranked_bridge *bridge = g_new0(ranked_bridge, 1);
+
+			bridge->line = g_strstrip(g_strdup(lines[i]));
+			bridge->latency_ms = result->latency_ms;
+			ranked = g_slist_prepend(ranked, bridge);
+		}
+	}
+	g_strfreev(lines);
+
+	/* Stable, so equally fast bridges keep their order */
+	ranked = g_slist_sort(g_slist_reverse(ranked), ranked_bridge_compare);
+
+	if (ranked == NULL) {
+		g_string_free(ret, TRUE);
+		return g_strdup(bridges);
+	}
+
+	for (l = ranked; l && (max == 0 || count < max); l = l->next, count++) {
+		ranked_bridge *bridge = l->data;
+
+		/* Bridge as the first word, however it was spelled */
+		g_string_append_printf(ret, "Bridge%s\n", bridge->line + strlen("Bridge"));
+	}
+
+	for (l = ranked; l; l = l->next)
+		g_free(((ranked_bridge *) l->data)->line);
+	g_slist_free_full(ranked, g_free);
+
+	return g_string_free(ret, FALSE);
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifndef __TOR_BRIDGES_H
+#define __TOR_BRIDGES_H
+#include <glib.h>
+
+/* Bridge reachability, measured before Tor gets to use the bridges.
+ *
+ * Every Bridge line of a configuration is connected to in parallel: plain
+ * bridges have to answer a TLS ClientHello, bridges behind a pluggable
+ * transport only have to accept the TCP connection, as the transport's own
+ * handshake is up to the transport. Results are cached per address for
+ * TOR_BRIDGES_CACHE_TTL seconds, and tor_bridges_select() picks the fastest
+ * reachable bridges, which are set with SETCONF before Tor's network is
+ * turned on, so Tor does not spend the bootstrap timeout on dead ones. */
+typedef struct _tor_bridges_probe tor_bridges_probe;
+
+#define TOR_BRIDGES_CACHE_TTL (30 * 60)
+#define TOR_BRIDGES_PROBE_TIMEOUT_MS 3000
+/* Bridges set when the configuration does not say */
+#define TOR_BRIDGES_DEFAULT_MAX 3
+
+/* Called once every bridge answered or timed out, after which the probe
+ * frees itself */
+typedef void (*tor_bridges_probe_fn)(gpointer user_data);
+
+tor_bridges_probe *tor_bridges_probe_new(const char *bridges, guint timeout_ms,
+					 tor_bridges_probe_fn done_cb, gpointer user_data);
+void tor_bridges_probe_set_callback(tor_bridges_probe * probe, tor_bridges_probe_fn done_cb, gpointer user_data);
+void tor_bridges_probe_free(tor_bridges_probe * probe);
+gchar *tor_bridges_select(const char *bridges, guint max);
+void tor_bridges_cache_free(void);
+
+#endif
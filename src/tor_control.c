@@ -0,0 +1,578 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <glib.h>
+
+#include "icd/support/icd_log.h"
+
+#include "libicd_tor.h"
+#include "tor_control.h"
+
+/* How often we try to connect while Tor is still starting up */
+#define TOR_CONTROL_RETRY_MS 100
+
+/* Tor's authentication cookie is always 32 bytes */
+#define TOR_CONTROL_COOKIE_LEN 32
+
+struct _tor_control {
+	int port;
+	gchar *cookie_path;
+
+	int fd;
+	GIOChannel *channel;
+	guint in_id;
+	guint out_id;
+	guint retry_id;
+
+	gboolean connecting;
+	gboolean ready;
+
+	GString *inbuf;
+	GString *outbuf;
+
+	/* Reply currently being received, and whether we are in a data block */
+	GString *reply;
+	gboolean in_data;
+
+	/* Commands waiting for a reply, in order */
+	GQueue *pending;
+
+	/* We can be freed from within one of our own callbacks */
+	guint dispatch_depth;
+	gboolean freed;
+
+	tor_control_ready_fn ready_cb;
+	tor_control_event_fn event_cb;
+	tor_control_lost_fn lost_cb;
+	gpointer user_data;
+};
+
+typedef struct {
+	tor_control_reply_fn reply_cb;
+	gpointer user_data;
+} tor_control_cmd;
+
+static gboolean tor_control_retry(gpointer user_data);
+static gboolean tor_control_io_in(GIOChannel * source, GIOCondition condition, gpointer user_data);
+static gboolean tor_control_io_out(GIOChannel * source, GIOCondition condition, gpointer user_data);
+
+static void tor_control_disconnect(tor_control * control)
+{
+	if (control->in_id) {
+		g_source_remove(control->in_id);
+		control->in_id = 0;
+	}
+	if (control->out_id) {
+		g_source_remove(control->out_id);
+		control->out_id = 0;
+	}
+	if (control->channel) {
+		g_io_channel_unref(control->channel);
+		control->channel = NULL;
+	}
+	if (control->fd >= 0) {
+		close(control->fd);
+		control->fd = -1;
+	}
+
+	control->connecting = FALSE;
+	control->ready = FALSE;
+	control->in_data = FALSE;
+
+	g_string_truncate(control->inbuf, 0);
+	g_string_truncate(control->outbuf, 0);
+	g_string_truncate(control->reply, 0);
+
+	/* Pending commands will never see their reply */
+	g_queue_foreach(control->pending, (GFunc) g_free, NULL);
+	g_queue_clear(control->pending);
+}
+
+/* Drop the connection and try again later, Tor might still be starting up or
+ * might have rewritten the cookie */
+static void tor_control_reconnect(tor_control * control)
+{
+	gboolean was_ready = control->ready;
+
+	tor_control_disconnect(control);
+
+	if (was_ready && control->lost_cb)
+		control->lost_cb(control, control->user_data);
+
+	if (control->retry_id == 0)
+		control->retry_id = g_timeout_add(TOR_CONTROL_RETRY_MS, tor_control_retry, control);
+}
+
+static void tor_control_really_free(tor_control * control)
+{
+	g_string_free(control->inbuf, TRUE);
+	g_string_free(control->outbuf, TRUE);
+	g_string_free(control->reply, TRUE);
+	g_queue_free(control->pending);
+	g_free(control->cookie_path);
+	g_free(control);
+}
+
+static gboolean tor_control_flush(tor_control * control)
+{
+	while (control->outbuf->len > 0) {
+		ssize_t len = send(control->fd, control->outbuf->str, control->outbuf->len, MSG_NOSIGNAL);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (control->out_id == 0)
+					control->out_id = g_io_add_watch(control->channel, G_IO_OUT,
+									 tor_control_io_out, control);
+				return TRUE;
+			}
+
+			TN_WARN("Could not write to Tor control port: %s", strerror(errno));
+			return FALSE;
+		}
+
+		g_string_erase(control->outbuf, 0, len);
+	}
+
+	if (control->out_id) {
+		g_source_remove(control->out_id);
+		control->out_id = 0;
+	}
+
+	return TRUE;
+}
+
+static int tor_control_queue(tor_control * control, const char *command,
+			     tor_control_reply_fn reply_cb, gpointer user_data)
+{
+	tor_control_cmd *cmd = g_new0(tor_control_cmd, 1);
+
+	cmd->reply_cb = reply_cb;
+	cmd->user_data = user_data;
+	g_queue_push_tail(control->pending, cmd);
+
+	g_string_append(control->outbuf, command);
+	g_string_append(control->outbuf, "\r\n");
+
+	if (!tor_control_flush(control)) {
+		tor_control_reconnect(control);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void tor_control_auth_reply(tor_control * control, int code, const char *reply, gpointer user_data)
+{
+	if (code != 250) {
+		TN_WARN("Tor control port authentication failed: %d %s", code, reply);
+		tor_control_reconnect(control);
+		return;
+	}
+
+	TN_DEBUG("Authenticated to Tor control port %d", control->port);
+	control->ready = TRUE;
+
+	if (control->ready_cb)
+		control->ready_cb(control, control->user_data);
+}
+
+static gboolean tor_control_authenticate(tor_control * control)
+{
+	gchar *cookie = NULL;
+	gsize cookie_len = 0;
+	GString *command;
+	gsize i;
+
+	if (!g_file_get_contents(control->cookie_path, &cookie, &cookie_len, NULL)) {
+		TN_DEBUG("Tor control cookie %s not available yet", control->cookie_path);
+		return FALSE;
+	}
+
+	if (cookie_len != TOR_CONTROL_COOKIE_LEN) {
+		TN_DEBUG("Tor control cookie %s has unexpected length %zu", control->cookie_path, cookie_len);
+		g_free(cookie);
+		return FALSE;
+	}
+
+	command = g_string_new("AUTHENTICATE ");
+	for (i = 0; i < cookie_len; i++)
+		g_string_append_printf(command, "%02X", (guchar) cookie[i]);
+	g_free(cookie);
+
+	tor_control_queue(control, command->str, tor_control_auth_reply, NULL);
+	g_string_free(command, TRUE);
+
+	return TRUE;
+}
+
+static void tor_control_connected(tor_control * control)
+{
+	control->connecting = FALSE;
+	control->in_id = g_io_add_watch(control->channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+					tor_control_io_in, control);
+
+	if (!tor_control_authenticate(control))
+		tor_control_reconnect(control);
+}
+
+static gboolean tor_control_connect(tor_control * control)
+{
+	struct sockaddr_in addr;
+
+	control->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (control->fd < 0) {
+		TN_WARN("Could not create control port socket: %s", strerror(errno));
+		return FALSE;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(control->port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	control->channel = g_io_channel_unix_new(control->fd);
+
+	if (connect(control->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		tor_control_connected(control);
+		return TRUE;
+	}
+
+	if (errno == EINPROGRESS) {
+		control->connecting = TRUE;
+		control->out_id = g_io_add_watch(control->channel, G_IO_OUT | G_IO_HUP | G_IO_ERR,
+						 tor_control_io_out, control);
+		return TRUE;
+	}
+
+	tor_control_disconnect(control);
+	return FALSE;
+}
+
+static gboolean tor_control_retry(gpointer user_data)
+{
+	tor_control *control = user_data;
+
+	control->retry_id = 0;
+
+	if (!tor_control_connect(control))
+		tor_control_reconnect(control);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean tor_control_io_out(GIOChannel * source, GIOCondition condition, gpointer user_data)
+{
+	tor_control *control = user_data;
+
+	if (control->connecting) {
+		int error = 0;
+		socklen_t len = sizeof(error);
+
+		control->out_id = 0;
+
+		if (getsockopt(control->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+			tor_control_reconnect(control);
+			return G_SOURCE_REMOVE;
+		}
+
+		tor_control_connected(control);
+		return G_SOURCE_REMOVE;
+	}
+
+	if (!tor_control_flush(control)) {
+		/* flush() left out_id alone, the source goes away when we return */
+		control->out_id = 0;
+		tor_control_reconnect(control);
+		return G_SOURCE_REMOVE;
+	}
+
+	/* flush() already removed us if everything was written */
+	return control->out_id != 0;
+}
+
+static void tor_control_dispatch(tor_control * control, int code)
+{
+	gchar *text = g_strdup(control->reply->str);
+
+	g_string_truncate(control->reply, 0);
+
+	if (code == 650) {
+		if (control->event_cb)
+			control->event_cb(control, text, control->user_data);
+	} else {
+		tor_control_cmd *cmd = g_queue_pop_head(control->pending);
+
+		if (cmd == NULL) {
+			TN_WARN("Unsolicited reply on Tor control port: %d %s", code, text);
+		} else {
+			if (cmd->reply_cb)
+				cmd->reply_cb(control, code, text, cmd->user_data);
+			g_free(cmd);
+		}
+	}
+
+	g_free(text);
+}
+
+static void tor_control_handle_line(tor_control * control, const char *line)
+{
+	if (control->in_data) {
+		if (strcmp(line, ".") == 0) {
+			control->in_data = FALSE;
+			return;
+		}
+
+		/* Undo dot-stuffing */
+		if (line[0] == '.')
+			line++;
+
+		g_string_append_c(control->reply, '\n');
+		g_string_append(control->reply, line);
+		return;
+	}
+
+	if (strlen(line) < 4) {
+		TN_WARN("Malformed line on Tor control port: %s", line);
+		return;
+	}
+
+	if (control->reply->len > 0)
+		g_string_append_c(control->reply, '\n');
+	g_string_append(control->reply, line + 4);
+
+	switch (line[3]) {
+	case '+':
+		control->in_data = TRUE;
+		break;
+	case '-':
+		break;
+	case ' ':
+		tor_control_dispatch(control, atoi(line));
+		break;
+	default:
+		TN_WARN("Malformed line on Tor control port: %s", line);
+		break;
+	}
+}
+
+static gboolean tor_control_io_in(GIOChannel * source, GIOCondition condition, gpointer user_data)
+{
+	tor_control *control = user_data;
+	char buf[4096];
+	ssize_t len;
+	char *eol;
+
+	len = read(control->fd, buf, sizeof(buf));
+	if (len < 0 && (errno == EINTR || errno == EAGAIN))
+		return G_SOURCE_CONTINUE;
+
+	if (len <= 0) {
+		TN_DEBUG("Lost connection to Tor control port %d", control->port);
+		control->in_id = 0;
+		tor_control_reconnect(control);
+		return G_SOURCE_REMOVE;
+	}
+
+	g_string_append_len(control->inbuf, buf, len);
+
+	control->dispatch_depth++;
+
+	while (!control->freed && control->fd >= 0 &&
+	       (eol = memchr(control->inbuf->str, '\n', control->inbuf->len)) != NULL) {
+		gsize line_len = eol - control->inbuf->str;
+		gchar *line;
+
+		if (line_len > 0 && control->inbuf->str[line_len - 1] == '\r')
+			line = g_strndup(control->inbuf->str, line_len - 1);
+		else
+			line = g_strndup(control->inbuf->str, line_len);
+		g_string_erase(control->inbuf, 0, line_len + 1);
+
+		tor_control_handle_line(control, line);
+		g_free(line);
+	}
+
+	control->dispatch_depth--;
+
+	if (control->freed) {
+		if (control->dispatch_depth == 0)
+			tor_control_really_free(control);
+		return G_SOURCE_REMOVE;
+	}
+
+	/* A callback may have dropped the connection and removed us already */
+	if (control->in_id == 0)
+		return G_SOURCE_REMOVE;
+
+	return G_SOURCE_CONTINUE;
+}
+
+/**
+ * Start connecting to a Tor control port on localhost
+ *
+ * @param port         control port
+ * @param cookie_path  path of Tor's control_auth_cookie
+ * @param ready_cb     called every time the connection is authenticated
+ * @param event_cb     called for asynchronous events
+ * @param user_data    passed to the callbacks
+ */
+tor_control *tor_control_new(int port, const char *cookie_path,
+			     tor_control_ready_fn ready_cb, tor_control_event_fn event_cb, gpointer user_data)
+{
+	tor_control *control = g_new0(tor_control, 1);
+
+	control->port = port;
+	control->cookie_path = g_strdup(cookie_path);
+	control->fd = -1;
+
+	control->inbuf = g_string_new(NULL);
+	control->outbuf = g_string_new(NULL);
+	control->reply = g_string_new(NULL);
+	control->pending = g_queue_new();
+
+	control->ready_cb = ready_cb;
+	control->event_cb = event_cb;
+	control->user_data = user_data;
+
+	/* Tor was most likely spawned just now, so don't even try yet */
+	control->retry_id = g_timeout_add(TOR_CONTROL_RETRY_MS, tor_control_retry, control);
+
+	return control;
+}
+
+void tor_control_free(tor_control * control)
+{
+	if (control == NULL)
+		return;
+
+	if (control->retry_id) {
+		g_source_remove(control->retry_id);
+		control->retry_id = 0;
+	}
+
+	tor_control_disconnect(control);
+
+	if (control->dispatch_depth > 0) {
+		/* tor_control_io_in will finish the job */
+		control->freed = TRUE;
+		return;
+	}
+
+	tor_control_really_free(control);
+}
+
+/* Hand the connection over to a new owner, which has to set its own lost
+ * callback again */
+void tor_control_set_callbacks(tor_control * control, tor_control_ready_fn ready_cb,
+			       tor_control_event_fn event_cb, gpointer user_data)
+{
+	control->ready_cb = ready_cb;
+	control->event_cb = event_cb;
+	control->lost_cb = NULL;
+	control->user_data = user_data;
+}
+
+/* Called with the user_data of the other callbacks */
+void tor_control_set_lost_callback(tor_control * control, tor_control_lost_fn lost_cb)
+{
+	control->lost_cb = lost_cb;
+}
+
+gboolean tor_control_is_ready(tor_control * control)
+{
+	return control != NULL && control->ready;
+}
+
+/**
+ * Send a command to Tor, the reply callback (if any) is called once the
+ * complete reply has been received. Commands sent before the connection is
+ * ready, or that are pending when it is lost, are dropped.
+ *
+ * @param control    control connection
+ * @param command    command without trailing CRLF
+ * @param reply_cb   reply callback or NULL
+ * @param user_data  passed to reply_cb
+ * @return 0 on success, 1 if the command could not be sent
+ */
+int tor_control_send(tor_control * control, const char *command, tor_control_reply_fn reply_cb, gpointer user_data)
+{
+	if (!tor_control_is_ready(control)) {
+		TN_WARN("Tor control port not ready, dropping command");
+		return 1;
+	}
+
+	return tor_control_queue(control, command, reply_cb, user_data);
+}
+
+/**
+ * Stop calling back for commands sent with user_data, for when it is freed
+ * before Tor replies. The replies themselves are still read and dropped.
+ *
+ * @param control    control connection
+ * @param user_data  as passed to tor_control_send()
+ */
+void tor_control_cancel(tor_control * control, gpointer user_data)
+{
+	GList *l;
+
+	for (l = control->pending->head; l; l = l->next) {
+		tor_control_cmd *cmd = l->data;
+
+		if (cmd->user_data == user_data)
+			cmd->reply_cb = NULL;
+	}
+}
+
+/**
+ * Quote a value as a control protocol QuotedString, for SETCONF and the
+ * like.
+ *
+ * @param value  value to quote
+ * @return newly allocated quoted value, or NULL if value has a control
+ *         character in it, which cannot be sent on one line
+ */
+gchar *tor_control_quote(const char *value)
+{
+	GString *quoted = g_string_new("\"");
+	const char *p;
+
+	for (p = value; *p != '\0'; p++) {
+		if (g_ascii_iscntrl(*p)) {
+			g_string_free(quoted, TRUE);
+			return NULL;
+		}
+		if (*p == '"' || *p == '\\')
+			g_string_append_c(quoted, '\\');
+		g_string_append_c(quoted, *p);
+	}
+	g_string_append_c(quoted, '"');
+
+	return g_string_free(quoted, FALSE);
+}
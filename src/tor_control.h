@@ -0,0 +1,57 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __TOR_CONTROL_H
+#define __TOR_CONTROL_H
+#include <glib.h>
+
+/* Non-blocking Tor control port client living on the GLib main loop.
+ *
+ * The connection is (re)established in the background until it is freed, so
+ * it can be created right after spawning Tor, before the control port is
+ * listening. Every time cookie authentication succeeds the ready callback is
+ * called, after which commands can be sent. */
+typedef struct _tor_control tor_control;
+
+typedef void (*tor_control_ready_fn)(tor_control * control, gpointer user_data);
+
+/* Asynchronous (650) event, without the status code, lines joined by '\n' */
+typedef void (*tor_control_event_fn)(tor_control * control, const char *event, gpointer user_data);
+
+/* The connection dropped, taking pending commands with it. Can be called
+ * from within tor_control_send(), so only update state in here. */
+typedef void (*tor_control_lost_fn)(tor_control * control, gpointer user_data);
+
+/* Reply to a command, without the status codes, lines joined by '\n' */
+typedef void (*tor_control_reply_fn)(tor_control * control, int code, const char *reply, gpointer user_data);
+
+tor_control *tor_control_new(int port, const char *cookie_path,
+			     tor_control_ready_fn ready_cb, tor_control_event_fn event_cb, gpointer user_data);
+void tor_control_free(tor_control * control);
+void tor_control_set_callbacks(tor_control * control, tor_control_ready_fn ready_cb,
+			       tor_control_event_fn event_cb, gpointer user_data);
+void tor_control_set_lost_callback(tor_control * control, tor_control_lost_fn lost_cb);
+gboolean tor_control_is_ready(tor_control * control);
+int tor_control_send(tor_control * control, const char *command, tor_control_reply_fn reply_cb, gpointer user_data);
+void tor_control_cancel(tor_control * control, gpointer user_data);
+gchar *tor_control_quote(const char *value);
+
+#endif
@@ -0,0 +1,375 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <glib.h>
+
+#include "icd/support/icd_log.h"
+
+#include "libicd_tor.h"
+#include "tor_warmup.h"
+
+/* Give up on a target after this long, Tor retries circuits for a while */
+#define TOR_WARMUP_PROBE_TIMEOUT 30
+
+enum warmup_step {
+	WARMUP_STEP_CONNECTING,
+	WARMUP_STEP_METHOD,
+	WARMUP_STEP_REPLY,
+};
+
+typedef struct {
+	tor_warmup *warmup;
+	const char *target;
+	gchar *host;
+	guint16 port;
+	gboolean cold;
+	/* Our end of the SOCKS connection, Tor reports it as SOURCE_ADDR */
+	guint16 local_port;
+
+	int fd;
+	GIOChannel *channel;
+	guint io_id;
+	guint timeout_id;
+
+	enum warmup_step step;
+	guchar buf[2];
+	gsize buflen;
+
+	gint64 start_time;
+} warmup_probe;
+
+struct _tor_warmup {
+	int socks_port;
+	gchar **targets;
+	tor_warmup_stats *stats;
+
+	GSList *probes;
+	guint refresh_s;
+	guint refresh_id;
+};
+
+static gboolean warmup_probe_io(GIOChannel * source, GIOCondition condition, gpointer user_data);
+static void warmup_probe_start(tor_warmup * warmup, const char *target, gboolean cold);
+
+static void warmup_probe_free(warmup_probe * probe)
+{
+	if (probe->io_id)
+		g_source_remove(probe->io_id);
+	if (probe->timeout_id)
+		g_source_remove(probe->timeout_id);
+	if (probe->channel)
+		g_io_channel_unref(probe->channel);
+	if (probe->fd >= 0)
+		close(probe->fd);
+
+	g_free(probe->host);
+	g_free(probe);
+}
+
+static void warmup_probe_done(warmup_probe * probe, gboolean success)
+{
+	tor_warmup *warmup = probe->warmup;
+	tor_warmup_stats *stats = warmup->stats;
+	guint ms = (g_get_monotonic_time() - probe->start_time) / 1000;
+	gboolean again = success && probe->cold;
+	const char *target = probe->target;
+
+	warmup->probes = g_slist_remove(warmup->probes, probe);
+
+	if (!success) {
+		TN_DEBUG("Warm-up of %s failed after %u ms", target, ms);
+		stats->failures++;
+	} else if (probe->cold) {
+		TN_DEBUG("Warm-up of %s: %u ms cold", target, ms);
+		stats->cold_count++;
+		stats->cold_total_ms += ms;
+	} else {
+		TN_DEBUG("Warm-up of %s: %u ms warm", target, ms);
+		stats->warm_count++;
+		stats->warm_total_ms += ms;
+	}
+
+	warmup_probe_free(probe);
+
+	/* Now see what it is like with the circuit in place */
+	if (again)
+		warmup_probe_start(warmup, target, FALSE);
+}
+
+static gboolean warmup_probe_send(warmup_probe * probe, const guchar * data, gsize len)
+{
+	ssize_t sent;
+
+	/* A few hundred bytes on a fresh connection, written in one go */
+	do {
+		sent = send(probe->fd, data, len, MSG_NOSIGNAL);
+	} while (sent < 0 && errno == EINTR);
+
+	return sent == (ssize_t) len;
+}
+
+/* SOCKS5 without authentication, CONNECT to a host name */
+static gboolean warmup_probe_request(warmup_probe * probe)
+{
+	guchar request[7 + 255];
+	gsize host_len = strlen(probe->host);
+
+	request[0] = 5;
+	request[1] = 1;
+	request[2] = 0;
+	request[3] = 3;
+	request[4] = host_len;
+	memcpy(request + 5, probe->host, host_len);
+	request[5 + host_len] = probe->port >> 8;
+	request[6 + host_len] = probe->port & 0xff;
+
+	return warmup_probe_send(probe, request, 7 + host_len);
+}
+
+static void warmup_probe_connected(warmup_probe * probe)
+{
+	static const guchar greeting[] = { 5, 1, 0 };
+
+	if (!warmup_probe_send(probe, greeting, sizeof(greeting))) {
+		warmup_probe_done(probe, FALSE);
+		return;
+	}
+
+	probe->step = WARMUP_STEP_METHOD;
+	probe->io_id = g_io_add_watch(probe->channel, G_IO_IN | G_IO_HUP | G_IO_ERR, warmup_probe_io, probe);
+}
+
+static gboolean warmup_probe_io(GIOChannel * source, GIOCondition condition, gpointer user_data)
+{
+	warmup_probe *probe = user_data;
+	ssize_t len;
+
+	if (probe->step == WARMUP_STEP_CONNECTING) {
+		int error = 0;
+		socklen_t error_len = sizeof(error);
+
+		probe->io_id = 0;
+
+		if (getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0)
+			warmup_probe_done(probe, FALSE);
+		else
+			warmup_probe_connected(probe);
+
+		return G_SOURCE_REMOVE;
+	}
+
+	len = recv(probe->fd, probe->buf + probe->buflen, sizeof(probe->buf) - probe->buflen, 0);
+	if (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return G_SOURCE_CONTINUE;
+	if (len <= 0) {
+		probe->io_id = 0;
+		warmup_probe_done(probe, FALSE);
+		return G_SOURCE_REMOVE;
+	}
+
+	probe->buflen += len;
+	if (probe->buflen < sizeof(probe->buf))
+		return G_SOURCE_CONTINUE;
+
+	probe->buflen = 0;
+
+	if (probe->step == WARMUP_STEP_METHOD) {
+		if (probe->buf[0] != 5 || probe->buf[1] != 0 || !warmup_probe_request(probe)) {
+			probe->io_id = 0;
+			warmup_probe_done(probe, FALSE);
+			return G_SOURCE_REMOVE;
+		}
+
+		probe->step = WARMUP_STEP_REPLY;
+		return G_SOURCE_CONTINUE;
+	}
+
+	/* Tor only replies once the exit connected, that is all we wanted */
+	probe->io_id = 0;
+	warmup_probe_done(probe, probe->buf[1] == 0);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean warmup_probe_timeout(gpointer user_data)
+{
+	warmup_probe *probe = user_data;
+
+	probe->timeout_id = 0;
+	warmup_probe_done(probe, FALSE);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void warmup_probe_start(tor_warmup * warmup, const char *target, gboolean cold)
+{
+	warmup_probe *probe;
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	const char *colon = strrchr(target, ':');
+	long port;
+	int ret;
+
+	port = colon ? strtol(colon + 1, NULL, 10) : 0;
+	if (colon == NULL || colon == target || colon - target > 255 || port <= 0 || port > 65535) {
+		TN_WARN("Invalid warm-up target %s, expected host:port", target);
+		return;
+	}
+
+	probe = g_new0(warmup_probe, 1);
+	probe->warmup = warmup;
+	probe->target = target;
+	probe->host = g_strndup(target, colon - target);
+	probe->port = port;
+	probe->cold = cold;
+	probe->start_time = g_get_monotonic_time();
+
+	probe->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (probe->fd < 0) {
+		TN_WARN("Could not create warm-up socket: %s", strerror(errno));
+		warmup_probe_free(probe);
+		return;
+	}
+	probe->channel = g_io_channel_unix_new(probe->fd);
+	warmup->probes = g_slist_prepend(warmup->probes, probe);
+	probe->timeout_id = g_timeout_add_seconds(TOR_WARMUP_PROBE_TIMEOUT, warmup_probe_timeout, probe);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(warmup->socks_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	ret = connect(probe->fd, (struct sockaddr *)&addr, sizeof(addr));
+	if ((ret == 0 || errno == EINPROGRESS)
+	    && getsockname(probe->fd, (struct sockaddr *)&addr, &addr_len) == 0)
+		probe->local_port = ntohs(addr.sin_port);
+
+	if (ret == 0) {
+		warmup_probe_connected(probe);
+	} else if (errno == EINPROGRESS) {
+		probe->step = WARMUP_STEP_CONNECTING;
+		probe->io_id = g_io_add_watch(probe->channel, G_IO_OUT | G_IO_HUP | G_IO_ERR, warmup_probe_io, probe);
+	} else {
+		warmup_probe_done(probe, FALSE);
+	}
+}
+
+static gboolean warmup_in_flight(tor_warmup * warmup, const char *target)
+{
+	GSList *l;
+
+	for (l = warmup->probes; l; l = l->next) {
+		warmup_probe *probe = l->data;
+
+		if (probe->target == target)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gboolean warmup_refresh(gpointer user_data)
+{
+	tor_warmup *warmup = user_data;
+	int i;
+
+	for (i = 0; warmup->targets[i] != NULL; i++) {
+		if (!warmup_in_flight(warmup, warmup->targets[i]))
+			warmup_probe_start(warmup, warmup->targets[i], FALSE);
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+tor_warmup *tor_warmup_new(int socks_port, gchar ** targets, guint refresh_s, tor_warmup_stats * stats)
+{
+	tor_warmup *warmup;
+	int i;
+
+	if (targets == NULL || targets[0] == NULL)
+		return NULL;
+
+	warmup = g_new0(tor_warmup, 1);
+	warmup->socks_port = socks_port;
+	warmup->targets = g_strdupv(targets);
+	warmup->stats = stats;
+	warmup->refresh_s = refresh_s;
+
+	for (i = 0; warmup->targets[i] != NULL; i++)
+		warmup_probe_start(warmup, warmup->targets[i], TRUE);
+
+	if (refresh_s > 0)
+		warmup->refresh_id = g_timeout_add_seconds(refresh_s, warmup_refresh, warmup);
+
+	return warmup;
+}
+
+/* No refreshes while paused, they would keep a dormant Tor awake */
+void tor_warmup_set_paused(tor_warmup * warmup, gboolean paused)
+{
+	if (warmup == NULL || warmup->refresh_s == 0)
+		return;
+
+	if (paused && warmup->refresh_id) {
+		g_source_remove(warmup->refresh_id);
+		warmup->refresh_id = 0;
+	} else if (!paused && !warmup->refresh_id) {
+		warmup->refresh_id = g_timeout_add_seconds(warmup->refresh_s, warmup_refresh, warmup);
+	}
+}
+
+/* Whether a stream from local port came from one of our connections */
+gboolean tor_warmup_owns_port(tor_warmup * warmup, guint16 port)
+{
+	GSList *l;
+
+	if (warmup == NULL || port == 0)
+		return FALSE;
+
+	for (l = warmup->probes; l; l = l->next) {
+		warmup_probe *probe = l->data;
+
+		if (probe->local_port == port)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+void tor_warmup_free(tor_warmup * warmup)
+{
+	if (warmup == NULL)
+		return;
+
+	if (warmup->refresh_id)
+		g_source_remove(warmup->refresh_id);
+
+	g_slist_free_full(warmup->probes, (GDestroyNotify) warmup_probe_free);
+	g_strfreev(warmup->targets);
+	g_free(warmup);
+}
@@ -0,0 +1,52 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __TOR_WARMUP_H
+#define __TOR_WARMUP_H
+#include <glib.h>
+
+/* Builds exit circuits ahead of the first real request.
+ *
+ * Once Tor is bootstrapped, a SOCKS connection is opened through it to every
+ * host:port of the warm-up profile and closed as soon as Tor reports the
+ * stream as established, which leaves a circuit to an exit allowing that port
+ * for the streams that follow. The first connection to a target pays for
+ * building the circuit (cold), a second one right after it shows what a
+ * request costs once warmed up (warm). Optionally the targets are connected
+ * to again every refresh_s seconds, counted as warm too. */
+typedef struct _tor_warmup tor_warmup;
+
+/* Time from connecting to the SOCKS port to Tor's reply, in ms */
+struct _tor_warmup_stats {
+	guint cold_count;
+	guint64 cold_total_ms;
+	guint warm_count;
+	guint64 warm_total_ms;
+	guint failures;
+};
+typedef struct _tor_warmup_stats tor_warmup_stats;
+
+tor_warmup *tor_warmup_new(int socks_port, gchar ** targets, guint refresh_s, tor_warmup_stats * stats);
+void tor_warmup_free(tor_warmup * warmup);
+void tor_warmup_set_paused(tor_warmup * warmup, gboolean paused);
+gboolean tor_warmup_owns_port(tor_warmup * warmup, guint16 port);
+
+#endif
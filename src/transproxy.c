@@ -0,0 +1,304 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <pwd.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <glib.h>
+#include <nftables/libnftables.h>
+
+#include "icd/support/icd_log.h"
+
+#include "libicd_tor.h"
+#include "transproxy.h"
+
+/* All our rules live in this table, so they leave other rules alone and can
+ * be removed as a whole */
+#define TRANSPROXY_TABLE "inet icd_tor"
+
+/* Tor's VirtualAddrNetworkIPv4 */
+#define TRANSPROXY_VIRT_ADDR "10.192.0.0/10"
+
+static uid_t tor_uid;
+
+/* Whether the table is (or will be, once queued jobs ran) loaded, so enabling
+ * only needs to update the elements */
+static gboolean table_loaded;
+
+/* Traffic of this uid is let through, so it must never be root */
+static gboolean transproxy_tor_uid(uid_t * uid)
+{
+	if (tor_uid == 0) {
+		struct passwd *pw = getpwnam(TOR_USER);
+
+		if (pw == NULL || pw->pw_uid == 0) {
+			TN_WARN("No usable user %s to exempt", TOR_USER);
+			return FALSE;
+		}
+
+		tor_uid = pw->pw_uid;
+	}
+
+	*uid = tor_uid;
+	return TRUE;
+}
+
+static gchar *transproxy_ruleset(uid_t uid, gint trans_port, gint dns_port)
+{
+	return g_strdup_printf(
+		/* Replace the table if it is there, all in the same batch */
+		"add table " TRANSPROXY_TABLE "\n"
+		"delete table " TRANSPROXY_TABLE "\n"
+		"\n"
+		"table " TRANSPROXY_TABLE " {\n"
+		"    map ports {\n"
+		"        type inet_proto : inet_service\n"
+		"        elements = { tcp : %d, udp : %d }\n"
+		"    }\n"
+		"\n"
+		"    set tor_uid {\n"
+		"        type uid\n"
+		"        elements = { %u }\n"
+		"    }\n"
+		"\n"
+		"    set unrouteables {\n"
+		"        type ipv4_addr\n"
+		"        flags interval\n"
+		"        elements = { 127.0.0.0/8, 10.0.0.0/8, 172.16.0.0/12, 192.168.0.0/16,\n"
+		"                     0.0.0.0/8, 100.64.0.0/10, 169.254.0.0/16, 192.0.0.0/24,\n"
+		"                     192.0.2.0/24, 192.88.99.0/24, 198.18.0.0/15, 198.51.100.0/24,\n"
+		"                     203.0.113.0/24, 224.0.0.0/4, 240.0.0.0/4 }\n"
+		"    }\n"
+		"\n"
+		"    set private {\n"
+		"        type ipv4_addr\n"
+		"        flags interval\n"
+		"        elements = { 10.0.0.0/8, 172.16.0.0/12, 192.168.0.0/16, 127.0.0.0/8 }\n"
+		"    }\n"
+		"\n"
+		"    chain nat_output {\n"
+		"        type nat hook output priority -100; policy accept;\n"
+		"        meta mark %u return\n"
+		"        ip daddr " TRANSPROXY_VIRT_ADDR " meta l4proto tcp redirect to :meta l4proto map @ports\n"
+		"        ip daddr 127.0.0.1 udp dport 53 redirect to :meta l4proto map @ports\n"
+		"        meta skuid @tor_uid return\n"
+		"        oifname \"lo\" return\n"
+		"        ip daddr @unrouteables return\n"
+		"        meta l4proto tcp redirect to :meta l4proto map @ports\n"
+		"    }\n"
+		"\n"
+		"    chain input {\n"
+		"        type filter hook input priority 0; policy drop;\n"
+		"        meta l4proto tcp tcp dport 22 ct state new accept\n"
+		"        ct state established accept\n"
+		"        iifname \"lo\" accept\n"
+		"        ip saddr @private accept\n"
+		"    }\n"
+		"\n"
+		"    chain forward {\n"
+		"        type filter hook forward priority 0; policy drop;\n"
+		"    }\n"
+		"\n"
+		"    chain output {\n"
+		"        type filter hook output priority 0; policy drop;\n"
+		"        ct state established accept\n"
+		"        meta l4proto tcp meta skuid @tor_uid ct state new accept\n"
+		"        meta l4proto tcp meta mark %u ct state new accept\n"
+		"        oifname \"lo\" accept\n"
+		"        ip daddr @private accept\n"
+		"    }\n"
+		"}\n",
+		trans_port, dns_port, (unsigned int)uid, TRANSPROXY_BYPASS_MARK, TRANSPROXY_BYPASS_MARK);
+}
+
+/* Switching configurations only changes where traffic is redirected to */
+static gchar *transproxy_elements(uid_t uid, gint trans_port, gint dns_port)
+{
+	return g_strdup_printf(
+		"flush map " TRANSPROXY_TABLE " ports\n"
+		"add element " TRANSPROXY_TABLE " ports { tcp : %d, udp : %d }\n"
+		"flush set " TRANSPROXY_TABLE " tor_uid\n"
+		"add element " TRANSPROXY_TABLE " tor_uid { %u }\n",
+		trans_port, dns_port, (unsigned int)uid);
+}
+
+/* Runs a ruleset as one batch */
+static int transproxy_run(const char *ruleset)
+{
+	struct nft_ctx *nft;
+	int ret;
+
+	nft = nft_ctx_new(NFT_CTX_DEFAULT);
+	if (nft == NULL) {
+		TN_WARN("Could not create nftables context");
+		return 1;
+	}
+	nft_ctx_buffer_output(nft);
+	nft_ctx_buffer_error(nft);
+
+	ret = nft_run_cmd_from_buffer(nft, ruleset);
+
+	if (ret != 0) {
+		TN_WARN("nftables rejected transproxy rules: %s", nft_ctx_get_error_buffer(nft));
+		ret = 1;
+	}
+
+	nft_ctx_free(nft);
+
+	return ret;
+}
+
+struct _transproxy_job {
+	/* NULL fails right away */
+	gchar *ruleset;
+	int result;
+
+	/* Main loop side only */
+	gboolean cancelled;
+	transproxy_done_fn done_cb;
+	gpointer user_data;
+};
+
+/* One worker, so jobs are applied in the order they are queued */
+static GThreadPool *pool;
+static GSList *pending_jobs;
+
+static void transproxy_job_free(transproxy_job * job)
+{
+	g_free(job->ruleset);
+	g_free(job);
+}
+
+static gboolean transproxy_job_done(gpointer user_data)
+{
+	transproxy_job *job = user_data;
+
+	pending_jobs = g_slist_remove(pending_jobs, job);
+
+	/* We no longer know what is loaded */
+	if (job->result != 0)
+		table_loaded = FALSE;
+
+	if (!job->cancelled && job->done_cb)
+		job->done_cb(job->result, job->user_data);
+
+	transproxy_job_free(job);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void transproxy_worker(gpointer data, gpointer user_data)
+{
+	transproxy_job *job = data;
+
+	job->result = transproxy_run(job->ruleset);
+
+	g_idle_add(transproxy_job_done, job);
+}
+
+static transproxy_job *transproxy_queue(gchar * ruleset, transproxy_done_fn done_cb, gpointer user_data)
+{
+	transproxy_job *job = g_new0(transproxy_job, 1);
+	GError *error = NULL;
+
+	job->ruleset = ruleset;
+	job->result = 1;
+	job->done_cb = done_cb;
+	job->user_data = user_data;
+
+	pending_jobs = g_slist_prepend(pending_jobs, job);
+
+	if (ruleset == NULL)
+		goto fail;
+
+	if (pool == NULL) {
+		pool = g_thread_pool_new(transproxy_worker, NULL, 1, FALSE, &error);
+		if (pool == NULL) {
+			TN_WARN("Could not create transproxy thread: %s", error->message);
+			g_clear_error(&error);
+			goto fail;
+		}
+	}
+
+	g_thread_pool_push(pool, job, NULL);
+
+	return job;
+
+ fail:
+	/* Report back from the main loop all the same */
+	g_idle_add(transproxy_job_done, job);
+	return job;
+}
+
+transproxy_job *transproxy_enable(const char *config_name, transproxy_done_fn done_cb, gpointer user_data)
+{
+	const tor_config *config = config_get(config_name);
+	gchar *ruleset = NULL;
+	uid_t uid;
+
+	if (config == NULL || config->trans_port == 0 || config->dns_port == 0)
+		TN_WARN("Configuration %s has no trans-port or dns-port", config_name);
+	else if (transproxy_tor_uid(&uid) && table_loaded)
+		ruleset = transproxy_elements(uid, config->trans_port, config->dns_port);
+	else if (transproxy_tor_uid(&uid))
+		ruleset = transproxy_ruleset(uid, config->trans_port, config->dns_port);
+
+	if (ruleset)
+		table_loaded = TRUE;
+
+	return transproxy_queue(ruleset, done_cb, user_data);
+}
+
+void transproxy_disable(void)
+{
+	table_loaded = FALSE;
+
+	/* Adding first makes deleting work when there is no table */
+	transproxy_queue(g_strdup("add table " TRANSPROXY_TABLE "\n"
+				  "delete table " TRANSPROXY_TABLE "\n"), NULL, NULL);
+}
+
+void transproxy_job_cancel(transproxy_job * job)
+{
+	if (job)
+		job->cancelled = TRUE;
+}
+
+void transproxy_shutdown(void)
+{
+	GSList *l;
+
+	/* Let queued jobs finish, so the rules end up as requested */
+	if (pool) {
+		g_thread_pool_free(pool, FALSE, TRUE);
+		pool = NULL;
+	}
+
+	for (l = pending_jobs; l; l = l->next) {
+		g_source_remove_by_user_data(l->data);
+		transproxy_job_free(l->data);
+	}
+	g_slist_free(pending_jobs);
+	pending_jobs = NULL;
+
+	tor_uid = 0;
+}
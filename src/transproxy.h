@@ -0,0 +1,51 @@
+/*
+ * This file is part of libicd-tor
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __TRANSPROXY_H
+#define __TRANSPROXY_H
+#include <glib.h>
+
+/* Transparent proxying of all traffic through Tor, using nftables.
+ *
+ * The rules live in their own "inet icd_tor" table and are committed through
+ * libnftables as a single batch, so they are either applied as a whole or not
+ * at all. Once the table is loaded, switching configurations only updates the
+ * ports map, and disabling deletes the table. This happens in a worker thread,
+ * in the order the requests were made, so ICd does not block on it. */
+typedef struct _transproxy_job transproxy_job;
+
+/* SO_MARK of ICd's own sockets that have to reach the network directly, like
+ * the bridge probes */
+#define TRANSPROXY_BYPASS_MARK 0x746f72
+
+/* Called from the main loop, result is 0 if the rules were applied */
+typedef void (*transproxy_done_fn)(int result, gpointer user_data);
+
+transproxy_job *transproxy_enable(const char *config_name, transproxy_done_fn done_cb, gpointer user_data);
+void transproxy_disable(void);
+
+/* The job still runs, but done_cb will not be called */
+void transproxy_job_cancel(transproxy_job * job);
+
+/* Waits for queued jobs, call before unloading */
+void transproxy_shutdown(void);
+
+#endif